@@ -0,0 +1,23 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+// Static variables
+static int next_cpu = 0;
+
+// Pin thread to the next online core, wrapping around when they run out
+void Affinity_pin(pthread_t thread, const char *name) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) % (num_cpus > 0 ? num_cpus : 1);
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+        printf("<DEBUG> Failed to pin %s thread to CPU %d\n", name, cpu);
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <pthread.h>
+
+// Prototypes
+void Affinity_pin(pthread_t thread, const char *name);
+
+#endif
@@ -0,0 +1,300 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "channel.h"
+#include "history.h"
+#include "network.h"
+#include "options.h"
+#include "sanitize.h"
+#include "stats.h"
+
+// A received line as shown: "[#name] " and the sanitized text
+#define LINE_LENGTH (CHANNEL_NAME_LENGTH + 2 + SANITIZE_MAX_OUTPUT(BUFFER_LENGTH) + 1)
+
+typedef struct Channel_s Channel;
+struct Channel_s {
+    char name[CHANNEL_NAME_LENGTH];
+    uint32_t id;
+    Message_ring backlog;   // Unread messages
+    uint64_t received;
+    uint64_t sent;
+};
+
+// Static variables
+static pthread_mutex_t channel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CHANNEL_SHOW_FN show_fn = NULL;
+
+// Guarded by channel_mutex, except that receive workers read the table
+static Channel channels[CHANNEL_MAX] = {[0] = {.name = CHANNEL_DEFAULT}};
+static int num_channels = 1;
+static int current = 0;                         // Index into channels
+static uint32_t table_ids[CHANNEL_TABLE_SIZE];  // 0 if the slot is empty
+static uint8_t table_index[CHANNEL_TABLE_SIZE]; // Into channels, written before the slot's ID
+
+// Allocate a channel's backlog, or exit if out of memory
+static void init_backlog(Channel *channel) {
+    if (Message_ring_init(&channel->backlog, CHANNEL_BACKLOG) < 0) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void Channel_start(CHANNEL_SHOW_FN show) {
+    show_fn = show;
+    init_backlog(&channels[0]);
+}
+
+// Free the unread messages of every channel. Call once the ui threads are
+// joined: one may have been cancelled with channel_mutex held.
+void Channel_stop() {
+    for (int i = 0; i < num_channels; i++) {
+        Message_ring_destroy(&channels[i].backlog);
+    }
+}
+
+// Lower-case name into canonical. Returns false if it is not a valid channel name.
+static bool canonical_name(const char *name, char *canonical) {
+    size_t length = strlen(name);
+
+    if (length < 2 || length > CHANNEL_NAME_LENGTH - 1 || name[0] != '#') {
+        return false;
+    }
+
+    canonical[0] = '#';
+
+    for (size_t i = 1; i < length; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') {
+            return false;
+        }
+
+        canonical[i] = tolower((unsigned char)name[i]);
+    }
+
+    canonical[length] = '\0';
+
+    return true;
+}
+
+// FNV-1a of the canonical name; 0 is kept for the default channel
+static uint32_t name_id(const char *canonical) {
+    uint32_t h = 2166136261u;
+
+    if (strcmp(canonical, CHANNEL_DEFAULT) == 0) {
+        return 0;
+    }
+
+    for (const char *c = canonical; *c != '\0'; c++) {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+
+    return h != 0 ? h : 1;
+}
+
+// Table slot holding id, or the empty slot where it would go
+static int find_slot(uint32_t id) {
+    int slot = id & (CHANNEL_TABLE_SIZE - 1);
+
+    while (true) {
+        uint32_t found = __atomic_load_n(&table_ids[slot], __ATOMIC_ACQUIRE);
+
+        if (found == id || found == 0) {
+            return slot;
+        }
+
+        slot = (slot + 1) & (CHANNEL_TABLE_SIZE - 1);
+    }
+}
+
+// Index of channel id in channels, or -1 if it was never joined (call with channel_mutex held)
+static int find_channel(uint32_t id) {
+    if (id == 0) {
+        return 0;
+    }
+
+    int slot = find_slot(id);
+
+    return table_ids[slot] == id ? table_index[slot] : -1;
+}
+
+// Intern name, so that its messages are accepted from now on, and set *id to its
+// ID. Returns 0 on success, or -1 after saying why the name can't be used.
+int Channel_join(const char *name, uint32_t *id) {
+    char canonical[CHANNEL_NAME_LENGTH];
+    int result = 0;
+
+    if (Options_get()->wire_version == 0) {
+        printf("<CHANNEL> Channels need the packet header, which --wire-version 0 leaves out\n");
+        return -1;
+    }
+
+    if (!canonical_name(name, canonical)) {
+        printf("<CHANNEL> A channel name is '#' and 1 to %d letters, digits, '-' or '_'\n", CHANNEL_NAME_LENGTH - 2);
+        return -1;
+    }
+
+    *id = name_id(canonical);
+
+    pthread_mutex_lock(&channel_mutex);
+    {
+        int index = find_channel(*id);
+
+        if (index >= 0 && strcmp(channels[index].name, canonical) != 0) {
+            printf("<CHANNEL> %s has the same ID as %s, pick another name\n", canonical, channels[index].name);
+            result = -1;
+        } else if (index < 0 && num_channels == CHANNEL_MAX) {
+            printf("<CHANNEL> Can't join more than %d channels\n", CHANNEL_MAX);
+            result = -1;
+        } else if (index < 0) {
+            Channel *channel = &channels[num_channels];
+            int slot = find_slot(*id);
+
+            memset(channel, 0, sizeof(Channel));
+            strcpy(channel->name, canonical);
+            channel->id = *id;
+            init_backlog(channel);
+            table_index[slot] = num_channels++;
+            __atomic_store_n(&table_ids[slot], *id, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&channel_mutex);
+
+    return result;
+}
+
+// True if datagrams for channel id are accepted. Takes no lock, for the receive workers.
+bool Channel_joined(uint32_t id) {
+    return id == 0 || __atomic_load_n(&table_ids[find_slot(id)], __ATOMIC_ACQUIRE) == id;
+}
+
+// Write message as shown in line: named channels are tagged with their name
+static void format_line(const Channel *channel, const Message *message, char *line) {
+    if (channel->id == 0) {
+        memcpy(line, message->text, message->length + 1);
+    } else {
+        snprintf(line, LINE_LENGTH, "[%s] %s", channel->name, message->text);
+    }
+}
+
+// Make the joined channel id the one typed lines go to, and show what it has unread
+void Channel_switch(uint32_t id) {
+    char line[LINE_LENGTH];
+
+    pthread_mutex_lock(&channel_mutex);
+    {
+        int index = find_channel(id);
+
+        if (index >= 0) {
+            Channel *channel = &channels[index];
+
+            current = index;
+            printf("<CHANNEL> Now in %s, %u unread\n", channel->name, Message_ring_count(&channel->backlog));
+            fflush(stdout);
+
+            // Shown with the lock held, so newer messages can't overtake them
+            for (Message **slot; (slot = Message_ring_front(&channel->backlog)) != NULL;) {
+                format_line(channel, *slot, line);
+                show_fn(line);
+                free(*slot);
+                Message_ring_pop(&channel->backlog);
+            }
+        }
+    }
+    pthread_mutex_unlock(&channel_mutex);
+}
+
+// ID of the channel typed lines go to
+uint32_t Channel_current() {
+    uint32_t id;
+
+    pthread_mutex_lock(&channel_mutex);
+    {
+        id = channels[current].id;
+    }
+    pthread_mutex_unlock(&channel_mutex);
+
+    return id;
+}
+
+// Log a received message and show it, or keep it unread if its channel is not
+// the current one. Takes ownership of message.
+void Channel_deliver(Message *message) {
+    char line[LINE_LENGTH];
+
+    pthread_mutex_lock(&channel_mutex);
+    {
+        int index = find_channel(message->channel);
+
+        if (index < 0) {
+            free(message);
+        } else {
+            Channel *channel = &channels[index];
+
+            channel->received++;
+            format_line(channel, message, line);
+            History_append(HISTORY_RECEIVED, line);
+
+            if (index == current) {
+                show_fn(line);
+                free(message);
+            } else {
+                Message **slot = Message_ring_push(&channel->backlog);
+
+                // Full: the oldest makes room
+                if (slot == NULL) {
+                    free(*Message_ring_front(&channel->backlog));
+                    Message_ring_pop(&channel->backlog);
+                    Stats_add(STATS_CHANNEL_BACKLOG_DROPPED, 1);
+                    slot = Message_ring_push(&channel->backlog);
+                }
+
+                *slot = message;
+            }
+        }
+    }
+    pthread_mutex_unlock(&channel_mutex);
+}
+
+// Log a message sent to channel id
+void Channel_sent(uint32_t id, const char *text) {
+    char line[LINE_LENGTH];
+
+    pthread_mutex_lock(&channel_mutex);
+    {
+        int index = find_channel(id);
+
+        if (index >= 0) {
+            channels[index].sent++;
+
+            if (id == 0) {
+                snprintf(line, sizeof(line), "%s", text);
+            } else {
+                snprintf(line, sizeof(line), "[%s] %s", channels[index].name, text);
+            }
+
+            History_append(HISTORY_SENT, line);
+        }
+    }
+    pthread_mutex_unlock(&channel_mutex);
+}
+
+// List the joined channels, marking the current one
+void Channel_print(FILE *out) {
+    pthread_mutex_lock(&channel_mutex);
+    {
+        fprintf(out, "Channels:\n");
+
+        for (int i = 0; i < num_channels; i++) {
+            const Channel *channel = &channels[i];
+
+            fprintf(out, "%c %-*s  id %08x  unread %u  received %llu  sent %llu\n",
+                i == current ? '*' : ' ', CHANNEL_NAME_LENGTH - 1, channel->name, channel->id, Message_ring_count(&channel->backlog),
+                (unsigned long long)channel->received, (unsigned long long)channel->sent);
+        }
+    }
+    pthread_mutex_unlock(&channel_mutex);
+}
@@ -0,0 +1,51 @@
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "message.h"
+
+/**
+ *  Named channels multiplexed over the one socket (/join, /msg).
+ *
+ *  A channel is named by '#' and up to CHANNEL_NAME_LENGTH - 2 letters, digits,
+ *  '-' or '_', compared without case. On the wire it is a 4-byte ID, the FNV-1a
+ *  hash of its lower-cased name, so both ends agree on it without any exchange.
+ *  The default channel, CHANNEL_DEFAULT, is ID 0 and is sent with no ID at all,
+ *  so a chat that never joins a channel looks exactly as before.
+ *
+ *  Joined channels are interned in a fixed open-addressing table keyed by ID.
+ *  Entries are only ever added, and each is published with a release store of
+ *  its ID, so receive workers look an ID up in O(1) without taking a lock and
+ *  drop datagrams for channels that were never joined.
+ *
+ *  Received messages for the current channel are shown at once. Those for any
+ *  other channel wait, unread, in that channel's queue of CHANNEL_BACKLOG
+ *  messages (the oldest is dropped when it is full) and are shown when it is
+ *  joined again. Logged messages carry their channel's name, so /search finds
+ *  them by channel too.
+ */
+
+#define CHANNEL_DEFAULT "#main"
+#define CHANNEL_NAME_LENGTH 32      // Including the '#' and the NUL
+#define CHANNEL_MAX 64              // Channels that can be joined, including the default
+#define CHANNEL_TABLE_SIZE 128      // Slots of the ID table, a power of two above CHANNEL_MAX
+#define CHANNEL_BACKLOG 128         // Unread messages kept per channel
+
+// Shows a received line (with its final newline) on the screen
+typedef void (*CHANNEL_SHOW_FN)(const char *line);
+
+// Prototypes
+void Channel_start(CHANNEL_SHOW_FN show);
+void Channel_stop();
+int Channel_join(const char *name, uint32_t *id);
+bool Channel_joined(uint32_t id);
+void Channel_switch(uint32_t id);
+uint32_t Channel_current();
+void Channel_deliver(Message *message);
+void Channel_sent(uint32_t id, const char *text);
+void Channel_print(FILE *out);
+
+#endif
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "channel.h"
+#include "command.h"
+#include "history.h"
+#include "link.h"
+#include "message.h"
+#include "network.h"
+#include "stats.h"
+#include "tui.h"
+
+typedef void (*COMMAND_FN)(const char *args);
+
+typedef struct Command_s Command;
+struct Command_s {
+    const char *name;
+    COMMAND_FN run;
+};
+
+// /search <terms>
+static void search_command(const char *args) {
+    if (*args == '\0') {
+        printf("Usage: /search <terms>\n");
+        return;
+    }
+
+    History_search(args, HISTORY_SEARCH_LIMIT, stdout);
+    fflush(stdout);
+}
+
+// /stats
+static void stats_command(const char *args) {
+    Stats_print(stdout);
+    Link_print(stdout);
+    fflush(stdout);
+}
+
+// /jump <line>
+static void jump_command(const char *args) {
+    char *end;
+    unsigned long long number = strtoull(args, &end, 10);
+
+    if (!Tui_enabled()) {
+        printf("/jump needs --tui\n");
+    } else if (*args == '\0' || *end != '\0') {
+        printf("Usage: /jump <line>\n");
+    } else if (!Tui_jump(number)) {
+        printf("Line %s is not in the scrollback\n", args);
+    }
+
+    fflush(stdout);
+}
+
+// /join [#channel]
+static void join_command(const char *args) {
+    uint32_t id;
+
+    if (*args == '\0') {
+        Channel_print(stdout);
+    } else if (Channel_join(args, &id) == 0) {
+        Channel_switch(id);
+    }
+
+    fflush(stdout);
+}
+
+// /msg <#channel> <text>
+static void msg_command(const char *args) {
+    char name[CHANNEL_NAME_LENGTH + 1];
+    char text[BUFFER_LENGTH];
+    size_t name_length = strcspn(args, " \t");
+    const char *start = args + name_length + strspn(args + name_length, " \t");
+    uint32_t id;
+
+    if (name_length == 0 || name_length > CHANNEL_NAME_LENGTH || *start == '\0') {
+        printf("Usage: /msg <#channel> <text>\n");
+        fflush(stdout);
+        return;
+    }
+
+    memcpy(name, args, name_length);
+    name[name_length] = '\0';
+    snprintf(text, sizeof(text), "%.*s\n", BUFFER_LENGTH - 2, start);
+
+    // Joining (without switching) lets the replies in
+    if (Channel_join(name, &id) < 0) {
+        fflush(stdout);
+        return;
+    }
+
+    bool queued = false;
+
+    Stats_lock(Network_get_send_mutex(), STATS_SEND_MUTEX_NS, "wait send_mutex");
+    {
+        if (Network_queue_send(LANE_CHAT, id, text, strlen(text)) < 0) {
+            printf("List is full! -> %s\n", text);
+            Stats_add(STATS_SEND_LIST_FULL, 1);
+        } else {
+            Network_notify_send();
+            pthread_cond_signal(Network_get_send_cond());
+            queued = true;
+        }
+    }
+    pthread_mutex_unlock(Network_get_send_mutex());
+
+    if (queued) {
+        Channel_sent(id, text);
+    }
+
+    fflush(stdout);
+}
+
+// /channels
+static void channels_command(const char *args) {
+    Channel_print(stdout);
+    fflush(stdout);
+}
+
+static const Command commands[] = {
+    {"search", search_command},
+    {"stats",  stats_command},
+    {"jump",   jump_command},
+    {"join",   join_command},
+    {"msg",    msg_command},
+    {"channels", channels_command},
+};
+
+// Runs line if it is a local command (such as /search). Returns true if the line
+// was handled and must not be sent; unknown commands are sent as ordinary messages.
+bool Command_handle(const char *line) {
+    if (line[0] != '/') {
+        return false;
+    }
+
+    const char *name = line + 1;
+    size_t name_length = strcspn(name, " \t\r\n");
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strlen(commands[i].name) == name_length && strncmp(commands[i].name, name, name_length) == 0) {
+            char args[BUFSIZ];
+            const char *start = name + name_length + strspn(name + name_length, " \t");
+
+            snprintf(args, sizeof(args), "%s", start);
+            args[strcspn(args, "\r\n")] = '\0';
+
+            commands[i].run(args);
+            return true;
+        }
+    }
+
+    return false;
+}
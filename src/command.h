@@ -0,0 +1,9 @@
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stdbool.h>
+
+// Prototypes
+bool Command_handle(const char *line);
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef _CONTAINER_H_
+#define _CONTAINER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Typed containers, generated per element type by macros. Header only.
+ *
+ *  Each macro expands to a struct named Name and static inline functions
+ *  named Name_<operation>. Elements of Type are stored inline in one array, so
+ *  there is no node or item pointer to chase. The hooks are expanded at every
+ *  call site, so the compiler inlines them rather than calling through a
+ *  function pointer as list.c does:
+ *      FREE(slot)      release what the element in slot owns, when a container
+ *                      is destroyed or a map entry removed (CONTAINER_NO_FREE
+ *                      does nothing)
+ *      EQUAL(a, b)     true if the elements (or keys) a and b point to match
+ *      HASH(key)       a uint64_t hash of the key key points to
+ *
+ *  CONTAINER_RING(Name, Type, FREE)
+ *      FIFO with a fixed capacity, allocated once by Name_init. Used for the
+ *      queues between threads.
+ *  CONTAINER_DEQUE(Name, Type, FREE, EQUAL)
+ *      Double-ended queue in a ring buffer that doubles when it is full.
+ *  CONTAINER_MAP(Name, Key, Value, HASH, EQUAL, FREE)
+ *      Hash map with open addressing, linear probing and backward-shift
+ *      deletion, doubled when it passes 3/4 full. FREE applies to values.
+ *
+ *  The push and put functions return the new element's slot, to be filled in
+ *  place, or NULL if the container is full or out of memory. No container is
+ *  thread-safe; its user locks it.
+ */
+
+#define CONTAINER_NO_FREE(slot) ((void)(slot))
+
+// Bounded FIFO
+#define CONTAINER_RING(Name, Type, FREE)                                        \
+typedef struct Name##_s Name;                                                   \
+struct Name##_s {                                                               \
+    Type *slots;                                                                \
+    uint32_t mask;          /* Slots, a power of two, minus one */              \
+    uint32_t capacity;                                                          \
+    uint32_t head;          /* Oldest element, counting every element ever */   \
+    uint32_t tail;          /* Where the next one goes */                       \
+};                                                                              \
+                                                                                \
+/* Allocate room for capacity elements. Returns 0, or -1 if out of memory. */   \
+static inline int Name##_init(Name *ring, uint32_t capacity) {                  \
+    uint32_t size = 1;                                                          \
+                                                                                \
+    while (size < capacity) {                                                   \
+        size *= 2;                                                              \
+    }                                                                           \
+                                                                                \
+    ring->slots = malloc(size * sizeof(Type));                                  \
+    ring->mask = size - 1;                                                      \
+    ring->capacity = capacity;                                                  \
+    ring->head = ring->tail = 0;                                                \
+                                                                                \
+    return ring->slots == NULL ? -1 : 0;                                        \
+}                                                                               \
+                                                                                \
+/* Free the elements still queued, then the ring */                            \
+static inline void Name##_destroy(Name *ring) {                                 \
+    for (uint32_t i = ring->head; i != ring->tail; i++) {                       \
+        FREE(&ring->slots[i & ring->mask]);                                     \
+    }                                                                           \
+                                                                                \
+    free(ring->slots);                                                          \
+    ring->slots = NULL;                                                         \
+    ring->head = ring->tail = 0;                                                \
+}                                                                               \
+                                                                                \
+static inline uint32_t Name##_count(const Name *ring) {                         \
+    return ring->tail - ring->head;                                             \
+}                                                                               \
+                                                                                \
+/* Slot for a new newest element, or NULL if the ring is full */               \
+static inline Type *Name##_push(Name *ring) {                                   \
+    if (ring->tail - ring->head == ring->capacity) {                            \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    return &ring->slots[ring->tail++ & ring->mask];                             \
+}                                                                               \
+                                                                                \
+/* Oldest element, or NULL if the ring is empty */                             \
+static inline Type *Name##_front(Name *ring) {                                  \
+    return ring->head == ring->tail ? NULL : &ring->slots[ring->head & ring->mask]; \
+}                                                                               \
+                                                                                \
+/* Drop the oldest element without freeing it: the caller has taken it */      \
+static inline void Name##_pop(Name *ring) {                                     \
+    ring->head++;                                                               \
+}
+
+// Growable double-ended queue
+#define CONTAINER_DEQUE(Name, Type, FREE, EQUAL)                                \
+typedef struct Name##_s Name;                                                   \
+struct Name##_s {                                                               \
+    Type *slots;            /* NULL until the first push */                     \
+    uint32_t size;          /* Slots, 0 or a power of two */                    \
+    uint32_t head;          /* Front element, wrapping modulo size */           \
+    uint32_t tail;          /* One past the back element */                     \
+};                                                                              \
+                                                                                \
+/* An empty deque; it allocates on the first push */                           \
+static inline void Name##_init(Name *deque) {                                   \
+    memset(deque, 0, sizeof(Name));                                             \
+}                                                                               \
+                                                                                \
+static inline void Name##_destroy(Name *deque) {                                \
+    for (uint32_t i = deque->head; i != deque->tail; i++) {                     \
+        FREE(&deque->slots[i & (deque->size - 1)]);                             \
+    }                                                                           \
+                                                                                \
+    free(deque->slots);                                                         \
+    memset(deque, 0, sizeof(Name));                                             \
+}                                                                               \
+                                                                                \
+static inline uint32_t Name##_count(const Name *deque) {                        \
+    return deque->tail - deque->head;                                           \
+}                                                                               \
+                                                                                \
+/* Element i, counting from the front (i < count) */                           \
+static inline Type *Name##_at(Name *deque, uint32_t i) {                        \
+    return &deque->slots[(deque->head + i) & (deque->size - 1)];                \
+}                                                                               \
+                                                                                \
+/* Double the slots, unwrapping the elements to the start. Returns false if */  \
+/* out of memory. */                                                            \
+static inline bool Name##_grow(Name *deque) {                                   \
+    uint32_t count = deque->tail - deque->head;                                 \
+    uint32_t size = deque->size == 0 ? 8 : deque->size * 2;                     \
+    Type *slots = malloc(size * sizeof(Type));                                  \
+                                                                                \
+    if (slots == NULL) {                                                        \
+        return false;                                                           \
+    }                                                                           \
+                                                                                \
+    for (uint32_t i = 0; i < count; i++) {                                      \
+        slots[i] = *Name##_at(deque, i);                                        \
+    }                                                                           \
+                                                                                \
+    free(deque->slots);                                                         \
+    deque->slots = slots;                                                       \
+    deque->size = size;                                                         \
+    deque->head = 0;                                                            \
+    deque->tail = count;                                                        \
+                                                                                \
+    return true;                                                                \
+}                                                                               \
+                                                                                \
+/* Slot for a new back element, or NULL if out of memory */                    \
+static inline Type *Name##_push_back(Name *deque) {                             \
+    if (deque->tail - deque->head == deque->size && !Name##_grow(deque)) {      \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    return &deque->slots[deque->tail++ & (deque->size - 1)];                    \
+}                                                                               \
+                                                                                \
+/* Slot for a new front element, or NULL if out of memory */                   \
+static inline Type *Name##_push_front(Name *deque) {                            \
+    if (deque->tail - deque->head == deque->size && !Name##_grow(deque)) {      \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    return &deque->slots[--deque->head & (deque->size - 1)];                    \
+}                                                                               \
+                                                                                \
+/* Front or back element, or NULL if the deque is empty */                     \
+static inline Type *Name##_front(Name *deque) {                                 \
+    return deque->head == deque->tail ? NULL : Name##_at(deque, 0);             \
+}                                                                               \
+                                                                                \
+static inline Type *Name##_back(Name *deque) {                                  \
+    return deque->head == deque->tail ? NULL : Name##_at(deque, deque->tail - deque->head - 1); \
+}                                                                               \
+                                                                                \
+/* Drop the front or back element without freeing it (the deque must not be */  \
+/* empty) */                                                                    \
+static inline void Name##_pop_front(Name *deque) {                              \
+    deque->head++;                                                              \
+}                                                                               \
+                                                                                \
+static inline void Name##_pop_back(Name *deque) {                               \
+    deque->tail--;                                                              \
+}                                                                               \
+                                                                                \
+/* First element, from the front, that EQUALs key, or NULL */                  \
+static inline Type *Name##_find(Name *deque, const Type *key) {                 \
+    for (uint32_t i = deque->head; i != deque->tail; i++) {                     \
+        Type *slot = &deque->slots[i & (deque->size - 1)];                      \
+                                                                                \
+        if (EQUAL(slot, key)) {                                                 \
+            return slot;                                                        \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    return NULL;                                                                \
+}
+
+// Hash map
+#define CONTAINER_MAP(Name, Key, Value, HASH, EQUAL, FREE)                      \
+typedef struct Name##_entry_s Name##_entry;                                     \
+struct Name##_entry_s {                                                         \
+    Key key;                                                                    \
+    Value value;                                                                \
+    bool used;                                                                  \
+};                                                                              \
+                                                                                \
+typedef struct Name##_s Name;                                                   \
+struct Name##_s {                                                               \
+    Name##_entry *entries;  /* NULL until the first put */                      \
+    uint32_t size;          /* Entries, 0 or a power of two */                  \
+    uint32_t count;                                                             \
+};                                                                              \
+                                                                                \
+/* An empty map; it allocates on the first put */                              \
+static inline void Name##_init(Name *map) {                                     \
+    memset(map, 0, sizeof(Name));                                               \
+}                                                                               \
+                                                                                \
+static inline void Name##_destroy(Name *map) {                                  \
+    for (uint32_t i = 0; i < map->size; i++) {                                  \
+        if (map->entries[i].used) {                                             \
+            FREE(&map->entries[i].value);                                       \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    free(map->entries);                                                         \
+    memset(map, 0, sizeof(Name));                                               \
+}                                                                               \
+                                                                                \
+static inline uint32_t Name##_count(const Name *map) {                          \
+    return map->count;                                                          \
+}                                                                               \
+                                                                                \
+/* Entry holding key, or the free entry where it would go (size > 0) */         \
+static inline Name##_entry *Name##_probe(Name *map, const Key *key) {           \
+    uint32_t i = (uint32_t)HASH(key) & (map->size - 1);                         \
+                                                                                \
+    while (map->entries[i].used && !EQUAL(&map->entries[i].key, key)) {         \
+        i = (i + 1) & (map->size - 1);                                          \
+    }                                                                           \
+                                                                                \
+    return &map->entries[i];                                                    \
+}                                                                               \
+                                                                                \
+/* Value of key, or NULL if it is not in the map */                            \
+static inline Value *Name##_get(Name *map, const Key *key) {                    \
+    if (map->size == 0) {                                                       \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    Name##_entry *entry = Name##_probe(map, key);                               \
+                                                                                \
+    return entry->used ? &entry->value : NULL;                                  \
+}                                                                               \
+                                                                                \
+/* Double the entries and rehash. Returns false if out of memory. */           \
+static inline bool Name##_grow(Name *map) {                                     \
+    Name bigger = {NULL, map->size == 0 ? 16 : map->size * 2, map->count};      \
+                                                                                \
+    if ((bigger.entries = calloc(bigger.size, sizeof(Name##_entry))) == NULL) { \
+        return false;                                                           \
+    }                                                                           \
+                                                                                \
+    for (uint32_t i = 0; i < map->size; i++) {                                  \
+        if (map->entries[i].used) {                                             \
+            *Name##_probe(&bigger, &map->entries[i].key) = map->entries[i];     \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    free(map->entries);                                                         \
+    *map = bigger;                                                              \
+                                                                                \
+    return true;                                                                \
+}                                                                               \
+                                                                                \
+/* Value of key, added if it is not in the map yet (*added tells which, and */  \
+/* a new value is for the caller to fill). Returns NULL if out of memory. */    \
+static inline Value *Name##_put(Name *map, const Key *key, bool *added) {       \
+    if ((map->count + 1) * 4 > map->size * 3 && !Name##_grow(map)) {            \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    Name##_entry *entry = Name##_probe(map, key);                               \
+                                                                                \
+    *added = !entry->used;                                                      \
+                                                                                \
+    if (*added) {                                                               \
+        entry->key = *key;                                                      \
+        entry->used = true;                                                     \
+        map->count++;                                                           \
+    }                                                                           \
+                                                                                \
+    return &entry->value;                                                       \
+}                                                                               \
+                                                                                \
+/* Remove key, freeing its value, and move later entries of its probe run */   \
+/* back so that no tombstone is left. Returns false if key was not there. */    \
+static inline bool Name##_remove(Name *map, const Key *key) {                   \
+    if (map->size == 0) {                                                       \
+        return false;                                                           \
+    }                                                                           \
+                                                                                \
+    uint32_t mask = map->size - 1;                                              \
+    uint32_t hole = Name##_probe(map, key) - map->entries;                      \
+                                                                                \
+    if (!map->entries[hole].used) {                                             \
+        return false;                                                           \
+    }                                                                           \
+                                                                                \
+    FREE(&map->entries[hole].value);                                            \
+                                                                                \
+    for (uint32_t i = (hole + 1) & mask; map->entries[i].used; i = (i + 1) & mask) { \
+        uint32_t home = (uint32_t)HASH(&map->entries[i].key) & mask;            \
+                                                                                \
+        /* Move the entry unless its home lies after the hole, up to i */       \
+        if (((i - home) & mask) >= ((i - hole) & mask)) {                       \
+            map->entries[hole] = map->entries[i];                               \
+            hole = i;                                                           \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    map->entries[hole].used = false;                                            \
+    map->count--;                                                               \
+                                                                                \
+    return true;                                                                \
+}
+
+#endif
@@ -0,0 +1,759 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRYPTO_X86
+#endif
+
+#include "crypto.h"
+
+#define CHACHA_BLOCK_LENGTH 64
+
+// One poly key block plus the blocks covering the longest message
+#define CRYPTO_MAX_BLOCKS (1 + (CRYPTO_MAX_LENGTH + CHACHA_BLOCK_LENGTH - 1) / CHACHA_BLOCK_LENGTH)
+
+// A single ChaCha20 block to generate
+typedef struct Block_job_s Block_job;
+struct Block_job_s {
+    uint32_t counter;
+    uint32_t nonce[3];
+    uint8_t *out;
+};
+
+typedef void (*BLOCKS_FN)(const uint32_t key[8], const Block_job *jobs, int count);
+
+typedef struct Kernel_s Kernel;
+struct Kernel_s {
+    const char *name;
+    BLOCKS_FN blocks;
+    bool (*supported)();
+};
+
+typedef struct Poly1305_s Poly1305;
+struct Poly1305_s {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    uint8_t buffer[16];
+    size_t leftover;
+};
+
+static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+// Static variables
+static uint32_t key_words[8];
+static bool enabled = false;
+static const Kernel *kernel = NULL;
+
+static uint32_t load32_le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32_le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void store64_le(uint8_t *p, uint64_t v) {
+    store32_le(p, (uint32_t)v);
+    store32_le(p + 4, (uint32_t)(v >> 32));
+}
+
+/*
+ * ChaCha20 kernels
+ */
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static void blocks_scalar(const uint32_t key[8], const Block_job *jobs, int count) {
+    for (int j = 0; j < count; j++) {
+        uint32_t s[16];
+        uint32_t x[16];
+
+        memcpy(s, sigma, sizeof(sigma));
+        memcpy(s + 4, key, 8 * sizeof(uint32_t));
+        s[12] = jobs[j].counter;
+        memcpy(s + 13, jobs[j].nonce, 3 * sizeof(uint32_t));
+        memcpy(x, s, sizeof(s));
+
+        for (int i = 0; i < 10; i++) {
+            QUARTER_ROUND(x[0], x[4], x[8],  x[12]);
+            QUARTER_ROUND(x[1], x[5], x[9],  x[13]);
+            QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+            QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+            QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+            QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+            QUARTER_ROUND(x[2], x[7], x[8],  x[13]);
+            QUARTER_ROUND(x[3], x[4], x[9],  x[14]);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            store32_le(jobs[j].out + 4 * i, x[i] + s[i]);
+        }
+    }
+}
+
+static bool always_supported() {
+    return true;
+}
+
+#ifdef CRYPTO_X86
+
+// The SIMD kernels keep one block per lane: vector i holds word i of every block,
+// so blocks with different counters and nonces (different messages) share a pass.
+
+#define ROTL128(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+#define QUARTER_ROUND128(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 16); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 12); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 8); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 7);
+
+__attribute__((target("sse2")))
+static void blocks4_sse2(const uint32_t key[8], const Block_job *jobs) {
+    __m128i s[16];
+    __m128i x[16];
+
+    for (int i = 0; i < 4; i++) {
+        s[i] = _mm_set1_epi32((int)sigma[i]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        s[4 + i] = _mm_set1_epi32((int)key[i]);
+    }
+
+    s[12] = _mm_setr_epi32((int)jobs[0].counter, (int)jobs[1].counter, (int)jobs[2].counter, (int)jobs[3].counter);
+
+    for (int i = 0; i < 3; i++) {
+        s[13 + i] = _mm_setr_epi32((int)jobs[0].nonce[i], (int)jobs[1].nonce[i], (int)jobs[2].nonce[i], (int)jobs[3].nonce[i]);
+    }
+
+    memcpy(x, s, sizeof(s));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND128(x[0], x[4], x[8],  x[12]);
+        QUARTER_ROUND128(x[1], x[5], x[9],  x[13]);
+        QUARTER_ROUND128(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND128(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND128(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND128(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND128(x[2], x[7], x[8],  x[13]);
+        QUARTER_ROUND128(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm_add_epi32(x[i], s[i]);
+    }
+
+    // Transpose each group of four words back into per-block order
+    for (int g = 0; g < 4; g++) {
+        __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+
+        _mm_storeu_si128((__m128i *)(jobs[0].out + 16 * g), _mm_unpacklo_epi64(t0, t1));
+        _mm_storeu_si128((__m128i *)(jobs[1].out + 16 * g), _mm_unpackhi_epi64(t0, t1));
+        _mm_storeu_si128((__m128i *)(jobs[2].out + 16 * g), _mm_unpacklo_epi64(t2, t3));
+        _mm_storeu_si128((__m128i *)(jobs[3].out + 16 * g), _mm_unpackhi_epi64(t2, t3));
+    }
+}
+
+static void blocks_sse2(const uint32_t key[8], const Block_job *jobs, int count) {
+    int j = 0;
+
+    for (; j + 4 <= count; j += 4) {
+        blocks4_sse2(key, jobs + j);
+    }
+
+    blocks_scalar(key, jobs + j, count - j);
+}
+
+static bool sse2_supported() {
+    return __builtin_cpu_supports("sse2");
+}
+
+#define ROTL256(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define QUARTER_ROUND256(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 7);
+
+__attribute__((target("avx2")))
+static void blocks8_avx2(const uint32_t key[8], const Block_job *jobs) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    __m256i s[16];
+    __m256i x[16];
+
+    for (int i = 0; i < 4; i++) {
+        s[i] = _mm256_set1_epi32((int)sigma[i]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        s[4 + i] = _mm256_set1_epi32((int)key[i]);
+    }
+
+    s[12] = _mm256_setr_epi32((int)jobs[0].counter, (int)jobs[1].counter, (int)jobs[2].counter, (int)jobs[3].counter,
+                              (int)jobs[4].counter, (int)jobs[5].counter, (int)jobs[6].counter, (int)jobs[7].counter);
+
+    for (int i = 0; i < 3; i++) {
+        s[13 + i] = _mm256_setr_epi32((int)jobs[0].nonce[i], (int)jobs[1].nonce[i], (int)jobs[2].nonce[i], (int)jobs[3].nonce[i],
+                                      (int)jobs[4].nonce[i], (int)jobs[5].nonce[i], (int)jobs[6].nonce[i], (int)jobs[7].nonce[i]);
+    }
+
+    memcpy(x, s, sizeof(s));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND256(x[0], x[4], x[8],  x[12]);
+        QUARTER_ROUND256(x[1], x[5], x[9],  x[13]);
+        QUARTER_ROUND256(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND256(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND256(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND256(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND256(x[2], x[7], x[8],  x[13]);
+        QUARTER_ROUND256(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm256_add_epi32(x[i], s[i]);
+    }
+
+    // Same transpose as SSE2 within each 128-bit half: the low half holds blocks
+    // 0-3 and the high half holds blocks 4-7
+    for (int g = 0; g < 4; g++) {
+        __m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i r[4] = {
+            _mm256_unpacklo_epi64(t0, t1),
+            _mm256_unpackhi_epi64(t0, t1),
+            _mm256_unpacklo_epi64(t2, t3),
+            _mm256_unpackhi_epi64(t2, t3)
+        };
+
+        for (int j = 0; j < 4; j++) {
+            _mm_storeu_si128((__m128i *)(jobs[j].out + 16 * g), _mm256_castsi256_si128(r[j]));
+            _mm_storeu_si128((__m128i *)(jobs[4 + j].out + 16 * g), _mm256_extracti128_si256(r[j], 1));
+        }
+    }
+}
+
+static void blocks_avx2(const uint32_t key[8], const Block_job *jobs, int count) {
+    int j = 0;
+
+    for (; j + 8 <= count; j += 8) {
+        blocks8_avx2(key, jobs + j);
+    }
+
+    blocks_sse2(key, jobs + j, count - j);
+}
+
+static bool avx2_supported() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+// Kernels in order of preference
+static const Kernel kernels[] = {
+#ifdef CRYPTO_X86
+    {"avx2", blocks_avx2, avx2_supported},
+    {"sse2", blocks_sse2, sse2_supported},
+#endif
+    {"scalar", blocks_scalar, always_supported},
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/*
+ * Poly1305 (26-bit limbs)
+ */
+
+static void poly1305_init(Poly1305 *st, const uint8_t key[32]) {
+    st->r[0] = (load32_le(key + 0)) & 0x3ffffff;
+    st->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+
+    memset(st->h, 0, sizeof(st->h));
+
+    for (int i = 0; i < 4; i++) {
+        st->pad[i] = load32_le(key + 16 + 4 * i);
+    }
+
+    st->leftover = 0;
+}
+
+static void poly1305_blocks(Poly1305 *st, const uint8_t *m, size_t bytes, uint32_t hibit) {
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    while (bytes >= 16) {
+        h0 += (load32_le(m + 0)) & 0x3ffffff;
+        h1 += (load32_le(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(m + 12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+        uint32_t c;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+static void poly1305_update(Poly1305 *st, const uint8_t *m, size_t bytes) {
+    if (st->leftover) {
+        size_t want = 16 - st->leftover;
+
+        if (want > bytes) {
+            want = bytes;
+        }
+
+        memcpy(st->buffer + st->leftover, m, want);
+        st->leftover += want;
+        m += want;
+        bytes -= want;
+
+        if (st->leftover < 16) {
+            return;
+        }
+
+        poly1305_blocks(st, st->buffer, 16, 1 << 24);
+        st->leftover = 0;
+    }
+
+    size_t full = bytes & ~(size_t)15;
+
+    if (full) {
+        poly1305_blocks(st, m, full, 1 << 24);
+        m += full;
+        bytes -= full;
+    }
+
+    if (bytes) {
+        memcpy(st->buffer, m, bytes);
+        st->leftover = bytes;
+    }
+}
+
+// Pads the input so far to a multiple of 16 bytes with zeros (RFC 8439 section 2.8)
+static void poly1305_pad16(Poly1305 *st) {
+    static const uint8_t zeros[16];
+
+    if (st->leftover) {
+        poly1305_update(st, zeros, 16 - st->leftover);
+    }
+}
+
+static void poly1305_finish(Poly1305 *st, uint8_t mac[16]) {
+    if (st->leftover) {
+        st->buffer[st->leftover] = 1;
+        memset(st->buffer + st->leftover + 1, 0, 16 - st->leftover - 1);
+        poly1305_blocks(st, st->buffer, 16, 0);
+    }
+
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t c;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // Compute h - p and select it if it did not underflow
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1 << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f;
+    f = (uint64_t)h0 + st->pad[0]; h0 = (uint32_t)f;
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    store32_le(mac + 0, h0);
+    store32_le(mac + 4, h1);
+    store32_le(mac + 8, h2);
+    store32_le(mac + 12, h3);
+}
+
+// Tag over aad and ciphertext as laid out in RFC 8439 section 2.8
+static void compute_tag(const uint8_t poly_key[32], const Crypto_message *message, uint8_t tag[CRYPTO_TAG_LENGTH]) {
+    Poly1305 st;
+    uint8_t lengths[16];
+
+    poly1305_init(&st, poly_key);
+    poly1305_update(&st, message->aad, message->aad_length);
+    poly1305_pad16(&st);
+    poly1305_update(&st, message->data, message->length);
+    poly1305_pad16(&st);
+
+    store64_le(lengths, message->aad_length);
+    store64_le(lengths + 8, message->length);
+    poly1305_update(&st, lengths, sizeof(lengths));
+    poly1305_finish(&st, tag);
+}
+
+static bool tags_equal(const uint8_t *a, const uint8_t *b) {
+    uint8_t diff = 0;
+
+    for (int i = 0; i < CRYPTO_TAG_LENGTH; i++) {
+        diff |= a[i] ^ b[i];
+    }
+
+    return diff == 0;
+}
+
+static void xor_keystream(uint8_t *data, size_t length, const uint8_t *keystream) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] ^= keystream[i];
+    }
+}
+
+// Seals or opens up to CRYPTO_MAX_BATCH messages with one kernel pass
+static void process_batch(const Kernel *k, const uint32_t key[8], Crypto_message *messages, int count, bool seal) {
+    static __thread uint8_t keystream[CRYPTO_MAX_BATCH * CRYPTO_MAX_BLOCKS][CHACHA_BLOCK_LENGTH];
+    Block_job jobs[CRYPTO_MAX_BATCH * CRYPTO_MAX_BLOCKS];
+    int first_block[CRYPTO_MAX_BATCH];
+    int num_jobs = 0;
+
+    assert(count <= CRYPTO_MAX_BATCH);
+
+    // Block 0 of each message keys Poly1305, blocks 1.. encrypt the data
+    for (int i = 0; i < count; i++) {
+        assert(messages[i].length <= CRYPTO_MAX_LENGTH);
+
+        int blocks = 1 + (int)((messages[i].length + CHACHA_BLOCK_LENGTH - 1) / CHACHA_BLOCK_LENGTH);
+        first_block[i] = num_jobs;
+
+        for (int b = 0; b < blocks; b++) {
+            jobs[num_jobs].counter = (uint32_t)b;
+            jobs[num_jobs].nonce[0] = load32_le(messages[i].nonce);
+            jobs[num_jobs].nonce[1] = load32_le(messages[i].nonce + 4);
+            jobs[num_jobs].nonce[2] = load32_le(messages[i].nonce + 8);
+            jobs[num_jobs].out = keystream[num_jobs];
+            num_jobs++;
+        }
+    }
+
+    k->blocks(key, jobs, num_jobs);
+
+    for (int i = 0; i < count; i++) {
+        Crypto_message *message = &messages[i];
+        const uint8_t *poly_key = keystream[first_block[i]];
+        const uint8_t *data_keystream = keystream[first_block[i] + 1];
+
+        if (seal) {
+            xor_keystream(message->data, message->length, data_keystream);
+            compute_tag(poly_key, message, message->tag);
+            message->ok = true;
+        } else {
+            uint8_t tag[CRYPTO_TAG_LENGTH];
+
+            compute_tag(poly_key, message, tag);
+            message->ok = tags_equal(tag, message->tag);
+
+            if (message->ok) {
+                xor_keystream(message->data, message->length, data_keystream);
+            }
+        }
+    }
+}
+
+static void process(const Kernel *k, const uint32_t key[8], Crypto_message *messages, int count, bool seal) {
+    for (int i = 0; i < count; i += CRYPTO_MAX_BATCH) {
+        int n = count - i < CRYPTO_MAX_BATCH ? count - i : CRYPTO_MAX_BATCH;
+        process_batch(k, key, messages + i, n, seal);
+    }
+}
+
+/*
+ * Test vectors
+ */
+
+// RFC 8439 section 2.5.2
+static const uint8_t poly_test_key[32] = {
+    0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+    0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b,
+};
+static const char poly_test_message[] = "Cryptographic Forum Research Group";
+static const uint8_t poly_test_tag[16] = {
+    0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6, 0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9,
+};
+
+// RFC 8439 section 2.8.2 (key 80..9f)
+static const char aead_test_plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you "
+    "only one tip for the future, sunscreen would be it.";
+static const uint8_t aead_test_nonce[12] = {
+    0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+};
+static const uint8_t aead_test_aad[12] = {
+    0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+};
+static const uint8_t aead_test_ciphertext[114] = {
+    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+    0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+    0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+    0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+    0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+    0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+    0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+    0x61, 0x16,
+};
+static const uint8_t aead_test_tag[16] = {
+    0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91,
+};
+
+// Same key, 200 bytes of (i * 7) mod 256 under a different nonce, so that a batch
+// mixing both vectors catches blocks written to the wrong lane
+static const uint8_t batch_test_nonce[12] = {
+    0xa1, 0xb2, 0xc3, 0xd4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07,
+};
+static const char batch_test_aad[] = "t-chat";
+static const uint8_t batch_test_ciphertext[200] = {
+    0xaa, 0xe2, 0xd6, 0x53, 0x40, 0xab, 0x27, 0x5e, 0x28, 0x66, 0xa1, 0xc9, 0xab, 0x5d, 0x9d, 0xf0,
+    0x29, 0xc3, 0x77, 0xe8, 0x58, 0x1e, 0x57, 0xb4, 0x54, 0xca, 0xb2, 0x69, 0x7b, 0x8d, 0x40, 0xcf,
+    0x23, 0x17, 0xda, 0x78, 0x9d, 0x0f, 0xb9, 0xdb, 0xe7, 0x85, 0x90, 0x0c, 0x80, 0x9c, 0x81, 0x18,
+    0x66, 0xb3, 0x6e, 0xa3, 0x86, 0xd9, 0x86, 0x7e, 0x3e, 0xf6, 0x0b, 0x8f, 0x47, 0x13, 0xaf, 0x2e,
+    0xce, 0xf7, 0xa4, 0x88, 0x44, 0xbf, 0xb4, 0xf5, 0x7f, 0x02, 0xae, 0xc5, 0xac, 0x7b, 0x6c, 0xdb,
+    0x3c, 0xca, 0xbd, 0xa9, 0x29, 0x6c, 0xb6, 0xc3, 0x89, 0x32, 0x15, 0xfe, 0xf1, 0xca, 0x42, 0xbd,
+    0x16, 0x29, 0x06, 0xb8, 0xd4, 0x7a, 0x1a, 0x03, 0x45, 0xbf, 0xa8, 0xe1, 0x43, 0x9c, 0xc1, 0xc8,
+    0x10, 0xbc, 0xa6, 0x91, 0x35, 0x82, 0xfe, 0xd2, 0x3b, 0xa6, 0x35, 0x62, 0x23, 0x32, 0x37, 0x53,
+    0x27, 0x66, 0x14, 0x3c, 0xfd, 0xb8, 0xd1, 0x0e, 0x7f, 0x7b, 0x18, 0x34, 0x3f, 0xe9, 0xb2, 0x89,
+    0xdd, 0x60, 0xe8, 0x36, 0xfb, 0x6e, 0xd9, 0x98, 0x9b, 0xc0, 0x48, 0x9b, 0x0e, 0x44, 0x7f, 0x20,
+    0xa8, 0xfb, 0xfc, 0x69, 0xfc, 0x52, 0x27, 0xe7, 0x45, 0x25, 0x7c, 0x0b, 0xaf, 0xb2, 0x76, 0xf2,
+    0x55, 0x94, 0xba, 0x80, 0x20, 0x21, 0xcf, 0x23, 0xee, 0x92, 0xf4, 0xe7, 0x45, 0xff, 0x87, 0x45,
+    0xf9, 0xd0, 0xec, 0x67, 0xe1, 0x97, 0x9d, 0x9f,
+};
+static const uint8_t batch_test_tag[16] = {
+    0xf5, 0x77, 0xcb, 0xe1, 0xf3, 0xff, 0x81, 0xf5, 0x22, 0x71, 0x0d, 0xa9, 0x78, 0xc2, 0xba, 0xe5,
+};
+
+#define SELF_TEST_BATCH 9
+
+// Seals and opens a batch alternating both AEAD vectors with kernel k
+static bool self_test_kernel(const Kernel *k) {
+    uint32_t key[8];
+    uint8_t key_bytes[32];
+    uint8_t data[SELF_TEST_BATCH][200];
+    uint8_t tags[SELF_TEST_BATCH][CRYPTO_TAG_LENGTH];
+    Crypto_message messages[SELF_TEST_BATCH];
+
+    for (int i = 0; i < 32; i++) {
+        key_bytes[i] = (uint8_t)(0x80 + i);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        key[i] = load32_le(key_bytes + 4 * i);
+    }
+
+    for (int i = 0; i < SELF_TEST_BATCH; i++) {
+        Crypto_message *message = &messages[i];
+
+        message->data = data[i];
+        message->tag = tags[i];
+
+        if (i % 2 == 0) {
+            memcpy(message->nonce, aead_test_nonce, CRYPTO_NONCE_LENGTH);
+            message->aad = aead_test_aad;
+            message->aad_length = sizeof(aead_test_aad);
+            message->length = sizeof(aead_test_ciphertext);
+            memcpy(data[i], aead_test_plaintext, message->length);
+        } else {
+            memcpy(message->nonce, batch_test_nonce, CRYPTO_NONCE_LENGTH);
+            message->aad = (const uint8_t *)batch_test_aad;
+            message->aad_length = strlen(batch_test_aad);
+            message->length = sizeof(batch_test_ciphertext);
+            for (size_t j = 0; j < message->length; j++) {
+                data[i][j] = (uint8_t)(j * 7);
+            }
+        }
+    }
+
+    process(k, key, messages, SELF_TEST_BATCH, true);
+
+    for (int i = 0; i < SELF_TEST_BATCH; i++) {
+        const uint8_t *ciphertext = i % 2 == 0 ? aead_test_ciphertext : batch_test_ciphertext;
+        const uint8_t *tag = i % 2 == 0 ? aead_test_tag : batch_test_tag;
+
+        if (memcmp(data[i], ciphertext, messages[i].length) != 0 || memcmp(tags[i], tag, CRYPTO_TAG_LENGTH) != 0) {
+            return false;
+        }
+    }
+
+    // Corrupt one message; only that one may fail to open
+    data[3][10] ^= 1;
+    process(k, key, messages, SELF_TEST_BATCH, false);
+
+    for (int i = 0; i < SELF_TEST_BATCH; i++) {
+        if (messages[i].ok != (i != 3)) {
+            return false;
+        }
+    }
+
+    return memcmp(data[0], aead_test_plaintext, sizeof(aead_test_ciphertext)) == 0;
+}
+
+static bool self_test_poly1305() {
+    Poly1305 st;
+    uint8_t tag[16];
+
+    poly1305_init(&st, poly_test_key);
+    poly1305_update(&st, (const uint8_t *)poly_test_message, strlen(poly_test_message));
+    poly1305_finish(&st, tag);
+
+    return memcmp(tag, poly_test_tag, sizeof(tag)) == 0;
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    c = tolower(c);
+
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// Load the pre-shared key and pick the fastest kernel that passes the test vectors
+void Crypto_load_key(const char *path) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        printf("<CRYPTO> Failed to open key file %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char hex[2 * CRYPTO_KEY_LENGTH + 2];
+    bool read_ok = fgets(hex, sizeof(hex), file) != NULL;
+    fclose(file);
+
+    uint8_t key_bytes[CRYPTO_KEY_LENGTH];
+    bool valid = read_ok && strcspn(hex, "\r\n") == 2 * CRYPTO_KEY_LENGTH;
+
+    for (int i = 0; valid && i < CRYPTO_KEY_LENGTH; i++) {
+        int high = hex_value(hex[2 * i]);
+        int low = hex_value(hex[2 * i + 1]);
+
+        valid = high >= 0 && low >= 0;
+        key_bytes[i] = (uint8_t)(high << 4 | low);
+    }
+
+    if (!valid) {
+        printf("<CRYPTO> Key file %s must contain 64 hex characters\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        key_words[i] = load32_le(key_bytes + 4 * i);
+    }
+
+    memset(key_bytes, 0, sizeof(key_bytes));
+
+    if (!self_test_poly1305()) {
+        printf("<CRYPTO> Poly1305 failed its test vector\n");
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef CRYPTO_X86
+    __builtin_cpu_init();
+#endif
+
+    for (size_t i = 0; i < NUM_KERNELS; i++) {
+        if (!kernels[i].supported()) {
+            continue;
+        }
+
+        if (!self_test_kernel(&kernels[i])) {
+            printf("<CRYPTO> %s kernel failed its test vectors\n", kernels[i].name);
+            exit(EXIT_FAILURE);
+        }
+
+        if (kernel == NULL) {
+            kernel = &kernels[i];
+        }
+    }
+
+    enabled = true;
+    printf("<CRYPTO> Pre-shared key loaded (%s kernel)\n", kernel->name);
+}
+
+// Returns true once a key has been loaded
+bool Crypto_enabled() {
+    return enabled;
+}
+
+// Name of the kernel in use
+const char *Crypto_kernel_name() {
+    return kernel ? kernel->name : "none";
+}
+
+// Encrypts each message in place and writes its tag
+void Crypto_seal_batch(Crypto_message *messages, int count) {
+    assert(enabled);
+    process(kernel, key_words, messages, count, true);
+}
+
+// Verifies and decrypts each message in place
+void Crypto_open_batch(Crypto_message *messages, int count) {
+    assert(enabled);
+    process(kernel, key_words, messages, count, false);
+}
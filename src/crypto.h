@@ -0,0 +1,55 @@
+#ifndef _CRYPTO_H_
+#define _CRYPTO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  ChaCha20-Poly1305 AEAD (RFC 8439) keyed with a pre-shared key.
+ *
+ *  Messages are sealed and opened in batches: the ChaCha20 blocks of every message
+ *  in a batch are generated together, so the SIMD kernels (SSE2 with 4 lanes, AVX2
+ *  with 8 lanes, chosen at runtime) stay busy even when each message is short.
+ */
+
+#define CRYPTO_KEY_LENGTH 32
+#define CRYPTO_NONCE_LENGTH 12
+#define CRYPTO_TAG_LENGTH 16
+
+// Largest message (in bytes) accepted by the batch functions
+#define CRYPTO_MAX_LENGTH 1024
+
+// Number of messages processed per kernel pass
+#define CRYPTO_MAX_BATCH 16
+
+typedef struct Crypto_message_s Crypto_message;
+struct Crypto_message_s {
+    uint8_t nonce[CRYPTO_NONCE_LENGTH];
+    const uint8_t *aad;        // Authenticated but not encrypted
+    size_t aad_length;
+    uint8_t *data;             // Encrypted or decrypted in place
+    size_t length;
+    uint8_t *tag;              // CRYPTO_TAG_LENGTH bytes
+    bool ok;                   // Set by Crypto_open_batch
+};
+
+// Reads a 32-byte key written as 64 hex characters from path, checks every
+// available kernel against the RFC 8439 test vectors, and enables encryption.
+// Exits on failure.
+void Crypto_load_key(const char *path);
+
+// Returns true once a key has been loaded.
+bool Crypto_enabled();
+
+// Name of the kernel in use ("scalar", "sse2" or "avx2").
+const char *Crypto_kernel_name();
+
+// Encrypts each message in place and writes its tag.
+void Crypto_seal_batch(Crypto_message *messages, int count);
+
+// Verifies each message's tag and decrypts it in place if it matches. Messages
+// whose tag does not match have ok set to false and are left untouched.
+void Crypto_open_batch(Crypto_message *messages, int count);
+
+#endif
@@ -0,0 +1,669 @@
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "history.h"
+#include "message.h"
+#include "network.h"
+#include "stats.h"
+#include "trace.h"
+
+// Messages taken from the receive queues per DAEMON_MESSAGES frame
+#define DAEMON_BATCH 64
+
+// Bytes of a DAEMON_MESSAGES entry before its text
+#define DAEMON_ENTRY_HEADER 29
+
+// How long the daemon keeps flushing to subscribers once the chat ends
+#define DAEMON_FLUSH_MS 1000
+
+typedef struct Client_s Client;
+struct Client_s {
+    int fd;
+    bool subscribed;
+    uint8_t *in;            // Partial frames read from the client
+    size_t in_length;
+    size_t submit_offset;   // Progress through a submit stalled on a full send queue (0 if none)
+    int submit_done;
+    uint8_t *out;           // Frames not yet written to the client
+    size_t out_length;
+    size_t out_capacity;
+    size_t out_partial;     // Unsent bytes of a frame at the front of out that was partly written (0 if none)
+    bool closing;           // Dropped once out is written; nothing more is read from it
+};
+
+// Static variables
+static pthread_t server_pthread;
+static pthread_t drain_pthread;
+static char *socket_path = NULL;
+static int listen_fd = -1;
+static int wake_fds[2] = {-1, -1};  // Written by the drain thread to wake the server thread
+
+static Client clients[DAEMON_MAX_CLIENTS];
+static int num_clients = 0;
+
+static pthread_mutex_t outbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *outbox = NULL;      // DAEMON_MESSAGES frames waiting for the server thread
+static size_t outbox_length = 0;
+static size_t outbox_capacity = 0;
+static bool peer_exited = false;    // Set once the peer's "!" is in the outbox (guarded by outbox_mutex)
+
+static void store16_be(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint16_t load16_be(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Make room for extra more bytes in a growable buffer
+static void reserve(uint8_t **buffer, size_t *capacity, size_t length, size_t extra) {
+    if (length + extra <= *capacity) {
+        return;
+    }
+
+    size_t new_capacity = *capacity ? *capacity : 4096;
+
+    while (new_capacity < length + extra) {
+        new_capacity *= 2;
+    }
+
+    uint8_t *new_buffer = realloc(*buffer, new_capacity);
+
+    if (new_buffer == NULL) {
+        printf("<DAEMON> Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+}
+
+// Append a DAEMON_MESSAGES entry for message to buffer
+static size_t encode_entry(uint8_t *p, const Message *message, size_t text_length) {
+    const struct sockaddr *sender = (const struct sockaddr *)&message->sender;
+
+    store32_be(p, (uint32_t)(message->time_ms >> 32));
+    store32_be(p + 4, (uint32_t)message->time_ms);
+    memset(p + 8, 0, 19);
+
+    if (message->sender_length > 0 && sender->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)sender;
+        p[8] = 4;
+        memcpy(p + 9, &in->sin_addr, 4);
+        memcpy(p + 25, &in->sin_port, 2);
+    } else if (message->sender_length > 0 && sender->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sender;
+        p[8] = 6;
+        memcpy(p + 9, &in6->sin6_addr, 16);
+        memcpy(p + 25, &in6->sin6_port, 2);
+    }
+
+    store16_be(p + 27, (uint16_t)text_length);
+    memcpy(p + DAEMON_ENTRY_HEADER, message->text, text_length);
+
+    return DAEMON_ENTRY_HEADER + text_length;
+}
+
+// Wake the server thread (the pipe being full means a wakeup is already pending)
+static void wake_server() {
+    if (write(wake_fds[1], "", 1) < 0 && errno != EAGAIN) {
+        printf("<DAEMON> Failed to wake server thread: %s\n", strerror(errno));
+    }
+}
+
+// Thread that moves received messages from the receive queues to the outbox
+static void *drain_run(void *unused) {
+    Message *batch[DAEMON_BATCH];
+    bool exiting = false;
+
+    Trace_thread("daemon drain");
+
+    while (!exiting) {
+        int count = 0;
+
+        Network_lock_received();
+        {
+            while (count < DAEMON_BATCH && Network_count_received() > 0) {
+                batch[count++] = Network_take_received();
+            }
+        }
+        pthread_mutex_unlock(Network_get_recv_mutex());
+
+        // Don't leak the batch if the chat ends while it is being encoded
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&outbox_mutex);
+        {
+            size_t frame_start = outbox_length;
+
+            reserve(&outbox, &outbox_capacity, outbox_length, 7);
+            outbox_length += 7;
+
+            for (int i = 0; i < count; i++) {
+                size_t text_length = batch[i]->length;
+
+                if (text_length > 0 && batch[i]->text[text_length - 1] == '\n') {
+                    text_length--;
+                }
+
+                reserve(&outbox, &outbox_capacity, outbox_length, DAEMON_ENTRY_HEADER + text_length);
+                outbox_length += encode_entry(outbox + outbox_length, batch[i], text_length);
+            }
+
+            store32_be(outbox + frame_start, outbox_length - frame_start - 4);
+            outbox[frame_start + 4] = DAEMON_MESSAGES;
+            store16_be(outbox + frame_start + 5, count);
+
+            for (int i = 0; i < count; i++) {
+                exiting = exiting || strcmp(batch[i]->text, "!\n") == 0;
+            }
+
+            peer_exited = exiting;
+        }
+        pthread_mutex_unlock(&outbox_mutex);
+
+        wake_server();
+
+        for (int i = 0; i < count; i++) {
+            if (strcmp(batch[i]->text, "!\n") != 0) {
+                History_append(HISTORY_RECEIVED, batch[i]->text);
+            }
+
+            free(batch[i]);
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+// Create the listening socket at path, replacing a stale one
+static void listen_at(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("<DAEMON> Socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(addr.sun_path, path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        printf("<DAEMON> Failed to create socket: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Replace a socket left behind by an earlier run, but never any other file
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+    || chmod(path, 0600) < 0
+    || listen(listen_fd, DAEMON_MAX_CLIENTS) < 0) {
+        printf("<DAEMON> Failed to listen on %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("<DAEMON> Listening on %s\n", path);
+}
+
+// Queue a frame for client
+static void client_send(Client *client, uint8_t type, const uint8_t *body, size_t length) {
+    reserve(&client->out, &client->out_capacity, client->out_length, 5 + length);
+    store32_be(client->out + client->out_length, 1 + length);
+    client->out[client->out_length + 4] = type;
+    memcpy(client->out + client->out_length + 5, body, length);
+    client->out_length += 5 + length;
+}
+
+// Write as much of the client's pending frames as the socket takes. Returns -1
+// if the client has gone away.
+static int client_flush(Client *client) {
+    size_t written = 0;
+
+    while (written < client->out_length) {
+        ssize_t bytes = send(client->fd, client->out + written, client->out_length - written, MSG_NOSIGNAL);
+
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            return -1;
+        }
+
+        written += bytes;
+    }
+
+    // Find where the write stopped: before, inside or after the frame it ends in
+    size_t end = client->out_partial;
+
+    while (end < written) {
+        end += 4 + load32_be(client->out + end);
+    }
+
+    client->out_partial = end - written;
+
+    memmove(client->out, client->out + written, client->out_length - written);
+    client->out_length -= written;
+
+    return 0;
+}
+
+// Disconnect the client at index i
+static void client_drop(int i) {
+    client_flush(&clients[i]);
+    close(clients[i].fd);
+    free(clients[i].in);
+    free(clients[i].out);
+
+    clients[i] = clients[--num_clients];
+}
+
+// Queue as much of a submit frame as the send queue takes. Returns false if the
+// send queue filled up before the end of the frame; sets *exiting on "!".
+static bool handle_submit(Client *client, const uint8_t *body, size_t length, bool *exiting) {
+    int count = load16_be(body + 1);
+    size_t offset = client->submit_offset ? client->submit_offset : 3;
+    size_t start = offset;
+    int done = client->submit_done;
+    bool full = false;
+
+    Stats_lock(Network_get_send_mutex(), STATS_SEND_MUTEX_NS, "wait send_mutex");
+    {
+        while (done < count && !*exiting) {
+            size_t text_length = load16_be(body + offset);
+            const char *text = (const char *)body + offset + 2;
+            char line[BUFFER_LENGTH];
+
+            memcpy(line, text, text_length);
+            line[text_length] = '\n';
+            line[text_length + 1] = '\0';
+
+            bool is_exit = strcmp(line, "!\n") == 0;
+
+            // A batch of several messages is bulk, so it cannot hold up other clients' typing
+            Network_lane lane = is_exit ? LANE_CONTROL : count > 1 ? LANE_BULK : LANE_CHAT;
+
+            if (Network_queue_send(lane, 0, line, text_length + 1) < 0) {
+                full = true;
+                break;
+            }
+
+            *exiting = is_exit;
+
+            offset += 2 + text_length;
+            done++;
+        }
+
+        if (done > client->submit_done) {
+            Network_notify_send();
+            pthread_cond_signal(Network_get_send_cond());
+        }
+    }
+    pthread_mutex_unlock(Network_get_send_mutex());
+
+    // Log what was queued, outside of the send mutex
+    for (size_t p = start; p < offset;) {
+        size_t text_length = load16_be(body + p);
+        char text[BUFFER_LENGTH];
+
+        memcpy(text, body + p + 2, text_length);
+        text[text_length] = '\0';
+
+        if (strcmp(text, "!") != 0) {
+            History_append(HISTORY_SENT, text);
+        }
+
+        p += 2 + text_length;
+    }
+
+    if (full) {
+        client->submit_offset = offset;
+        client->submit_done = done;
+        return false;
+    }
+
+    uint8_t ack[2];
+    store16_be(ack, count);
+    client_send(client, DAEMON_ACK, ack, sizeof(ack));
+
+    client->submit_offset = 0;
+    client->submit_done = 0;
+
+    return true;
+}
+
+// Check that a submit frame's messages fit inside it and inside a datagram
+static bool submit_valid(const uint8_t *body, size_t length) {
+    if (length < 3) {
+        return false;
+    }
+
+    int count = load16_be(body + 1);
+    size_t offset = 3;
+
+    for (int i = 0; i < count; i++) {
+        if (offset + 2 > length) {
+            return false;
+        }
+
+        size_t text_length = load16_be(body + offset);
+
+        // Room for the newline appended to every message
+        if (text_length > BUFFER_LENGTH - 2 || offset + 2 + text_length > length) {
+            return false;
+        }
+
+        offset += 2 + text_length;
+    }
+
+    return offset == length;
+}
+
+// Reply with an error and mark the client for dropping
+static int client_error(Client *client, const char *error) {
+    client_send(client, DAEMON_ERROR, (const uint8_t *)error, strlen(error));
+    return -1;
+}
+
+// Handle every complete frame read from the client. Returns -1 if the client
+// must be dropped, 1 if it is stalled on a full send queue, 0 otherwise.
+static int client_process(Client *client, bool *exiting) {
+    size_t consumed = 0;
+    int result = 0;
+
+    while (client->in_length - consumed >= 4 && !*exiting) {
+        const uint8_t *frame = client->in + consumed;
+        size_t length = load32_be(frame);
+        const uint8_t *body = frame + 4;
+
+        if (length == 0 || length > DAEMON_MAX_FRAME) {
+            result = client_error(client, "bad frame length");
+            break;
+        }
+
+        if (client->in_length - consumed < 4 + length) {
+            break;
+        }
+
+        if (body[0] == DAEMON_SUBMIT) {
+            if (client->submit_offset == 0 && !submit_valid(body, length)) {
+                result = client_error(client, "malformed submit");
+                break;
+            }
+
+            if (!handle_submit(client, body, length, exiting)) {
+                result = 1;
+                break;
+            }
+        } else if (body[0] == DAEMON_SUBSCRIBE) {
+            client->subscribed = true;
+        } else if (body[0] == DAEMON_UNSUBSCRIBE) {
+            client->subscribed = false;
+        } else {
+            result = client_error(client, "unknown frame type");
+            break;
+        }
+
+        consumed += 4 + length;
+    }
+
+    memmove(client->in, client->in + consumed, client->in_length - consumed);
+    client->in_length -= consumed;
+
+    return result;
+}
+
+// Read from the client. Returns -1 if it must be dropped.
+static int client_read(Client *client) {
+    size_t capacity = 4 + DAEMON_MAX_FRAME;
+    ssize_t bytes = recv(client->fd, client->in + client->in_length, capacity - client->in_length, 0);
+
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+        return -1;
+    }
+
+    if (bytes > 0) {
+        client->in_length += bytes;
+    }
+
+    return 0;
+}
+
+static void accept_client() {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (num_clients == DAEMON_MAX_CLIENTS) {
+        printf("<DAEMON> Too many clients, refusing connection\n");
+        close(fd);
+        return;
+    }
+
+    Client *client = &clients[num_clients];
+
+    memset(client, 0, sizeof(Client));
+    client->fd = fd;
+    client->in = malloc(4 + DAEMON_MAX_FRAME);
+
+    if (client->in == NULL) {
+        printf("<DAEMON> Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    num_clients++;
+}
+
+// Copy the outbox to every subscriber. Returns true once the peer has left.
+static bool fan_out() {
+    uint8_t drain[64];
+    bool exited;
+
+    while (read(wake_fds[0], drain, sizeof(drain)) > 0) {
+    }
+
+    pthread_mutex_lock(&outbox_mutex);
+    {
+        for (int i = 0; i < num_clients; i++) {
+            Client *client = &clients[i];
+
+            if (!client->subscribed || outbox_length == 0) {
+                continue;
+            }
+
+            // Whole unsent frames are dropped, the one being written is kept so
+            // that the error still starts on a frame boundary
+            if (client->out_length + outbox_length > DAEMON_MAX_BACKLOG) {
+                printf("<DAEMON> Dropping a client that stopped reading\n");
+                client->subscribed = false;
+                client->closing = true;
+                client->out_length = client->out_partial;
+                client_error(client, "too far behind");
+                continue;
+            }
+
+            reserve(&client->out, &client->out_capacity, client->out_length, outbox_length);
+            memcpy(client->out + client->out_length, outbox, outbox_length);
+            client->out_length += outbox_length;
+        }
+
+        outbox_length = 0;
+        exited = peer_exited;
+    }
+    pthread_mutex_unlock(&outbox_mutex);
+
+    return exited;
+}
+
+// Give subscribers up to DAEMON_FLUSH_MS to take their last frames
+static void flush_clients() {
+    for (int waited = 0; waited < DAEMON_FLUSH_MS; waited += 10) {
+        bool pending = false;
+
+        for (int i = 0; i < num_clients; i++) {
+            if (clients[i].out_length > 0 && client_flush(&clients[i]) == 0 && clients[i].out_length > 0) {
+                pending = true;
+            }
+        }
+
+        if (!pending) {
+            break;
+        }
+
+        usleep(10000);
+    }
+}
+
+// Thread serving the local clients
+static void *server_run(void *unused) {
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 2];
+    bool stalled[DAEMON_MAX_CLIENTS] = {false};
+    bool exiting = false;
+    bool peer_left = false;
+
+    Trace_thread("daemon server");
+
+    while (!exiting && !peer_left) {
+        bool any_stalled = false;
+
+        fds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = wake_fds[0], .events = POLLIN };
+
+        for (int i = 0; i < num_clients; i++) {
+            // A client stalled on a full send queue is not read until it can go on
+            fds[i + 2].fd = clients[i].fd;
+            fds[i + 2].events = (stalled[i] || clients[i].closing ? 0 : POLLIN) | (clients[i].out_length > 0 ? POLLOUT : 0);
+            fds[i + 2].revents = 0;
+            any_stalled = any_stalled || stalled[i];
+        }
+
+        int polled_clients = num_clients;
+
+        if (poll(fds, polled_clients + 2, any_stalled ? 1 : -1) < 0 && errno != EINTR) {
+            printf("<DAEMON> poll: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            peer_left = fan_out();
+        }
+
+        // Walk backwards so that dropping a client does not skip another
+        for (int i = polled_clients - 1; i >= 0; i--) {
+            Client *client = &clients[i];
+            int result = 0;
+
+            if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+                result = client_read(client);
+            }
+
+            if (result == 0 && (stalled[i] || (fds[i + 2].revents & POLLIN))) {
+                result = client_process(client, &exiting);
+                stalled[i] = result == 1;
+            }
+
+            if (result >= 0 && client->out_length > 0) {
+                result = client_flush(client);
+            }
+
+            if (client->closing && client->out_length == 0) {
+                result = -1;
+            }
+
+            if (result < 0) {
+                client_drop(i);
+                stalled[i] = stalled[num_clients];
+                stalled[num_clients] = false;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_client();
+        }
+    }
+
+    flush_clients();
+
+    // A local "!" ends the chat: stop the drain thread as the keyboard stops the screen
+    if (exiting && pthread_cancel(drain_pthread) != 0) {
+        printf("Error cancelling daemon drain thread.\n");
+    }
+
+    return NULL;
+}
+
+// Start serving clients on socket_path in place of the keyboard and screen threads
+void Daemon_start_chat(const char *path) {
+    socket_path = strdup(path);
+
+    if (socket_path == NULL || pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        printf("<DAEMON> Failed to set up: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    listen_at(path);
+
+    if (pthread_create(&drain_pthread, NULL, drain_run, NULL) != 0
+    || pthread_create(&server_pthread, NULL, server_run, NULL) != 0) {
+        printf("Error creating daemon threads. Exiting\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Helper function for joining threads
+void Daemon_join_threads() {
+    if (pthread_join(server_pthread, NULL) != 0 || pthread_join(drain_pthread, NULL) != 0) {
+        printf("Error joining daemon threads. Exiting\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Disconnect every client and remove the socket
+void Daemon_exit_chat() {
+    while (num_clients > 0) {
+        client_drop(num_clients - 1);
+    }
+
+    close(listen_fd);
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    unlink(socket_path);
+
+    free(socket_path);
+    free(outbox);
+    socket_path = NULL;
+    outbox = NULL;
+}
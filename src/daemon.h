@@ -0,0 +1,49 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+/**
+ *  Headless mode: a Unix domain socket server that stands in for the keyboard
+ *  and screen threads.
+ *
+ *  Every frame is a 4-byte big-endian body length followed by the body, whose
+ *  first byte is the frame type. Integers are big-endian and text is UTF-8
+ *  without a trailing newline or NUL.
+ *
+ *  Client to daemon:
+ *      DAEMON_SUBMIT       u16 count, then count times { u16 length, text }
+ *                          Queues every message for the peer ("!" ends the chat).
+ *                          While the send queue is full the daemon stops reading
+ *                          from the client, so a submit is never partly dropped.
+ *      DAEMON_SUBSCRIBE    Start receiving DAEMON_MESSAGES frames.
+ *      DAEMON_UNSUBSCRIBE  Stop receiving them.
+ *
+ *  Daemon to client:
+ *      DAEMON_ACK          u16 count
+ *                          Sent once every message of a submit has been queued.
+ *      DAEMON_MESSAGES     u16 count, then count times { u64 time (ms since the
+ *                          epoch), u8 family (4, 6 or 0 if unknown), u8[16] address,
+ *                          u16 port, u16 length, text }
+ *                          Messages received from the peer, in arrival order.
+ *      DAEMON_ERROR        text
+ *                          Sent before the daemon drops a misbehaving client, or a
+ *                          subscriber more than DAEMON_MAX_BACKLOG bytes behind
+ *                          (after the rest of any frame it was part way through).
+ */
+
+#define DAEMON_SUBMIT       0x01
+#define DAEMON_SUBSCRIBE    0x02
+#define DAEMON_UNSUBSCRIBE  0x03
+#define DAEMON_ACK          0x81
+#define DAEMON_MESSAGES     0x82
+#define DAEMON_ERROR        0x83
+
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_FRAME 65536              // Largest frame body either side may send
+#define DAEMON_MAX_BACKLOG (1024 * 1024)    // Unsent bytes after which a subscriber is sent DAEMON_ERROR and disconnected
+
+// Prototypes
+void Daemon_start_chat(const char *socket_path);
+void Daemon_join_threads();
+void Daemon_exit_chat();
+
+#endif
@@ -0,0 +1,181 @@
+#include <sys/random.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "stats.h"
+
+#define WINDOW_WORDS (DEDUP_WINDOW_SIZE / 64)
+
+// Create an empty filter with a fresh hash key. Returns NULL if out of memory.
+Dedup_bloom *Dedup_bloom_create() {
+    Dedup_bloom *bloom = aligned_alloc(64, sizeof(Dedup_bloom));
+
+    if (bloom == NULL) {
+        return NULL;
+    }
+
+    memset(bloom, 0, sizeof(Dedup_bloom));
+
+    if (getrandom(bloom->key, sizeof(bloom->key), 0) != sizeof(bloom->key)) {
+        printf("<DEBUG> Failed to read random duplicate filter key: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return bloom;
+}
+
+void Dedup_bloom_free(Dedup_bloom *bloom) {
+    free(bloom);
+}
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// Start following session from seq, forgetting the previous one
+static void window_reset(Dedup_window *window, uint32_t session, uint64_t seq) {
+    memset(window->bits, 0, sizeof(window->bits));
+    window->session = session;
+    window->strays = 0;
+    window->highest = seq;
+    window->bits[(seq / 64) % WINDOW_WORDS] = 1ULL << (seq % 64);
+    window->started = true;
+}
+
+// Look seq up in the peer's bitmap, recording it. Returns 1 if it is new, 0 if
+// it was seen, or -1 if the bitmap cannot tell.
+static int window_check(Dedup_window *window, uint32_t session, uint64_t seq) {
+    if (!window->started || (session != window->session && ++window->strays >= DEDUP_ADOPT)) {
+        window_reset(window, session, seq);
+        return 1;
+    }
+
+    if (session != window->session) {
+        return -1;
+    }
+
+    window->strays = 0;
+
+    if (seq > window->highest) {
+        // Forget the sequence numbers that slide out, one word at a time where possible
+        if (seq - window->highest >= DEDUP_WINDOW_SIZE) {
+            memset(window->bits, 0, sizeof(window->bits));
+        } else {
+            for (uint64_t s = window->highest + 1; s <= seq;) {
+                uint64_t *word = &window->bits[(s / 64) % WINDOW_WORDS];
+
+                if (s % 64 == 0 && seq - s >= 63) {
+                    *word = 0;
+                    s += 64;
+                } else {
+                    *word &= ~(1ULL << (s % 64));
+                    s++;
+                }
+            }
+        }
+
+        window->highest = seq;
+    } else if (window->highest - seq >= DEDUP_WINDOW_SIZE) {
+        return -1;
+    }
+
+    uint64_t *word = &window->bits[(seq / 64) % WINDOW_WORDS];
+    uint64_t bit = 1ULL << (seq % 64);
+
+    if (*word & bit) {
+        return 0;
+    }
+
+    *word |= bit;
+
+    return 1;
+}
+
+// Look the ID up in both generations, adding it to the current one. Returns
+// true if it was (probably) seen.
+static bool bloom_check(Dedup_bloom *bloom, uint32_t session, uint64_t seq) {
+    uint64_t h = mix(bloom->key[0] ^ seq ^ (bloom->key[1] + session) * 0x9e3779b97f4a7c15ULL);
+    uint64_t block = (h >> 48) % DEDUP_BLOOM_BLOCKS;
+    uint64_t masks[8];
+    uint64_t hits[2] = {0, 0};
+    uint64_t odds[2] = {1, 1};  // Chance a new ID matches each generation, in units of 64^-8
+
+    // The block from the top 16 bits of the hash, and one bit in each of its
+    // words from 6 bits each of the other 48
+    for (int i = 0; i < 8; i++) {
+        masks[i] = 1ULL << ((h >> (6 * i)) & 63);
+    }
+
+    for (int g = 0; g < 2; g++) {
+        const uint64_t *words = bloom->blocks[g][block];
+        const uint8_t *ones = bloom->ones[g][block];
+
+        for (int i = 0; i < 8; i++) {
+            hits[g] += (words[i] & masks[i]) != 0;
+            odds[g] *= ones[i];
+        }
+    }
+
+    bloom->checks++;
+    bloom->false_ppb += (uint64_t)((double)(odds[0] + odds[1]) * (1e9 / 281474976710656.0));
+
+    if (hits[0] == 8 || hits[1] == 8) {
+        return true;
+    }
+
+    uint64_t *words = bloom->blocks[bloom->current][block];
+    uint8_t *ones = bloom->ones[bloom->current][block];
+
+    for (int i = 0; i < 8; i++) {
+        ones[i] += (words[i] & masks[i]) == 0;
+        words[i] |= masks[i];
+    }
+
+    // Rotate: the older generation is emptied and becomes the current one
+    if (++bloom->added == DEDUP_BLOOM_CAPACITY) {
+        bloom->current ^= 1;
+        memset(bloom->blocks[bloom->current], 0, sizeof(bloom->blocks[0]));
+        memset(bloom->ones[bloom->current], 0, sizeof(bloom->ones[0]));
+        bloom->added = 0;
+    }
+
+    return false;
+}
+
+// Add the checks since the last call to the counters, once per batch rather
+// than once per datagram
+void Dedup_flush(Dedup_bloom *bloom) {
+    if (bloom->checks > 0) {
+        Stats_add(STATS_DEDUP_BLOOM_CHECKS, bloom->checks);
+        Stats_add(STATS_DEDUP_BLOOM_FALSE_PPB, bloom->false_ppb);
+        bloom->checks = 0;
+        bloom->false_ppb = 0;
+    }
+}
+
+// Record a chat datagram's ID from the peer that window belongs to. Returns
+// false if it is a duplicate and must be dropped.
+bool Dedup_check(Dedup_window *window, Dedup_bloom *bloom, uint32_t session, uint64_t seq) {
+    if (window_check(window, session, seq) == 0) {
+        Stats_add(STATS_RECV_DUPLICATES, 1);
+        return false;
+    }
+
+    if (bloom_check(bloom, session, seq)) {
+        Stats_add(STATS_RECV_BLOOM_DUPLICATES, 1);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ *  Duplicate suppression on the receive path.
+ *
+ *  A chat datagram is identified by its sender's session and sequence number.
+ *  Two filters with fixed memory look at that ID before the message is copied
+ *  or queued:
+ *
+ *  - Every peer (sender address) has a sliding bitmap over the last
+ *    DEDUP_WINDOW_SIZE sequence numbers of one session. It answers exactly, so
+ *    copies from the same address (retransmissions, a duplicating link) are
+ *    dropped with no false positives.
+ *
+ *  - Every receive worker has a rotating Bloom filter over the IDs of all the
+ *    chat datagrams it accepted, from any address. It catches copies that arrive
+ *    by another path, such as a relay, and IDs the bitmap cannot decide (another
+ *    session through the same relay, or a sequence number older than the window).
+ *    It is split into blocks of one cache line: an ID sets one bit in each of
+ *    the eight words of one block, so a check reads a single line. Two
+ *    generations are kept; once the current one holds DEDUP_BLOOM_CAPACITY IDs
+ *    the older one is cleared and takes its place, so an ID is remembered for at
+ *    least that many datagrams.
+ *
+ *  A Bloom filter can mistake a new ID for a seen one. For a new ID, the chance
+ *  is the product over the eight words of its block of the share of their bits
+ *  that are set. That is counted exactly as the filter fills, summed over every
+ *  check and reported by /stats as the expected false positive rate. Copies that come in through different
+ *  receive workers (--recv-workers, or shared memory and UDP) are not compared.
+ */
+
+#define DEDUP_WINDOW_SIZE 1024      // Sequence numbers each peer's bitmap covers, a multiple of 64
+#define DEDUP_ADOPT 64              // Datagrams in a row from another session after which a peer's bitmap follows it
+#define DEDUP_BLOOM_BLOCKS 512      // Cache-line blocks in each generation, a power of two
+#define DEDUP_BLOOM_CAPACITY 8192   // IDs per generation: 32 bits each, for a false positive rate near 1e-5
+
+typedef struct Dedup_window_s Dedup_window;
+struct Dedup_window_s {
+    uint32_t session;
+    uint32_t strays;        // Datagrams in a row from other sessions
+    uint64_t highest;       // Highest sequence number seen from session
+    uint64_t bits[DEDUP_WINDOW_SIZE / 64]; // Bit seq % DEDUP_WINDOW_SIZE set if seq was seen
+    bool started;
+};
+
+typedef struct Dedup_bloom_s Dedup_bloom;
+struct Dedup_bloom_s {
+    uint64_t blocks[2][DEDUP_BLOOM_BLOCKS][8] __attribute__((aligned(64)));
+    uint8_t ones[2][DEDUP_BLOOM_BLOCKS][8]; // Bits set in each word
+    uint64_t key[2];
+    uint32_t added;         // IDs added to the current generation
+    int current;
+    uint64_t checks;        // Not yet added to the counters
+    uint64_t false_ppb;     // Expected false positives of those checks, in billionths
+};
+
+// Prototypes
+Dedup_bloom *Dedup_bloom_create();
+void Dedup_bloom_free(Dedup_bloom *bloom);
+bool Dedup_check(Dedup_window *window, Dedup_bloom *bloom, uint32_t session, uint64_t seq);
+void Dedup_flush(Dedup_bloom *bloom);
+
+#endif
@@ -0,0 +1,264 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "history.h"
+#include "index.h"
+
+/**
+ *  Persisted chat log with an incrementally maintained search index.
+ *
+ *  The log is plain text, one message per line:
+ *      <unix time in ms> TAB <direction> TAB <text> NEWLINE
+ *  Messages are indexed by the byte offset of their line. The index is saved
+ *  next to the log as <log>.idx together with the log length it covers, so on
+ *  the next start only the tail of the log has to be indexed.
+ */
+
+#define HISTORY_LINE_LENGTH 1024
+
+// Static variables
+static int log_fd = -1;
+static char *log_path = NULL;
+static char *index_path = NULL;
+static uint64_t log_size = 0;
+static uint64_t saved_size = 0;
+static bool log_read_only = false;
+static Index *search_index = NULL;
+
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Indexes a single log line found at offset
+static void index_line(uint64_t offset, const char *line, size_t length) {
+    const char *direction = memchr(line, '\t', length);
+    const char *text = direction ? memchr(direction + 1, '\t', length - (direction + 1 - line)) : NULL;
+
+    if (text == NULL) {
+        return;
+    }
+
+    text++;
+
+    if (Index_add(search_index, offset, text, length - (text - line)) < 0) {
+        printf("<LOG>   Failed to index message at offset %llu\n", (unsigned long long)offset);
+    }
+}
+
+// Indexes every complete line of the log from log_size onwards
+static void catch_up() {
+    FILE *file = fopen(log_path, "rb");
+
+    if (file == NULL) {
+        printf("<LOG>   Failed to open %s: %s\n", log_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (fseeko(file, (off_t)log_size, SEEK_SET) != 0) {
+        printf("<LOG>   Failed to seek in %s: %s\n", log_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+
+    while ((line_length = getline(&line, &line_capacity, file)) > 0) {
+        // A partial last line is left for a later catch up
+        if (line[line_length - 1] != '\n') {
+            break;
+        }
+
+        index_line(log_size, line, line_length - 1);
+        log_size += line_length;
+    }
+
+    free(line);
+    fclose(file);
+}
+
+// Open the log at path, loading its index and indexing anything appended since
+void History_open(const char *path, bool read_only) {
+    struct stat st;
+
+    log_read_only = read_only;
+    log_fd = read_only ? open(path, O_RDONLY) : open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+
+    if (log_fd < 0 || fstat(log_fd, &st) < 0) {
+        printf("<LOG>   Failed to open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    size_t index_path_length = strlen(path) + sizeof(".idx");
+
+    log_path = strdup(path);
+    index_path = malloc(index_path_length);
+
+    if (log_path == NULL || index_path == NULL) {
+        printf("<LOG>   Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(index_path, index_path_length, "%s.idx", path);
+
+    search_index = Index_load(index_path, &log_size);
+
+    // Rebuild from scratch if there is no index or the log was truncated
+    if (search_index == NULL || log_size > (uint64_t)st.st_size) {
+        Index_free(search_index);
+        search_index = Index_create();
+        log_size = 0;
+
+        if (search_index == NULL) {
+            printf("<LOG>   Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    saved_size = log_size;
+    catch_up();
+}
+
+// Returns true if a log is open
+bool History_is_open() {
+    return log_fd >= 0;
+}
+
+// Append a message to the log and index it
+void History_append(char direction, const char *text) {
+    if (log_fd < 0) {
+        return;
+    }
+
+    assert(!log_read_only);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char line[HISTORY_LINE_LENGTH];
+    int prefix_length = snprintf(line, sizeof(line), "%lld\t%c\t",
+        (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000, direction);
+    size_t length = prefix_length;
+
+    // One line per message, so embedded line breaks become spaces
+    for (const char *c = text; *c != '\0' && length < sizeof(line) - 1; c++) {
+        line[length++] = (*c == '\n' || *c == '\r') ? ' ' : *c;
+    }
+
+    while (length > (size_t)prefix_length && line[length - 1] == ' ') {
+        length--;
+    }
+
+    line[length++] = '\n';
+
+    pthread_mutex_lock(&history_mutex);
+    {
+        if (write(log_fd, line, length) != (ssize_t)length) {
+            printf("<LOG>   Failed to write to %s: %s\n", log_path, strerror(errno));
+        } else {
+            index_line(log_size, line, length - 1);
+            log_size += length;
+        }
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+// Print the message found at offset
+static void print_message(uint64_t offset, FILE *out) {
+    char line[HISTORY_LINE_LENGTH];
+    ssize_t bytes = pread(log_fd, line, sizeof(line) - 1, (off_t)offset);
+
+    if (bytes <= 0) {
+        return;
+    }
+
+    line[bytes] = '\0';
+
+    char *end = strchr(line, '\n');
+    char *direction = strchr(line, '\t');
+
+    if (end == NULL || direction == NULL || direction > end || direction[1] == '\0') {
+        return;
+    }
+
+    *end = '\0';
+
+    time_t seconds = strtoll(line, NULL, 10) / 1000;
+    struct tm tm;
+    char time_str[32];
+
+    localtime_r(&seconds, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+
+    fprintf(out, "[%s] %s: %s\n", time_str, direction[1] == HISTORY_SENT ? "you" : "peer", direction + 3);
+}
+
+// Print the most recent messages matching every term of query
+void History_search(const char *query, int limit, FILE *out) {
+    if (log_fd < 0) {
+        fprintf(out, "Chat history is disabled. Start t-chat with --log <file> to enable it.\n");
+        return;
+    }
+
+    uint64_t *results = malloc(limit * sizeof(uint64_t));
+
+    if (results == NULL) {
+        fprintf(out, "Out of memory\n");
+        return;
+    }
+
+    pthread_mutex_lock(&history_mutex);
+    {
+        struct timespec start, end;
+        int total = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int found = Index_search(search_index, query, results, limit, &total);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (int i = 0; i < found; i++) {
+            print_message(results[i], out);
+        }
+
+        double elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        fprintf(out, "%d of %d matches (%.3f ms)\n", found, total, elapsed_ms);
+    }
+    pthread_mutex_unlock(&history_mutex);
+
+    free(results);
+}
+
+// Save the index if it is behind the log, then close the log
+void History_close() {
+    if (log_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&history_mutex);
+    {
+        if (log_size != saved_size && Index_save(search_index, index_path, log_size) < 0) {
+            printf("<LOG>   Failed to save index %s\n", index_path);
+        }
+
+        close(log_fd);
+        log_fd = -1;
+
+        Index_free(search_index);
+        search_index = NULL;
+
+        free(log_path);
+        free(index_path);
+        log_path = NULL;
+        index_path = NULL;
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Message directions as written to the log
+#define HISTORY_SENT '>'
+#define HISTORY_RECEIVED '<'
+
+// Default number of matches printed by a search
+#define HISTORY_SEARCH_LIMIT 20
+
+// Prototypes
+void History_open(const char *path, bool read_only);
+bool History_is_open();
+void History_append(char direction, const char *text);
+void History_search(const char *query, int limit, FILE *out);
+void History_close();
+
+#endif
@@ -0,0 +1,580 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "index.h"
+
+#define INDEX_MAGIC 0x58494354 // "TCIX"
+#define INDEX_VERSION 1
+#define INDEX_INITIAL_CAPACITY 1024
+
+typedef struct Skip_s Skip;
+struct Skip_s {
+    uint64_t base;     // Last offset before the block (delta base for its first posting)
+    uint32_t position; // Byte position of the block in data
+};
+
+typedef struct Posting_s Posting;
+struct Posting_s {
+    char *term;
+    uint8_t *data;     // Delta-encoded varint offsets
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t last;
+    Skip *skips;
+    uint32_t num_skips;
+    uint32_t skips_capacity;
+};
+
+struct Index_s {
+    Posting **table;   // Open addressing, NULL marks an empty slot
+    uint32_t capacity;
+    uint32_t size;
+};
+
+typedef struct Cursor_s Cursor;
+struct Cursor_s {
+    const Posting *posting;
+    uint32_t position;
+    uint32_t index;    // Number of postings decoded so far
+    uint64_t value;    // Last decoded offset
+};
+
+// FNV-1a hash of a term
+static uint32_t hash_term(const char *term, size_t length) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)term[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool is_token_char(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static char to_lower(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : (char)c;
+}
+
+// Reads the next token of text starting at *pos into token, returning its length (0 at end)
+static size_t next_token(const char *text, size_t length, size_t *pos, char *token) {
+    size_t i = *pos;
+    size_t token_length = 0;
+
+    while (i < length && !is_token_char(text[i])) {
+        i++;
+    }
+
+    while (i < length && is_token_char(text[i])) {
+        if (token_length < INDEX_MAX_TOKEN_LENGTH) {
+            token[token_length++] = to_lower(text[i]);
+        }
+        i++;
+    }
+
+    *pos = i;
+    return token_length;
+}
+
+// Finds the slot for term, which is either its posting or an empty slot
+static Posting **find_slot(Posting **table, uint32_t capacity, const char *term, size_t length) {
+    uint32_t mask = capacity - 1;
+    uint32_t slot = hash_term(term, length) & mask;
+
+    while (table[slot] != NULL) {
+        if (strlen(table[slot]->term) == length && memcmp(table[slot]->term, term, length) == 0) {
+            return &table[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return &table[slot];
+}
+
+static int grow_table(Index *index) {
+    uint32_t capacity = index->capacity * 2;
+    Posting **table = calloc(capacity, sizeof(Posting *));
+
+    if (table == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        Posting *posting = index->table[i];
+
+        if (posting != NULL) {
+            *find_slot(table, capacity, posting->term, strlen(posting->term)) = posting;
+        }
+    }
+
+    free(index->table);
+    index->table = table;
+    index->capacity = capacity;
+
+    return 0;
+}
+
+static Posting *lookup(Index *index, const char *term, size_t length) {
+    return *find_slot(index->table, index->capacity, term, length);
+}
+
+static Posting *lookup_or_insert(Index *index, const char *term, size_t length) {
+    Posting **slot = find_slot(index->table, index->capacity, term, length);
+
+    if (*slot != NULL) {
+        return *slot;
+    }
+
+    if ((index->size + 1) * 10 > index->capacity * 7) {
+        if (grow_table(index) < 0) {
+            return NULL;
+        }
+        slot = find_slot(index->table, index->capacity, term, length);
+    }
+
+    Posting *posting = calloc(1, sizeof(Posting));
+
+    if (posting == NULL || (posting->term = malloc(length + 1)) == NULL) {
+        free(posting);
+        return NULL;
+    }
+
+    memcpy(posting->term, term, length);
+    posting->term[length] = '\0';
+
+    *slot = posting;
+    index->size++;
+
+    return posting;
+}
+
+static void free_posting(Posting *posting) {
+    free(posting->term);
+    free(posting->data);
+    free(posting->skips);
+    free(posting);
+}
+
+// Ensures room for extra more bytes of posting data
+static int reserve_data(Posting *posting, uint32_t extra) {
+    if (posting->length + extra <= posting->capacity) {
+        return 0;
+    }
+
+    uint32_t capacity = posting->capacity ? posting->capacity * 2 : 16;
+
+    while (capacity < posting->length + extra) {
+        capacity *= 2;
+    }
+
+    uint8_t *data = realloc(posting->data, capacity);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    posting->data = data;
+    posting->capacity = capacity;
+
+    return 0;
+}
+
+static int push_skip(Posting *posting) {
+    if (posting->num_skips == posting->skips_capacity) {
+        uint32_t capacity = posting->skips_capacity ? posting->skips_capacity * 2 : 4;
+        Skip *skips = realloc(posting->skips, capacity * sizeof(Skip));
+
+        if (skips == NULL) {
+            return -1;
+        }
+
+        posting->skips = skips;
+        posting->skips_capacity = capacity;
+    }
+
+    posting->skips[posting->num_skips].base = posting->last;
+    posting->skips[posting->num_skips].position = posting->length;
+    posting->num_skips++;
+
+    return 0;
+}
+
+static int push_offset(Posting *posting, uint64_t offset) {
+    // A token repeated within one message is only recorded once
+    if (posting->count > 0 && posting->last == offset) {
+        return 0;
+    }
+
+    assert(posting->count == 0 || offset > posting->last);
+
+    if (posting->count % INDEX_SKIP_INTERVAL == 0 && push_skip(posting) < 0) {
+        return -1;
+    }
+
+    if (reserve_data(posting, 10) < 0) {
+        return -1;
+    }
+
+    uint64_t delta = offset - posting->last;
+
+    while (delta >= 0x80) {
+        posting->data[posting->length++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    posting->data[posting->length++] = (uint8_t)delta;
+
+    posting->last = offset;
+    posting->count++;
+
+    return 0;
+}
+
+// Decodes the next posting, returning false at the end of the list
+static bool cursor_next(Cursor *cursor) {
+    const Posting *posting = cursor->posting;
+
+    if (cursor->index == posting->count) {
+        return false;
+    }
+
+    uint64_t delta = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = posting->data[cursor->position++];
+        delta |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    cursor->value += delta;
+    cursor->index++;
+
+    return true;
+}
+
+// Advances to the first posting >= target, jumping whole blocks through the skip list
+static bool cursor_seek(Cursor *cursor, uint64_t target) {
+    const Posting *posting = cursor->posting;
+
+    if (cursor->index > 0 && cursor->value >= target) {
+        return true;
+    }
+
+    // Last block whose base is below target
+    uint32_t low = 0;
+    uint32_t high = posting->num_skips;
+
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (posting->skips[mid].base < target) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    uint32_t block_start = low * INDEX_SKIP_INTERVAL;
+
+    if (low > 0 && block_start > cursor->index) {
+        cursor->position = posting->skips[low].position;
+        cursor->value = posting->skips[low].base;
+        cursor->index = block_start;
+    }
+
+    while (cursor->index == 0 || cursor->value < target) {
+        if (!cursor_next(cursor)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int compare_counts(const void *a, const void *b) {
+    const Cursor *ca = a;
+    const Cursor *cb = b;
+
+    return (ca->posting->count > cb->posting->count) - (ca->posting->count < cb->posting->count);
+}
+
+// Makes a new, empty index. Returns NULL on failure.
+Index *Index_create() {
+    Index *index = calloc(1, sizeof(Index));
+
+    if (index == NULL) {
+        return NULL;
+    }
+
+    index->capacity = INDEX_INITIAL_CAPACITY;
+    index->table = calloc(index->capacity, sizeof(Posting *));
+
+    if (index->table == NULL) {
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+// Frees the index and all of its posting lists.
+void Index_free(Index *index) {
+    if (index == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (index->table[i] != NULL) {
+            free_posting(index->table[i]);
+        }
+    }
+
+    free(index->table);
+    free(index);
+}
+
+// Adds every token of text to the index under offset.
+int Index_add(Index *index, uint64_t offset, const char *text, size_t length) {
+    assert(index != NULL);
+
+    char token[INDEX_MAX_TOKEN_LENGTH];
+    size_t token_length;
+    size_t pos = 0;
+
+    while ((token_length = next_token(text, length, &pos, token)) > 0) {
+        Posting *posting = lookup_or_insert(index, token, token_length);
+
+        if (posting == NULL || push_offset(posting, offset) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Finds the offsets of messages containing every term of query.
+int Index_search(Index *index, const char *query, uint64_t *results, int max_results, int *total) {
+    assert(index != NULL);
+
+    Cursor cursors[INDEX_MAX_QUERY_TERMS];
+    int num_cursors = 0;
+    char token[INDEX_MAX_TOKEN_LENGTH];
+    size_t token_length;
+    size_t pos = 0;
+
+    *total = 0;
+
+    while ((token_length = next_token(query, strlen(query), &pos, token)) > 0
+    && num_cursors < INDEX_MAX_QUERY_TERMS) {
+        Posting *posting = lookup(index, token, token_length);
+
+        if (posting == NULL) {
+            return 0;
+        }
+
+        memset(&cursors[num_cursors], 0, sizeof(Cursor));
+        cursors[num_cursors].posting = posting;
+        num_cursors++;
+    }
+
+    if (num_cursors == 0) {
+        return 0;
+    }
+
+    // Lead with the rarest term so the others are mostly skipped over
+    qsort(cursors, num_cursors, sizeof(Cursor), compare_counts);
+
+    int stored = 0;
+    int next_slot = 0;
+
+    if (!cursor_next(&cursors[0])) {
+        return 0;
+    }
+
+    uint64_t target = cursors[0].value;
+
+    while (true) {
+        bool matched = true;
+
+        for (int i = 1; i < num_cursors; i++) {
+            if (!cursor_seek(&cursors[i], target)) {
+                goto done;
+            }
+
+            if (cursors[i].value > target) {
+                target = cursors[i].value;
+                matched = false;
+                break;
+            }
+        }
+
+        if (matched) {
+            // Keep the most recent max_results matches in a ring
+            if (max_results > 0) {
+                results[next_slot] = target;
+                next_slot = (next_slot + 1) % max_results;
+                if (stored < max_results) {
+                    stored++;
+                }
+            }
+            (*total)++;
+
+            if (!cursor_next(&cursors[0])) {
+                break;
+            }
+        } else if (!cursor_seek(&cursors[0], target)) {
+            break;
+        }
+
+        target = cursors[0].value;
+    }
+
+done:
+    // Rotate the ring so results are in increasing order
+    if (stored == max_results && next_slot != 0) {
+        uint64_t *rotated = malloc(stored * sizeof(uint64_t));
+
+        if (rotated != NULL) {
+            for (int i = 0; i < stored; i++) {
+                rotated[i] = results[(next_slot + i) % max_results];
+            }
+            memcpy(results, rotated, stored * sizeof(uint64_t));
+            free(rotated);
+        }
+    }
+
+    return stored;
+}
+
+// Writes the index to path (via a temporary file and rename).
+int Index_save(Index *index, const char *path, uint64_t covered) {
+    assert(index != NULL);
+
+    size_t tmp_length = strlen(path) + sizeof(".tmp");
+    char *tmp_path = malloc(tmp_length);
+
+    if (tmp_path == NULL) {
+        return -1;
+    }
+
+    snprintf(tmp_path, tmp_length, "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+
+    if (file == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    uint32_t header[3] = {INDEX_MAGIC, INDEX_VERSION, index->size};
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(&covered, sizeof(covered), 1, file) == 1;
+
+    for (uint32_t i = 0; ok && i < index->capacity; i++) {
+        Posting *posting = index->table[i];
+
+        if (posting == NULL) {
+            continue;
+        }
+
+        uint16_t term_length = (uint16_t)strlen(posting->term);
+
+        ok = fwrite(&term_length, sizeof(term_length), 1, file) == 1
+            && fwrite(posting->term, 1, term_length, file) == term_length
+            && fwrite(&posting->count, sizeof(posting->count), 1, file) == 1
+            && fwrite(&posting->last, sizeof(posting->last), 1, file) == 1
+            && fwrite(&posting->length, sizeof(posting->length), 1, file) == 1
+            && fwrite(posting->data, 1, posting->length, file) == posting->length
+            && fwrite(&posting->num_skips, sizeof(posting->num_skips), 1, file) == 1
+            && fwrite(posting->skips, sizeof(Skip), posting->num_skips, file) == posting->num_skips;
+    }
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+
+    if (ok && rename(tmp_path, path) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+
+    return ok ? 0 : -1;
+}
+
+// Reads an index written by Index_save.
+Index *Index_load(const char *path, uint64_t *covered) {
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    uint32_t header[3];
+    Index *index = NULL;
+
+    if (fread(header, sizeof(header), 1, file) != 1
+    || header[0] != INDEX_MAGIC || header[1] != INDEX_VERSION
+    || fread(covered, sizeof(*covered), 1, file) != 1
+    || (index = Index_create()) == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    uint32_t num_terms = header[2];
+
+    for (uint32_t i = 0; i < num_terms; i++) {
+        uint16_t term_length;
+        char term[INDEX_MAX_TOKEN_LENGTH];
+
+        if (fread(&term_length, sizeof(term_length), 1, file) != 1
+        || term_length == 0 || term_length > INDEX_MAX_TOKEN_LENGTH
+        || fread(term, 1, term_length, file) != term_length) {
+            goto fail;
+        }
+
+        Posting *posting = lookup_or_insert(index, term, term_length);
+
+        if (posting == NULL || posting->count != 0
+        || fread(&posting->count, sizeof(posting->count), 1, file) != 1
+        || fread(&posting->last, sizeof(posting->last), 1, file) != 1
+        || fread(&posting->length, sizeof(posting->length), 1, file) != 1) {
+            goto fail;
+        }
+
+        posting->capacity = posting->length;
+        if ((posting->data = malloc(posting->length ? posting->length : 1)) == NULL
+        || fread(posting->data, 1, posting->length, file) != posting->length
+        || fread(&posting->num_skips, sizeof(posting->num_skips), 1, file) != 1
+        || posting->num_skips != (posting->count + INDEX_SKIP_INTERVAL - 1) / INDEX_SKIP_INTERVAL) {
+            goto fail;
+        }
+
+        posting->skips_capacity = posting->num_skips;
+        if ((posting->skips = malloc((posting->num_skips ? posting->num_skips : 1) * sizeof(Skip))) == NULL
+        || fread(posting->skips, sizeof(Skip), posting->num_skips, file) != posting->num_skips) {
+            goto fail;
+        }
+    }
+
+    fclose(file);
+    return index;
+
+fail:
+    fclose(file);
+    Index_free(index);
+    return NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Inverted index over chat messages.
+ *
+ *  Each token maps to a posting list of message offsets (byte offsets into the
+ *  chat log). Offsets are added in increasing order, so posting lists are stored
+ *  as delta-encoded varints with a skip entry every INDEX_SKIP_INTERVAL postings.
+ */
+
+// Maximum number of bytes kept from a single token
+#define INDEX_MAX_TOKEN_LENGTH 64
+
+// Number of postings between skip entries
+#define INDEX_SKIP_INTERVAL 128
+
+// Maximum number of terms in one query
+#define INDEX_MAX_QUERY_TERMS 16
+
+typedef struct Index_s Index;
+
+// Makes a new, empty index. Returns NULL on failure.
+Index *Index_create();
+
+// Frees the index and all of its posting lists.
+void Index_free(Index *index);
+
+// Adds every token of text to the index under offset. Offsets must be added in
+// increasing order. Returns 0 on success, -1 on failure.
+int Index_add(Index *index, uint64_t offset, const char *text, size_t length);
+
+// Finds the offsets of messages containing every term of query. The most recent
+// max_results matches are stored in results in increasing order; the number stored
+// is returned and the total number of matches is stored in total.
+int Index_search(Index *index, const char *query, uint64_t *results, int max_results, int *total);
+
+// Writes the index to path, recording that it covers the log up to covered.
+// Returns 0 on success, -1 on failure.
+int Index_save(Index *index, const char *path, uint64_t covered);
+
+// Reads an index written by Index_save. Returns NULL if the file is missing or
+// invalid; otherwise stores the covered log length in covered.
+Index *Index_load(const char *path, uint64_t *covered);
+
+#endif
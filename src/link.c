@@ -0,0 +1,500 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "link.h"
+#include "peer.h"
+#include "timer.h"
+#include "trace.h"
+#include "waiter.h"
+
+typedef enum Link_state_e Link_state;
+enum Link_state_e {
+    LINK_UNKNOWN,   // Not heard from yet
+    LINK_UP,
+    LINK_DOWN,
+};
+
+typedef struct Ping_s Ping;
+struct Ping_s {
+    uint32_t id;
+    bool answered;
+};
+
+typedef struct Link_s Link;
+struct Link_s {
+    struct sockaddr_storage addr;
+    socklen_t addr_length;          // 0 if the slot is free
+    Timer timer;
+    Link_state state;
+    uint32_t next_ping;
+    Ping pings[LINK_PING_RING];
+    uint64_t srtt_ns;
+    uint64_t rttvar_ns;
+    uint64_t min_rtt_ns;
+    uint64_t last_rtt_ns;
+    double loss;                    // Moving average of ping outcomes (1 for lost)
+    uint64_t pings_sent;
+    uint64_t pongs_received;
+    uint64_t pings_lost;
+    uint64_t added_ns;
+    uint64_t last_heard_ns;
+    bool group;                     // A multicast group, pinged on behalf of its members
+    bool member;                    // A member of the group, learned from its pongs and never pinged itself
+};
+
+// Static variables
+static Link links[LINK_MAX_LINKS];
+static int num_links = 0;
+static uint64_t hash_key[2];
+static Timer_wheel wheel;
+static uint64_t interval_ticks = 0;
+static LINK_SEND_FN send_ping = NULL;
+static Link *group_link = NULL;
+static pthread_t heartbeat_pthread;
+static bool started = false;
+
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Printable "address:port" of addr
+static const char *address_name(const struct sockaddr *addr, char *name, size_t length) {
+    char ip_str[INET6_ADDRSTRLEN] = "?";
+    int port = 0;
+
+    if (addr->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, ip_str, sizeof(ip_str));
+        port = ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+        snprintf(name, length, "[%s]:%d", ip_str, port);
+    } else {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, ip_str, sizeof(ip_str));
+        port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+        snprintf(name, length, "%s:%d", ip_str, port);
+    }
+
+    return name;
+}
+
+// Printable "address:port" of a link
+static const char *link_name(const Link *link, char *name, size_t length) {
+    return address_name((const struct sockaddr *)&link->addr, name, length);
+}
+
+// Slot of addr in links, or of the free slot it would take (call with the mutex held)
+static Link *find(const struct sockaddr *addr) {
+    uint64_t i = Peer_hash_address(hash_key, addr);
+
+    for (int probes = 0; probes < LINK_MAX_LINKS; probes++, i++) {
+        Link *link = &links[i % LINK_MAX_LINKS];
+
+        if (link->addr_length == 0 || Peer_same_address((const struct sockaddr *)&link->addr, addr)) {
+            return link;
+        }
+    }
+
+    return NULL;
+}
+
+// Judge the group ping sent LINK_LOSS_AFTER intervals ago for every member, and
+// notice members that went quiet (call with the mutex held, before the next group ping)
+static void check_members(uint64_t now, uint64_t interval_ns) {
+    uint32_t id = group_link->next_ping - LINK_LOSS_AFTER;
+    char name[INET6_ADDRSTRLEN + 16];
+
+    for (int i = 0; i < LINK_MAX_LINKS; i++) {
+        Link *link = &links[i];
+
+        if (link->addr_length == 0 || !link->member || link->state == LINK_DOWN) {
+            continue;
+        }
+
+        if (link->pings_sent >= LINK_LOSS_AFTER) {
+            Ping *ping = &link->pings[id % LINK_PING_RING];
+            bool lost = !(ping->id == id && ping->answered);
+
+            link->pings_lost += lost;
+            link->loss += ((lost ? 1.0 : 0.0) - link->loss) / 16;
+        }
+
+        if (now - link->last_heard_ns > LINK_DEAD_INTERVALS * interval_ns) {
+            printf("<LINK>  %s left the group (silent for %.1f s)\n", link_name(link, name, sizeof(name)),
+                (now - link->last_heard_ns) / 1e9);
+            fflush(stdout);
+            link->state = LINK_DOWN;
+            continue;
+        }
+
+        link->pings_sent++;
+    }
+}
+
+// Timer callback: judge an old ping, check liveness and send the next ping
+static void ping_due(Timer *timer, void *arg) {
+    Link *link = arg;
+    uint64_t now = Waiter_now_ns();
+    uint64_t interval_ns = interval_ticks * LINK_TICK_MS * 1000000;
+    char name[INET6_ADDRSTRLEN + 16];
+
+    if (link->pings_sent >= LINK_LOSS_AFTER) {
+        bool lost = !link->pings[(link->next_ping - LINK_LOSS_AFTER) % LINK_PING_RING].answered;
+
+        link->pings_lost += lost;
+        link->loss += ((lost ? 1.0 : 0.0) - link->loss) / 16;
+    }
+
+    if (link->group) {
+        check_members(now, interval_ns);
+    }
+
+    uint64_t heard = link->last_heard_ns ? link->last_heard_ns : link->added_ns;
+
+    if (link->state != LINK_DOWN && now - heard > LINK_DEAD_INTERVALS * interval_ns) {
+        printf("<LINK>  %s %s (silent for %.1f s)\n", link_name(link, name, sizeof(name)),
+            link->group ? "has no members responding"
+                : link->state == LINK_UP ? "stopped responding" : "is not responding",
+            (now - heard) / 1e9);
+        fflush(stdout);
+        link->state = LINK_DOWN;
+    }
+
+    uint8_t payload[LINK_PING_LENGTH];
+    uint32_t id = link->next_ping++;
+
+    link->pings[id % LINK_PING_RING] = (Ping){ .id = id, .answered = false };
+    store32_be(payload, id);
+    store32_be(payload + 4, (uint32_t)(now >> 32));
+    store32_be(payload + 8, (uint32_t)now);
+
+    send_ping((const struct sockaddr *)&link->addr, link->addr_length, payload, sizeof(payload));
+    link->pings_sent++;
+
+    Timer_add(&wheel, timer, wheel.now + interval_ticks);
+}
+
+static uint64_t now_ticks() {
+    return Waiter_now_ns() / (LINK_TICK_MS * 1000000);
+}
+
+// Schedule the first ping of link at a random point of the interval, so that
+// pings to many peers are spread out (call with the mutex held)
+static void schedule_first(Link *link) {
+    uint32_t offset = 0;
+
+    if (getrandom(&offset, sizeof(offset), 0) != sizeof(offset)) {
+        offset = 0;
+    }
+
+    Timer_add(&wheel, &link->timer, wheel.now + 1 + offset % interval_ticks);
+}
+
+// Heartbeat thread
+static void *heartbeat_run(void *unused) {
+    struct timespec next;
+
+    Trace_thread("heartbeat");
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (true) {
+        next.tv_nsec += LINK_TICK_MS * 1000000;
+
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        // Only stop between ticks, never with the mutex held
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&link_mutex);
+        {
+            Timer_advance(&wheel, now_ticks());
+        }
+        pthread_mutex_unlock(&link_mutex);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+// Start pinging every interval_ms through send (0 disables heartbeats)
+void Link_start(int interval_ms, LINK_SEND_FN send) {
+    if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key)) {
+        printf("<DEBUG> Failed to read random link table key: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (interval_ms <= 0) {
+        return;
+    }
+
+    interval_ticks = (interval_ms + LINK_TICK_MS - 1) / LINK_TICK_MS;
+    send_ping = send;
+    Timer_wheel_init(&wheel, now_ticks());
+
+    if (pthread_create(&heartbeat_pthread, NULL, heartbeat_run, NULL) != 0) {
+        printf("Error creating heartbeat thread. Exiting\n");
+        exit(EXIT_FAILURE);
+    }
+
+    started = true;
+}
+
+// Stop the heartbeat thread
+void Link_stop() {
+    if (!started) {
+        return;
+    }
+
+    if (pthread_cancel(heartbeat_pthread) != 0 || pthread_join(heartbeat_pthread, NULL) != 0) {
+        printf("Error stopping heartbeat thread.\n");
+    }
+
+    started = false;
+}
+
+// Take a slot for addr, or return the one it has. Returns NULL if the table is
+// full (call with the mutex held).
+static Link *add(const struct sockaddr *addr, socklen_t addr_length) {
+    Link *link = find(addr);
+
+    if (link == NULL) {
+        printf("<LINK>  Too many peers, not tracking another\n");
+    } else if (link->addr_length == 0) {
+        memcpy(&link->addr, addr, addr_length);
+        link->addr_length = addr_length;
+        link->added_ns = Waiter_now_ns();
+        Timer_init(&link->timer, ping_due, link);
+        num_links++;
+    }
+
+    return link;
+}
+
+// Start tracking the peer at addr
+void Link_add(const struct sockaddr *addr, socklen_t addr_length) {
+    pthread_mutex_lock(&link_mutex);
+    {
+        Link *link = add(addr, addr_length);
+
+        if (link != NULL && started && !Timer_pending(&link->timer)) {
+            schedule_first(link);
+        }
+    }
+    pthread_mutex_unlock(&link_mutex);
+}
+
+// Start tracking the multicast group at addr: one ping per interval goes to the
+// group, and every member that answers is tracked as a link of its own
+void Link_add_group(const struct sockaddr *addr, socklen_t addr_length) {
+    pthread_mutex_lock(&link_mutex);
+    {
+        Link *link = add(addr, addr_length);
+
+        if (link != NULL) {
+            link->group = true;
+            group_link = link;
+
+            if (started && !Timer_pending(&link->timer)) {
+                schedule_first(link);
+            }
+        }
+    }
+    pthread_mutex_unlock(&link_mutex);
+}
+
+// Note that the member at addr said goodbye
+void Link_left(const struct sockaddr *addr) {
+    char name[INET6_ADDRSTRLEN + 16];
+
+    pthread_mutex_lock(&link_mutex);
+    {
+        Link *link = find(addr);
+
+        if (link != NULL && link->addr_length != 0 && link->member) {
+            link->state = LINK_DOWN;
+        }
+    }
+    pthread_mutex_unlock(&link_mutex);
+
+    printf("<LINK>  %s left the group\n", address_name(addr, name, sizeof(name)));
+    fflush(stdout);
+}
+
+// Account for a pong from addr
+void Link_pong(const struct sockaddr *addr, const uint8_t *payload, size_t length) {
+    if (length != LINK_PING_LENGTH) {
+        return;
+    }
+
+    uint64_t now = Waiter_now_ns();
+    uint32_t id = load32_be(payload);
+    uint64_t sent = ((uint64_t)load32_be(payload + 4) << 32) | load32_be(payload + 8);
+
+    if (sent > now) {
+        return;
+    }
+
+    pthread_mutex_lock(&link_mutex);
+    {
+        Link *link = find(addr);
+        bool joined = false;
+
+        // A pong to a group ping from an address not seen before is a new member
+        if (link != NULL && link->addr_length == 0 && group_link != NULL
+        && group_link->pings[id % LINK_PING_RING].id == id) {
+            link = add(addr, sizeof(struct sockaddr_storage));
+            link->member = true;
+            joined = true;
+        }
+
+        if (link != NULL && link->addr_length != 0) {
+            Ping *ping = &link->pings[id % LINK_PING_RING];
+            uint64_t rtt = now - sent;
+
+            // Only count each ping once, and only while it is remembered. Members
+            // answer the group's pings, so theirs are filled in as the pongs arrive.
+            bool fresh = link->member
+                ? group_link->pings[id % LINK_PING_RING].id == id && !(ping->id == id && ping->answered)
+                : ping->id == id && !ping->answered;
+
+            if (fresh) {
+                ping->id = id;
+                ping->answered = true;
+                link->pongs_received++;
+
+                if (link->srtt_ns == 0) {
+                    link->srtt_ns = rtt;
+                    link->rttvar_ns = rtt / 2;
+                    link->min_rtt_ns = rtt;
+                } else {
+                    uint64_t deviation = rtt > link->srtt_ns ? rtt - link->srtt_ns : link->srtt_ns - rtt;
+
+                    link->rttvar_ns = (3 * link->rttvar_ns + deviation) / 4;
+                    link->srtt_ns = (7 * link->srtt_ns + rtt) / 8;
+                    link->min_rtt_ns = rtt < link->min_rtt_ns ? rtt : link->min_rtt_ns;
+                }
+
+                link->last_rtt_ns = rtt;
+            }
+
+            char name[INET6_ADDRSTRLEN + 16];
+
+            if (joined || (link->member && link->state == LINK_DOWN)) {
+                printf("<LINK>  %s joined the group (rtt %.2f ms)\n", link_name(link, name, sizeof(name)), rtt / 1e6);
+                fflush(stdout);
+            } else if (link->state == LINK_DOWN) {
+                printf("<LINK>  %s is responding again (rtt %.2f ms)\n", link_name(link, name, sizeof(name)), rtt / 1e6);
+                fflush(stdout);
+            }
+
+            link->state = LINK_UP;
+            link->last_heard_ns = now;
+
+            // Any member answering keeps the group up, and answers the group's ping
+            if (link->member) {
+                Ping *group_ping = &group_link->pings[id % LINK_PING_RING];
+
+                if (!group_ping->answered) {
+                    group_ping->answered = true;
+                    group_link->pongs_received++;
+                }
+
+                if (group_link->state == LINK_DOWN) {
+                    printf("<LINK>  %s has members responding again\n", link_name(group_link, name, sizeof(name)));
+                    fflush(stdout);
+                }
+
+                group_link->state = LINK_UP;
+                group_link->last_heard_ns = now;
+            }
+        }
+    }
+    pthread_mutex_unlock(&link_mutex);
+}
+
+// True if the peer at addr is answering heartbeats (or heartbeats are off)
+bool Link_is_up(const struct sockaddr *addr) {
+    bool up = true;
+
+    if (!started) {
+        return true;
+    }
+
+    pthread_mutex_lock(&link_mutex);
+    {
+        Link *link = find(addr);
+
+        if (link != NULL && link->addr_length != 0) {
+            up = link->state != LINK_DOWN;
+        }
+    }
+    pthread_mutex_unlock(&link_mutex);
+
+    return up;
+}
+
+// Print the quality of every link
+void Link_print(FILE *out) {
+    static const char *states[] = {"unknown", "up", "down"};
+
+    if (!started) {
+        fprintf(out, "Heartbeats are off.\n");
+        return;
+    }
+
+    fprintf(out, "Links:                          state     srtt ms  jitter ms    min ms   loss %%   sent  lost  heard s ago\n");
+
+    pthread_mutex_lock(&link_mutex);
+    {
+        uint64_t now = Waiter_now_ns();
+
+        for (int i = 0; i < LINK_MAX_LINKS; i++) {
+            Link *link = &links[i];
+            char name[INET6_ADDRSTRLEN + 16];
+
+            if (link->addr_length == 0) {
+                continue;
+            }
+
+            link_name(link, name, sizeof(name) - 8);
+
+            if (link->group) {
+                strcat(name, " (group)");
+            }
+
+            fprintf(out, "  %-30s %-7s %9.3f %10.3f %9.3f %8.1f %6llu %5llu ",
+                name, states[link->state],
+                link->srtt_ns / 1e6, link->rttvar_ns / 1e6, link->min_rtt_ns / 1e6, link->loss * 100,
+                (unsigned long long)link->pings_sent, (unsigned long long)link->pings_lost);
+
+            if (link->last_heard_ns) {
+                fprintf(out, "%12.1f\n", (now - link->last_heard_ns) / 1e9);
+            } else {
+                fprintf(out, "%12s\n", "never");
+            }
+        }
+    }
+    pthread_mutex_unlock(&link_mutex);
+}
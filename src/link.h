@@ -0,0 +1,46 @@
+#ifndef _LINK_H_
+#define _LINK_H_
+
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ *  Heartbeats and link quality.
+ *
+ *  Every known peer is pinged once per interval from a timer wheel ticking every
+ *  LINK_TICK_MS. A ping carries an id and the sender's clock, which the peer
+ *  echoes in its pong, so round trips are measured without keeping per-ping
+ *  timestamps. Each link keeps a smoothed RTT and RTT variation (RFC 6298), a
+ *  loss estimate, and whether the peer is up; a peer that has not answered for
+ *  LINK_DEAD_INTERVALS intervals is reported as not responding.
+ *
+ *  A multicast group is pinged once per interval like a single peer. Every
+ *  member that answers becomes a link of its own, measured from its pongs to the
+ *  group's pings, and is reported as having left once it has been silent for
+ *  LINK_DEAD_INTERVALS intervals, so the links double as the group's presence list.
+ */
+
+#define LINK_MAX_LINKS 4096
+#define LINK_TICK_MS 10
+#define LINK_PING_LENGTH 12         // u32 id, u64 send time in ns
+#define LINK_PING_RING 16           // Recent pings remembered per link
+#define LINK_LOSS_AFTER 3           // Intervals after which an unanswered ping counts as lost
+#define LINK_DEAD_INTERVALS 5
+
+// Sends a ping payload to addr
+typedef void (*LINK_SEND_FN)(const struct sockaddr *addr, socklen_t addr_length, const uint8_t *payload, size_t length);
+
+// Prototypes
+void Link_start(int interval_ms, LINK_SEND_FN send);
+void Link_stop();
+void Link_add(const struct sockaddr *addr, socklen_t addr_length);
+void Link_add_group(const struct sockaddr *addr, socklen_t addr_length);
+void Link_left(const struct sockaddr *addr);
+void Link_pong(const struct sockaddr *addr, const uint8_t *payload, size_t length);
+bool Link_is_up(const struct sockaddr *addr);
+void Link_print(FILE *out);
+
+#endif
@@ -24,11 +24,15 @@ struct List_s {
 
 // Maximum number of unique lists the system can support
 // (You may modify its value for your needs)
+#ifndef LIST_MAX_NUM_HEADS
 #define LIST_MAX_NUM_HEADS 10
+#endif
 
 // Maximum total number of nodes (statically allocated) to be shared across all lists
-// (You may modify its value for your needs)
+// (You may modify its value for your needs, or override it when compiling)
+#ifndef LIST_MAX_NUM_NODES
 #define LIST_MAX_NUM_NODES 100
+#endif
 
 // General Error Handling:
 // Client code is assumed never to call these functions with a NULL List pointer, or 
@@ -0,0 +1,28 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "message.h"
+
+// Allocate a message holding a copy of text in the default channel, stamped
+// with the current time.
+// Returns NULL if out of memory; free with free().
+Message *Message_create(const char *text, size_t length) {
+    Message *message = malloc(sizeof(Message) + length + 1);
+
+    if (message == NULL) {
+        return NULL;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    message->time_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    message->sender_length = 0;
+    message->channel = 0;
+    message->length = length;
+    memcpy(message->text, text, length);
+    message->text[length] = '\0';
+
+    return message;
+}
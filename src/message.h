@@ -0,0 +1,30 @@
+#ifndef _MESSAGE_H_
+#define _MESSAGE_H_
+
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "container.h"
+
+// A received chat message, as queued between the receive workers and the output stage
+typedef struct Message_s Message;
+struct Message_s {
+    uint64_t time_ms;                   // Wall clock time of arrival (ms since the epoch)
+    struct sockaddr_storage sender;
+    socklen_t sender_length;            // 0 if the sender is unknown
+    uint32_t channel;                   // 0 for the default channel
+    size_t length;
+    char text[];                        // length bytes followed by a NUL
+};
+
+// Queued by pointer: a message outlives its queue, and queues free what is left in them
+#define MESSAGE_FREE_SLOT(slot) free(*(slot))
+
+CONTAINER_RING(Message_ring, Message *, MESSAGE_FREE_SLOT)
+
+// Prototypes
+Message *Message_create(const char *text, size_t length);
+
+#endif
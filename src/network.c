@@ -1,10 +1,15 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <sched.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -13,9 +18,25 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include "affinity.h"
+#include "channel.h"
+#include "crypto.h"
+#include "dedup.h"
 #include "network.h"
-#include "list.h"
+#include "container.h"
+#include "link.h"
+#include "message.h"
+#include "options.h"
+#include "packet.h"
+#include "peer.h"
+#include "record.h"
+#include "sanitize.h"
+#include "shm.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
 #include "ui.h"
+#include "waiter.h"
 
 // Static variables
 static int src_port;
@@ -26,22 +47,142 @@ static struct addrinfo src_hints;
 static struct addrinfo *src_res;
 static struct addrinfo dest_hints;
 static struct addrinfo *dest_res;
+static struct addrinfo *dest_addr;  // The resolved destination actually used
+
+static struct addrinfo *bound_addrs[MAX_BOUND_ADDRESSES]; // One per address family
+static int num_bound = 0;
+
+static bool multicast = false;                  // --multicast: dest_addr is a group that src_res joined
+static struct addrinfo *unicast_res;            // Ephemeral port every datagram to the group is sent from
+static char group_host[INET6_ADDRSTRLEN];
+static char group_port[8];
 
 static pthread_t send_pthread;
-static pthread_t recv_pthread;
 
 static pthread_mutex_t recv_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards replay_window
 
 static pthread_cond_t recv_cond = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t send_cond = PTHREAD_COND_INITIALIZER;
 
-static char *newstr = NULL;
+static Waiter_site send_wait = {
+    STATS_SEND_HANDOFF, STATS_SEND_MUTEX_NS, STATS_SEND_COND_NS, "wait send_mutex", "sleep send_cond", 0
+};
+static Waiter_site recv_wait = {
+    STATS_SCREEN_HANDOFF, STATS_RECV_MUTEX_NS, STATS_RECV_COND_NS, "wait recv_mutex", "sleep recv_cond", 0
+};
+
+static uint32_t session;
+static Packet_window replay_window;  // Shared by the workers, as a session may reach any of them
+static uint64_t send_seq;     // Taken atomically: send_run and control messages share it
+
+static bool gso = false;      // send_run hands runs of equal-length datagrams to UDP_SEGMENT
+static bool gro = false;      // Receive sockets may coalesce datagrams into one read (UDP_GRO)
+static bool buffer_cap_shown = false; // net.core.rmem_max caps every socket alike, so it is reported once
+static bool dedup = true;     // Duplicate chat datagrams are dropped (unless --no-dedup)
+static size_t header_length = PACKET_HEADER_LENGTH; // 0 with --wire-version 0, which sends bare text
+
+// A message waiting in a send lane, stored inline
+typedef struct Outgoing_s Outgoing;
+struct Outgoing_s {
+    uint32_t channel;
+    uint32_t length;
+    char text[BUFFER_LENGTH + 1];   // length bytes followed by a NUL
+};
+
+CONTAINER_RING(Outgoing_ring, Outgoing, CONTAINER_NO_FREE)
+
+static Outgoing_ring lanes[NUM_LANES];
+static const int lane_capacity[NUM_LANES] = { LANE_CONTROL_CAPACITY, LANE_CHAT_CAPACITY, LANE_BULK_CAPACITY };
+static const Stats_counter lane_counter[NUM_LANES] = { STATS_SEND_CONTROL, STATS_SEND_CHAT, STATS_SEND_BULK };
+static int lane_weights[NUM_LANES];  // Messages send_run takes from each lane per round
+
+// Receive workers, each draining its own SO_REUSEPORT socket into its own queue
+typedef struct Recv_worker_s Recv_worker;
+struct Recv_worker_s {
+    int id;
+    int socket_fds[MAX_BOUND_ADDRESSES]; // Parallel to bound_addrs
+    Message_ring queue;    // Full at capacity, when messages are dropped
+    int batch;             // Datagrams read per recvmmsg
+    int next_socket;       // Socket polled first on the next read
+    int recv_fd;           // Socket the last batch was read from
+    int recv_index;        // Its index in socket_fds
+    uint32_t kernel_drops[MAX_BOUND_ADDRESSES]; // Last SO_RXQ_OVFL count seen on each socket
+    bool buffer_capped[MAX_BOUND_ADDRESSES]; // Whether growing each socket's receive buffer has hit a limit
+    pthread_t pthread;
+    pthread_mutex_t mutex; // Guards queue
+    pthread_cond_t cond;   // Signalled when the output stage empties queue
+    Peer_table *peers;     // Token buckets and sequence bitmaps of the senders hashed to this worker
+    Dedup_bloom *bloom;    // IDs of the chat datagrams this worker accepted, from any sender
+    Message *newmsg;
+    uint8_t *reads;        // batch buffers of read_length bytes each
+    size_t read_length;    // DATAGRAM_LENGTH, or GRO_READ_LENGTH with UDP_GRO
+    bool shm;              // Reads the shared-memory ring instead of the sockets
+};
+
+// One datagram of a batch, which may share a read with others under UDP_GRO
+typedef struct Segment_s Segment;
+struct Segment_s {
+    uint8_t *data;
+    size_t length;
+    int msg;               // The read it came from, and so its sender
+};
+
+static Recv_worker workers[MAX_RECV_WORKERS + 1];
+static int num_workers = 1;
+static int num_queues = 1;       // Receive workers, plus the shared-memory reader if the peer is local
+static int pending_received = 0; // Messages queued across all workers (written under recv_mutex, read atomically)
+static int pending_send = 0;     // Messages queued across the lanes (written under send_mutex, read atomically)
+static bool exit_queued = false; // "!" is in a lane, so nothing more is queued (guarded by send_mutex)
+static int next_worker = 0;      // Round-robin position of the output stage
+
+// Split "<group>:<port>" (IPv6 groups in brackets) for multicast_connect
+static void check_multicast_args(int argc, const char *spec) {
+    const char *host = spec;
+    const char *colon = strrchr(spec, ':');
+    size_t host_length = colon ? (size_t)(colon - spec) : 0;
+
+    if (argc != 1) {
+        printf("--multicast takes the place of the port and remote machine arguments.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (host_length >= 2 && host[0] == '[' && host[host_length - 1] == ']') {
+        host++;
+        host_length -= 2;
+    }
+
+    if (colon == NULL || host_length == 0 || host_length >= sizeof(group_host) || strlen(colon + 1) >= sizeof(group_port)) {
+        printf("Invalid multicast group %s, expected <group>:<port>\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(group_host, host, host_length);
+    group_host[host_length] = '\0';
+    strcpy(group_port, colon + 1);
+
+    char *end;
+    src_port = dest_port = strtol(group_port, &end, 10);
+
+    if (*end != '\0' || end == group_port || src_port < MIN_PORT || src_port > MAX_PORT) {
+        printf("Invalid multicast port.\n");
+        printf("Please enter a port number between %d and %d inclusive.\n", MIN_PORT, MAX_PORT);
+        exit(EXIT_FAILURE);
+    }
+
+    multicast = true;
+}
 
 // Check arguments for errors
 void Network_check_args(int argc, char *argv[]) {
+    if (Options_get()->multicast != NULL) {
+        check_multicast_args(argc, Options_get()->multicast);
+        return;
+    }
+
     if (argc != ARG_COUNT) {
-        printf("Usage: ./t-chat [my port number] [remote machine name] [remote port number]\n");
+        Options_usage();
         exit(EXIT_FAILURE);
     } 
 
@@ -92,7 +233,7 @@ void Network_check_args(int argc, char *argv[]) {
 // Connect source 
 static void src_connect(struct addrinfo *src_hints, struct addrinfo **src_res, char *argv[]) {
     memset(src_hints, 0, sizeof(struct addrinfo));
-    src_hints->ai_family = AF_INET; 
+    src_hints->ai_family = AF_UNSPEC; // IPv4 and IPv6
     src_hints->ai_socktype = SOCK_DGRAM;
     src_hints->ai_flags = AI_PASSIVE; 
 
@@ -106,11 +247,21 @@ static void src_connect(struct addrinfo *src_hints, struct addrinfo **src_res, c
     }
 }
 
+// Printable form of an IPv4 or IPv6 address
+static const char *address_string(const struct sockaddr *addr, char *ip_str, socklen_t length) {
+    const void *src = addr->sa_family == AF_INET6
+        ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+        : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+
+    return inet_ntop(addr->sa_family, src, ip_str, length);
+}
+
 // Connect destination
 static void dest_connect(struct addrinfo *dest_hints, struct addrinfo **dest_res, char *argv[]) {
     memset(dest_hints, 0, sizeof(struct addrinfo));
-    dest_hints->ai_family = AF_INET; // IPV4
+    dest_hints->ai_family = AF_UNSPEC; // IPv4 or IPv6, in the resolver's order of preference
     dest_hints->ai_socktype = SOCK_DGRAM; // UDP Datagram
+    dest_hints->ai_flags = AI_ADDRCONFIG;
 
     int gai_result;
     char ip_str[INET6_ADDRSTRLEN];
@@ -119,78 +270,673 @@ static void dest_connect(struct addrinfo *dest_hints, struct addrinfo **dest_res
         printf("<DEST>  Failed to resolve address for %s: %s\n", argv[2], gai_strerror(gai_result));
         exit(EXIT_FAILURE);
     } else {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)(*dest_res)->ai_addr;
-        inet_ntop((*dest_res)->ai_family, &(addr_in->sin_addr), ip_str, sizeof ip_str);
-        printf("<DEST>  Successfully resolved address for %s: %s\n", argv[2], ip_str);
+        for (struct addrinfo *res = *dest_res; res != NULL; res = res->ai_next) {
+            printf("<DEST>  Successfully resolved address for %s: %s\n", argv[2],
+                address_string(res->ai_addr, ip_str, sizeof ip_str));
+        }
     }
 }
 
-// Bind to socket
-static void socket_bind(int *socket_fd, struct addrinfo **dest_res, struct addrinfo **src_res) {
-    int bind_result;
+// Resolve the --multicast group as the destination, and a wildcard address of
+// the same family on the group's port as the source
+static void multicast_connect() {
+    int gai_result;
+
+    memset(&dest_hints, 0, sizeof(dest_hints));
+    dest_hints.ai_family = AF_UNSPEC;
+    dest_hints.ai_socktype = SOCK_DGRAM;
+    dest_hints.ai_flags = AI_NUMERICHOST;
 
-    // Shared socket
-    if ((*socket_fd = socket((*dest_res)->ai_family, (*dest_res)->ai_socktype, (*dest_res)->ai_protocol)) < 0) {
-        printf("<DEBUG> Failed to create socket: %s\n", strerror(errno));
+    if ((gai_result = getaddrinfo(group_host, group_port, &dest_hints, &dest_res)) != 0) {
+        printf("<DEST>  Invalid multicast group %s: %s\n", group_host, gai_strerror(gai_result));
         exit(EXIT_FAILURE);
+    }
+
+    const struct sockaddr *group = dest_res->ai_addr;
+    bool is_multicast = group->sa_family == AF_INET6
+        ? IN6_IS_ADDR_MULTICAST(&((const struct sockaddr_in6 *)group)->sin6_addr)
+        : IN_MULTICAST(ntohl(((const struct sockaddr_in *)group)->sin_addr.s_addr));
+
+    if (!is_multicast) {
+        printf("<DEST>  %s is not a multicast address\n", group_host);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&src_hints, 0, sizeof(src_hints));
+    src_hints.ai_family = group->sa_family;
+    src_hints.ai_socktype = SOCK_DGRAM;
+    src_hints.ai_flags = AI_PASSIVE;
+
+    if ((gai_result = getaddrinfo(NULL, group_port, &src_hints, &src_res)) != 0
+    || (gai_result = getaddrinfo(NULL, "0", &src_hints, &unicast_res)) != 0) {
+        printf("<SRC>   Failed to resolve host: %s\n", gai_strerror(gai_result));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("<DEST>  Multicast group %s port %s\n", group_host, group_port);
+}
+
+// Join the multicast group on group_fd and set how far and where the datagrams
+// sent from send_fd go
+static void join_group(int group_fd, int send_fd, const struct sockaddr *group) {
+    int hops = Options_get()->multicast_ttl;
+    int loop = Options_get()->multicast_loop;
+    int result;
+
+    if (group->sa_family == AF_INET6) {
+        struct ipv6_mreq request = { .ipv6mr_multiaddr = ((const struct sockaddr_in6 *)group)->sin6_addr };
+
+        result = setsockopt(group_fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request));
+        result = result < 0 ? result : setsockopt(send_fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+        result = result < 0 ? result : setsockopt(send_fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+    } else {
+        struct ip_mreqn request = {
+            .imr_multiaddr = ((const struct sockaddr_in *)group)->sin_addr,
+            .imr_address.s_addr = htonl(INADDR_ANY),
+        };
+
+        result = setsockopt(group_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request));
+        result = result < 0 ? result : setsockopt(send_fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+        result = result < 0 ? result : setsockopt(send_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    }
+
+    if (result < 0) {
+        printf("<SRC>   Failed to join multicast group %s: %s\n", group_host, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("<SRC>   Joined multicast group %s (ttl %d, loopback %s)\n", group_host, hops, loop ? "on" : "off");
+}
+
+// Bind to socket. Returns 0 on success, -1 if src_addr could not be bound.
+static int socket_bind(int *socket_fd, struct addrinfo *src_addr, bool reuse_port) {
+    int bind_result;
+    const char *family = src_addr->ai_family == AF_INET6 ? "IPv6" : "IPv4";
+
+    if ((*socket_fd = socket(src_addr->ai_family, src_addr->ai_socktype, src_addr->ai_protocol)) < 0) {
+        printf("<DEBUG> Failed to create %s socket: %s\n", family, strerror(errno));
+        return -1;
     } else {
-        printf("<DEBUG> Successfully created socket\n");
+        printf("<DEBUG> Successfully created %s socket\n", family);
+    }
+
+    int enable = 1;
+
+    // Keep IPv6 sockets to IPv6 so the IPv4 socket can share the port
+    if (src_addr->ai_family == AF_INET6
+    && setsockopt(*socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable)) < 0) {
+        printf("<SRC>   Failed to set IPV6_V6ONLY: %s\n", strerror(errno));
+        close(*socket_fd);
+        return -1;
+    }
+
+    // Let other instances on this host join the same group on the same port
+    if (multicast && setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+        printf("<SRC>   Failed to set SO_REUSEADDR: %s\n", strerror(errno));
+        close(*socket_fd);
+        return -1;
+    }
+
+    // Let every receive worker bind its own socket to the port
+    if (reuse_port && setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        printf("<SRC>   Failed to set SO_REUSEPORT: %s\n", strerror(errno));
+        close(*socket_fd);
+        return -1;
     }
     
+    // Let the kernel busy poll the device queue in --low-latency mode. Raising it
+    // above net.core.busy_read needs CAP_NET_ADMIN; user space spinning still applies.
+    int busy_poll_usec = Options_get()->spin_usec;
+
+    if (busy_poll_usec > 0
+    && setsockopt(*socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(busy_poll_usec)) < 0) {
+        printf("<SRC>   SO_BUSY_POLL unavailable (%s), spinning in user space only\n", strerror(errno));
+    }
+
+    // Report datagrams the kernel drops for lack of buffer space with each read
+    if (setsockopt(*socket_fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0) {
+        printf("<SRC>   SO_RXQ_OVFL unavailable (%s), kernel drops will not be counted\n", strerror(errno));
+    }
+
     // Bind
-    if ((bind_result = bind(*socket_fd, (*src_res)->ai_addr, (*src_res)->ai_addrlen)) < 0) {
-        printf("<SRC>   Failed to bind socket: %s\n", strerror(errno));
+    if ((bind_result = bind(*socket_fd, src_addr->ai_addr, src_addr->ai_addrlen)) < 0) {
+        printf("<SRC>   Failed to bind %s socket: %s\n", family, strerror(errno));
         close(*socket_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     } else {
-        printf("<SRC>   Successfully bound to socket\n");
+        printf("<SRC>   Successfully bound to %s socket\n", family);
     }
+
+    return 0;
+}
+
+// Set a socket buffer to at least bytes, past the net.core limits where allowed.
+// Returns the size the kernel reports afterwards.
+static int set_buffer(int fd, bool receive, int bytes) {
+    int size;
+    socklen_t length = sizeof(size);
+
+    // The kernel doubles what it is given to allow for its own overhead
+    bytes /= 2;
+
+    if (setsockopt(fd, SOL_SOCKET, receive ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, &bytes, sizeof(bytes)) < 0) {
+        setsockopt(fd, SOL_SOCKET, receive ? SO_RCVBUF : SO_SNDBUF, &bytes, sizeof(bytes));
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, receive ? SO_RCVBUF : SO_SNDBUF, &size, &length) < 0) {
+        return 0;
+    }
+
+    return size;
+}
+
+// Size a socket's buffers to hold what the queues around it can hold, never
+// going below the kernel defaults
+static void size_buffers(int fd, int queue_depth) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    int wanted = (queue_depth + BATCH_SIZE) * SOCKET_BUFFER_PER_DATAGRAM;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &length) == 0 && size < wanted) {
+        size = set_buffer(fd, true, wanted);
+    }
+
+    Stats_max(STATS_RECV_BUFFER_BYTES, size);
+
+    length = sizeof(size);
+    wanted = 2 * BATCH_SIZE * SOCKET_BUFFER_PER_DATAGRAM;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &length) == 0 && size < wanted) {
+        set_buffer(fd, false, wanted);
+    }
+}
+
+// Double the receive buffer of the worker's socket at index after the kernel
+// dropped datagrams on it, up to SOCKET_BUFFER_MAX
+static void grow_buffer(Recv_worker *worker, int index) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    int fd = worker->socket_fds[index];
+
+    if (worker->buffer_capped[index] || getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &length) < 0 || size >= SOCKET_BUFFER_MAX) {
+        return;
+    }
+
+    int grown = set_buffer(fd, true, size * 2 < SOCKET_BUFFER_MAX ? size * 2 : SOCKET_BUFFER_MAX);
+
+    if (grown > size) {
+        printf("<RECV>  Kernel dropped datagrams, receive buffer raised to %d KiB\n", grown / 1024);
+        Stats_max(STATS_RECV_BUFFER_BYTES, grown);
+    } else {
+        worker->buffer_capped[index] = true;
+
+        if (!__atomic_exchange_n(&buffer_cap_shown, true, __ATOMIC_RELAXED)) {
+            printf("<RECV>  Kernel dropped datagrams, receive buffer capped at %d KiB by net.core.rmem_max\n", size / 1024);
+        }
+    }
+}
+
+// Index into bound_addrs of the socket for family, or -1 if none is bound
+static int bound_index(int family) {
+    for (int i = 0; i < num_bound; i++) {
+        if (bound_addrs[i]->ai_family == family) {
+            return i;
+        }
+    }
+
+    return -1;
 }
 
 // Helper function to connect network
 void Network_connect(char *argv[]) {
-    src_connect(&src_hints, &src_res, argv);
-    dest_connect(&dest_hints, &dest_res, argv);
-    socket_bind(&socket_fd, &dest_res, &src_res);
+    if (multicast) {
+        multicast_connect();
+    } else {
+        src_connect(&src_hints, &src_res, argv);
+        dest_connect(&dest_hints, &dest_res, argv);
+    }
+
+    num_workers = Options_get()->recv_workers;
+    Peer_configure_rate(Options_get()->rate_limit, Options_get()->rate_burst);
+    dedup = !Options_get()->no_dedup;
+    header_length = Options_get()->wire_version == 0 ? 0 : PACKET_HEADER_LENGTH;
+
+    if (num_workers < 1 || num_workers > MAX_RECV_WORKERS) {
+        printf("Invalid number of receive workers.\n");
+        printf("Please enter a number between 1 and %d inclusive.\n", MAX_RECV_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+
+    // Every socket in the group gets its own copy, so more workers would only see duplicates
+    if (multicast && num_workers > 1) {
+        printf("--multicast uses a single receive worker.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (multicast) {
+        // Members on one host share the group's port, so each sends from a port of
+        // its own that pongs and the link table can tell apart. It comes first, so
+        // that it is the socket the family sends from.
+        if (socket_bind(&workers[0].socket_fds[0], unicast_res, false) < 0
+        || socket_bind(&workers[0].socket_fds[1], src_res, false) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        bound_addrs[num_bound++] = unicast_res;
+        bound_addrs[num_bound++] = src_res;
+    }
+
+    // The first worker binds every local address it can; the others must match it
+    for (struct addrinfo *res = src_res; res != NULL && num_bound < MAX_BOUND_ADDRESSES; res = res->ai_next) {
+        if (bound_index(res->ai_family) < 0
+        && socket_bind(&workers[0].socket_fds[num_bound], res, num_workers > 1) == 0) {
+            bound_addrs[num_bound++] = res;
+        }
+    }
+
+    if (num_bound == 0) {
+        printf("<SRC>   Failed to bind any local address\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < num_workers; i++) {
+        for (int j = 0; j < num_bound; j++) {
+            if (socket_bind(&workers[i].socket_fds[j], bound_addrs[j], true) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Send to the first destination with a bound socket of the same family
+    for (dest_addr = dest_res; dest_addr != NULL; dest_addr = dest_addr->ai_next) {
+        if (bound_index(dest_addr->ai_family) >= 0) {
+            break;
+        }
+    }
+
+    if (dest_addr == NULL) {
+        printf("<DEST>  No bound socket can reach %s\n", multicast ? group_host : argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (multicast) {
+        join_group(workers[0].socket_fds[1], workers[0].socket_fds[0], dest_addr->ai_addr);
+    }
+
+    // The first worker's socket of that family is also used for sending
+    socket_fd = workers[0].socket_fds[bound_index(dest_addr->ai_family)];
+
+    // Random session, and seq starting at a random point, so that the nonce
+    // (session || seq) has 95 random bits and two processes sharing the key are
+    // not expected to reuse one. The top bit of seq stays clear so it cannot wrap.
+    if (getrandom(&session, sizeof(session), 0) != sizeof(session)
+    || getrandom(&send_seq, sizeof(send_seq), 0) != sizeof(send_seq)) {
+        printf("<DEBUG> Failed to read random session id: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    send_seq &= ~((uint64_t)1 << 63);
 }
 
 // Helper function to free and close network
 void Network_freeaddrinfo(){
     freeaddrinfo(src_res);
     freeaddrinfo(dest_res);
-    close(socket_fd);
+
+    if (multicast) {
+        freeaddrinfo(unicast_res);
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        for (int j = 0; j < num_bound; j++) {
+            close(workers[i].socket_fds[j]);
+        }
+    }
 }
 
-// Thread for sending data
-static void *send_run(void *send_list) {
-    char send_buffer[BUFFER_LENGTH] = "";
-    ssize_t bytes = 0;
+// Cleanup handler so that a thread cancelled in pthread_cond_wait releases its mutex
+static void unlock_mutex(void *mutex) {
+    pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+// Cancel every receive worker except the caller
+static int cancel_recv_workers(Recv_worker *self) {
+    int result = 0;
+
+    for (int i = 0; i < num_queues; i++) {
+        if (&workers[i] != self && pthread_cancel(workers[i].pthread) != 0) {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+// True if a send lane has items (reads pending_send atomically, so no lock is
+// needed; the rings themselves are only touched under send_mutex)
+static bool lanes_ready(void *unused) {
+    return __atomic_load_n(&pending_send, __ATOMIC_ACQUIRE) > 0;
+}
+
+// True if a receive worker has queued messages for the output stage
+static bool received_ready(void *arg) {
+    return __atomic_load_n(&pending_received, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Frame a payload of the given type into datagram, returning the datagram length
+static size_t frame_datagram(uint8_t *datagram, uint8_t type, uint8_t flags, const void *payload, size_t length) {
+    // Version 0 is the text and its NUL, as t-chat sent before the header existed
+    if (header_length == 0) {
+        memcpy(datagram, payload, length);
+        datagram[length] = '\0';
+
+        return length + 1;
+    }
+
+    Packet_header header = {
+        .version = PACKET_VERSION,
+        .type = type,
+        .flags = flags | (Crypto_enabled() ? PACKET_FLAG_SEALED : 0),
+        .session = session,
+        .seq = __atomic_fetch_add(&send_seq, 1, __ATOMIC_RELAXED),
+    };
+
+    Packet_encode_header(&header, datagram);
+    memcpy(datagram + PACKET_HEADER_LENGTH, payload, length);
+
+    return PACKET_HEADER_LENGTH + length;
+}
+
+// Frame chat text into datagram, after its channel's ID unless it is in the
+// default channel. Returns the datagram length.
+static size_t frame_chat(uint8_t *datagram, uint32_t channel, const char *text, size_t length) {
+    uint8_t payload[PACKET_CHANNEL_LENGTH + BUFFER_LENGTH];
+
+    if (channel == 0) {
+        return frame_datagram(datagram, PACKET_CHAT, 0, text, length);
+    }
+
+    Packet_encode_channel(channel, payload);
+    memcpy(payload + PACKET_CHANNEL_LENGTH, text, length);
+
+    return frame_datagram(datagram, PACKET_CHAT, PACKET_FLAG_CHANNEL, payload, PACKET_CHANNEL_LENGTH + length);
+}
+
+// True for the "!" that ends the chat; in a named channel it is just text
+static bool is_exit(uint32_t channel, const char *text) {
+    return channel == 0 && strcmp(text, "!\n") == 0;
+}
+
+// Describe the sealing of a framed datagram
+static void seal_message(Crypto_message *sealed, uint8_t *datagram, size_t length) {
+    Packet_header header;
+
+    Packet_decode_header(&header, datagram, length);
+    Packet_nonce(&header, sealed->nonce);
+    sealed->aad = datagram;
+    sealed->aad_length = PACKET_HEADER_LENGTH;
+    sealed->data = datagram + PACKET_HEADER_LENGTH;
+    sealed->length = length - PACKET_HEADER_LENGTH;
+    sealed->tag = datagram + length;
+}
+
+// Seal and send a single framed datagram on socket fd. Returns 0 on success, -1 on error.
+static int send_datagram(int fd, const struct sockaddr *addr, socklen_t addr_length, uint8_t *datagram, size_t datagram_length) {
+    if (Crypto_enabled()) {
+        Crypto_message sealed;
 
-    while (true) {
-        pthread_mutex_lock(&send_mutex);
+        seal_message(&sealed, datagram, datagram_length);
+        Crypto_seal_batch(&sealed, 1);
+        datagram_length += CRYPTO_TAG_LENGTH;
+    }
+
+    uint64_t span = Trace_begin();
+    int result = 0;
+
+    if (sendto(fd, datagram, datagram_length, 0, addr, addr_length) < 0) {
+        printf("sendto: %s\n", strerror(errno));
+        Stats_add(STATS_SEND_ERRORS, 1);
+        result = -1;
+    }
+
+    Trace_end("sendto", span);
+
+    return result;
+}
+
+// Frame, seal and send a single datagram on socket fd. Returns 0 on success, -1 on error.
+static int send_control(int fd, const struct sockaddr *addr, socklen_t addr_length, uint8_t type, const uint8_t *payload, size_t length) {
+    uint8_t datagram[DATAGRAM_LENGTH];
+
+    return send_datagram(fd, addr, addr_length, datagram, frame_datagram(datagram, type, 0, payload, length));
+}
+
+// Heartbeat callback: ping a peer from the send socket of its family
+static void send_ping(const struct sockaddr *addr, socklen_t addr_length, const uint8_t *payload, size_t length) {
+    int index = bound_index(addr->sa_family);
+
+    if (index >= 0) {
+        send_control(workers[0].socket_fds[index], addr, addr_length, PACKET_PING, payload, length);
+    }
+}
+
+// Shm callback: offer our ring to the peer
+static void send_offer(const uint8_t *name, size_t length) {
+    send_control(socket_fd, dest_addr->ai_addr, dest_addr->ai_addrlen, PACKET_SHM_OFFER, name, length);
+}
+
+// Spool callback: send one replayed message to the peer
+static bool send_spooled(uint32_t channel, const char *text, size_t length) {
+    uint8_t datagram[DATAGRAM_LENGTH];
+
+    if (length > BUFFER_LENGTH - 1) {
+        printf("<SPOOL> Dropped oversized spooled message\n");
+        return true;
+    }
+
+    size_t datagram_length = frame_chat(datagram, channel, text, length);
+
+    if (send_datagram(socket_fd, dest_addr->ai_addr, dest_addr->ai_addrlen, datagram, datagram_length) < 0) {
+        return false;
+    }
+
+    Stats_add(STATS_MSGS_SENT, 1);
+    Stats_add(STATS_BYTES_SENT, datagram_length);
+
+    return true;
+}
+
+// Group the datagrams in iovecs into messages for sendmmsg: with UDP GSO, each run
+// of equal-length datagrams (optionally ending in one shorter datagram) becomes a
+// single message that the kernel splits again, otherwise every datagram is a
+// message of its own. Message m holds datagrams first[m] to first[m + 1] - 1.
+// Returns the number of messages.
+static int coalesce(struct iovec *iovecs, int count, struct mmsghdr *msgs, uint8_t (*controls)[CMSG_SPACE(sizeof(uint16_t))], int *first) {
+    int num_msgs = 0;
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+
+    for (int i = 0; i < count; num_msgs++) {
+        struct msghdr *hdr = &msgs[num_msgs].msg_hdr;
+        size_t size = iovecs[i].iov_len;
+        int end = i + 1;
+
+        if (gso) {
+            while (end < count && end - i < GRO_MAX_SEGMENTS && iovecs[end].iov_len == size) {
+                end++;
+            }
+
+            if (end < count && end - i < GRO_MAX_SEGMENTS && iovecs[end].iov_len < size) {
+                end++;
+            }
+        }
+
+        hdr->msg_name = dest_addr->ai_addr;
+        hdr->msg_namelen = dest_addr->ai_addrlen;
+        hdr->msg_iov = &iovecs[i];
+        hdr->msg_iovlen = end - i;
+
+        if (end - i > 1) {
+            uint16_t segment = size;
+            hdr->msg_control = controls[num_msgs];
+            hdr->msg_controllen = sizeof(controls[num_msgs]);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+
+        first[num_msgs] = i;
+        i = end;
+    }
+
+    first[num_msgs] = count;
+
+    return num_msgs;
+}
+
+// Thread for sending data
+static void *send_run(void *unused) {
+    uint8_t datagrams[BATCH_SIZE][DATAGRAM_LENGTH];
+    struct iovec iovecs[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    uint8_t controls[BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))]; // UDP_SEGMENT sizes
+    int first[BATCH_SIZE + 1];
+    Crypto_message sealed[BATCH_SIZE];
+    Outgoing taken[BATCH_SIZE];
+    Outgoing *sending[BATCH_SIZE]; // Parallel to datagrams
+    Outgoing exit_message;
+    bool exit_taken = false;      // exit_message is held back until the lanes are empty, which
+                                  // they become as nothing is queued after "!"
+    bool exiting = false;
+
+    Trace_thread("send");
+
+    while (!exiting) {
+        int num_taken = 0;
+        int count = 0;
+
+        Waiter_lock_until(&send_wait, &send_mutex, &send_cond, lanes_ready, NULL);
         {
-            while(List_count(send_list) == 0) {
-                pthread_cond_wait(&send_cond, &send_mutex);
+            Trace_counter("send_list", Network_count_send());
+
+            // Drain up to a batch so it can be sealed and sent together: each
+            // round visits the lanes in priority order, taking up to a lane's weight.
+            // A held "!" keeps a slot of the batch for itself.
+            while (num_taken + exit_taken < BATCH_SIZE && Network_count_send() > 0) {
+                for (int lane = 0; lane < NUM_LANES && num_taken + exit_taken < BATCH_SIZE; lane++) {
+                    for (int n = 0; n < lane_weights[lane] && Outgoing_ring_count(&lanes[lane]) > 0 && num_taken + exit_taken < BATCH_SIZE; n++) {
+                        Outgoing *front = Outgoing_ring_front(&lanes[lane]);
+
+                        // Only the used part of the text is copied
+                        memcpy(&taken[num_taken], front, offsetof(Outgoing, text) + front->length + 1);
+                        Outgoing_ring_pop(&lanes[lane]);
+                        __atomic_fetch_sub(&pending_send, 1, __ATOMIC_RELEASE);
+                        Stats_add(lane_counter[lane], 1);
+
+                        // "!" ends the peer's chat too, so whatever was queued in a lower
+                        // lane before it (the rest of a daemon frame or a paste) goes first
+                        if (is_exit(taken[num_taken].channel, taken[num_taken].text)) {
+                            memcpy(&exit_message, &taken[num_taken], sizeof(Outgoing));
+                            exit_taken = true;
+                        } else {
+                            num_taken++;
+                        }
+                    }
+                }
             }
 
-            strcpy(send_buffer, List_last((List *)send_list));
-            free(List_last((List *)send_list));
-            List_trim((List *)send_list);
+            if (exit_taken && Network_count_send() == 0) {
+                memcpy(&taken[num_taken++], &exit_message, sizeof(Outgoing));
+                exiting = true;
+            }
         }
         pthread_mutex_unlock(&send_mutex);
 
-        bytes = sendto(socket_fd, send_buffer, BUFFER_LENGTH, 0, dest_res->ai_addr, sizeof(struct sockaddr_in));
+        for (int i = 0; i < num_taken; i++) {
+            // With --spool, messages the peer can't take now wait on disk ("!" is always sent)
+            if (!is_exit(taken[i].channel, taken[i].text) && Spool_offer(taken[i].channel, taken[i].text, taken[i].length)) {
+                continue;
+            }
+
+            iovecs[count].iov_base = datagrams[count];
+            iovecs[count].iov_len = frame_chat(datagrams[count], taken[i].channel, taken[i].text, taken[i].length);
+            sending[count++] = &taken[i];
+        }
+
+        if (Crypto_enabled()) {
+            for (int i = 0; i < count; i++) {
+                seal_message(&sealed[i], datagrams[i], iovecs[i].iov_len);
+                iovecs[i].iov_len += CRYPTO_TAG_LENGTH;
+            }
+
+            Crypto_seal_batch(sealed, count);
+        }
+
+        uint64_t span = Trace_begin();
+
+        // A peer on this host takes what it can straight from shared memory
+        int shm_sent = Shm_send(iovecs, count);
+
+        for (int i = 0; i < shm_sent; i++) {
+            Stats_add(STATS_BYTES_SENT, iovecs[i].iov_len);
+        }
+
+        Stats_add(STATS_MSGS_SENT, shm_sent);
+
+        for (int sent = shm_sent; sent < count;) {
+            int num_msgs = coalesce(iovecs + sent, count - sent, msgs, controls, first);
+            int result = sendmmsg(socket_fd, msgs, num_msgs, 0);
+
+            // Fall back to one datagram per message if the route can't segment
+            if (result < 0 && first[1] > 1 && (errno == EIO || errno == EINVAL)) {
+                printf("<SEND>  UDP GSO failed (%s), sending datagrams one by one\n", strerror(errno));
+                gso = false;
+                continue;
+            }
+
+            if (result < 0) {
+                printf("sendmmsg: %s\n", strerror(errno));
+                Stats_add(STATS_SEND_ERRORS, 1);
+
+                // Spool the rest of the batch to keep it in order, or drop the first
+                // datagram of the message that failed and retry the rest of its run
+                if (Spool_enabled()) {
+                    for (; sent < count; sent++) {
+                        if (!is_exit(sending[sent]->channel, sending[sent]->text)) {
+                            Spool_store(sending[sent]->channel, sending[sent]->text, sending[sent]->length);
+                        }
+                    }
+                } else {
+                    sent++;
+                }
+
+                continue;
+            }
+
+            for (int i = 0; i < result; i++) {
+                Stats_add(STATS_BYTES_SENT, msgs[i].msg_len);
 
-        if (bytes < 0) {
-            printf("send_to: %s\n", strerror(errno));
+                if (first[i + 1] - first[i] > 1) {
+                    Stats_add(STATS_SEND_SEGMENTED, first[i + 1] - first[i]);
+                }
+            }
+
+            Stats_add(STATS_MSGS_SENT, first[result]);
+            sent += first[result];
         }
-        
-        if (strcmp(send_buffer, "!\n") == 0) {
+
+        Trace_end("sendmmsg", span);
+
+        if (exiting) {
             pthread_cond_signal(&send_cond);
             break;
         }
 
-        pthread_mutex_lock(&send_mutex);
+        Stats_lock(&send_mutex, STATS_SEND_MUTEX_NS, "wait send_mutex");
         {
             pthread_cond_signal(&send_cond);
         }
@@ -200,7 +946,7 @@ static void *send_run(void *send_list) {
     int recv_cancel_result = 0;
     int send_cancel_result = 0;
 
-    recv_cancel_result = pthread_cancel(recv_pthread);
+    recv_cancel_result = cancel_recv_workers(NULL);
     send_cancel_result = pthread_cancel(send_pthread);
 
     if (recv_cancel_result < 0 || send_cancel_result < 0) {
@@ -210,58 +956,474 @@ static void *send_run(void *send_list) {
     return NULL;
 }
 
+// Check a received datagram's framing, preparing it for opening if it is sealed.
+// Returns the payload length, or -1 if the datagram must be dropped.
+static ssize_t check_datagram(Recv_worker *worker, uint8_t *datagram, size_t length, Packet_header *header, Crypto_message *sealed) {
+    // Version 0 text ends at its NUL, or is cut to what a message can hold
+    if (header_length == 0) {
+        *header = (Packet_header){ .type = PACKET_CHAT };
+
+        return strnlen((const char *)datagram, length < BUFFER_LENGTH ? length : BUFFER_LENGTH - 1);
+    }
+
+    if (Packet_decode_header(header, datagram, length) < 0
+    || (header->type != PACKET_CHAT && header->type != PACKET_PING && header->type != PACKET_PONG
+        && header->type != PACKET_SHM_OFFER)) {
+        printf("<RECV>  Dropped malformed datagram\n");
+        return -1;
+    }
+
+    // The group loops our own datagrams back to us
+    if (multicast && header->session == session) {
+        return -1;
+    }
+
+    bool is_sealed = (header->flags & PACKET_FLAG_SEALED) != 0;
+
+    if (is_sealed != Crypto_enabled()) {
+        printf("<RECV>  Dropped %s datagram (both sides must use the same --psk)\n",
+            is_sealed ? "encrypted" : "unencrypted");
+        return -1;
+    }
+
+    ssize_t payload_length = length - PACKET_HEADER_LENGTH - (is_sealed ? CRYPTO_TAG_LENGTH : 0);
+    ssize_t channel_length = (header->flags & PACKET_FLAG_CHANNEL) ? PACKET_CHANNEL_LENGTH : 0;
+
+    if (payload_length < channel_length || payload_length > channel_length + BUFFER_LENGTH - 1) {
+        printf("<RECV>  Dropped malformed datagram\n");
+        return -1;
+    }
+
+    // Replays are looked for once the datagram is opened, as the session can then be trusted
+    if (is_sealed) {
+        seal_message(sealed, datagram, length - CRYPTO_TAG_LENGTH);
+    }
+
+    return payload_length;
+}
+
+// Poll the worker's sockets without blocking for up to the spin budget. Returns
+// the number of datagrams read, 0 if the budget ran out, or -1 on error.
+static int recv_spin(Recv_worker *worker, struct mmsghdr *msgs) {
+    uint64_t start = Waiter_now_ns();
+
+    do {
+        for (int i = 0; i < num_bound; i++) {
+            int j = (worker->next_socket + i) % num_bound;
+            int count = recvmmsg(worker->socket_fds[j], msgs, worker->batch, MSG_DONTWAIT, NULL);
+
+            if (count > 0) {
+                worker->recv_fd = worker->socket_fds[j];
+                worker->recv_index = j;
+                worker->next_socket = (j + 1) % num_bound;
+                Stats_add(STATS_RECV_SPIN_HITS, 1);
+                return count;
+            }
+
+            if (count < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+
+        Waiter_relax();
+    } while (Waiter_now_ns() - start < Waiter_spin_ns());
+
+    return 0;
+}
+
+// Account for datagrams the kernel dropped before this batch, from the socket's
+// SO_RXQ_OVFL count carried by each datagram, and grow the buffer if there were any
+static void count_kernel_drops(Recv_worker *worker, struct mmsghdr *msgs, int count) {
+    uint32_t *last = &worker->kernel_drops[worker->recv_index];
+    uint32_t drops = *last;
+
+    for (int i = 0; i < count; i++) {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t value;
+
+                memcpy(&value, CMSG_DATA(cmsg), sizeof(value));
+
+                // The count only grows (modulo 2^32), so keep the newest
+                if ((int32_t)(value - drops) > 0) {
+                    drops = value;
+                }
+            }
+        }
+    }
+
+    if (drops != *last) {
+        Stats_add(STATS_RECV_KERNEL_DROPS, drops - *last);
+        *last = drops;
+        grow_buffer(worker, worker->recv_index);
+    }
+}
+
+// Read a batch from whichever of the worker's sockets is readable
+static int recv_batch(Recv_worker *worker, struct mmsghdr *msgs) {
+    if (Waiter_spin_ns() > 0) {
+        uint64_t span = Trace_begin();
+        int count = recv_spin(worker, msgs);
+
+        Trace_end("recv spin", span);
+
+        if (count != 0) {
+            return count;
+        }
+
+        Stats_add(STATS_RECV_BLOCKS, 1);
+    }
+
+    if (num_bound == 1) {
+        uint64_t span = Trace_begin();
+
+        worker->recv_fd = worker->socket_fds[0];
+        worker->recv_index = 0;
+        int count = recvmmsg(worker->socket_fds[0], msgs, worker->batch, MSG_WAITFORONE, NULL);
+
+        Trace_end("recvmmsg", span);
+
+        return count;
+    }
+
+    struct pollfd fds[MAX_BOUND_ADDRESSES];
+
+    for (int i = 0; i < num_bound; i++) {
+        fds[i].fd = worker->socket_fds[i];
+        fds[i].events = POLLIN;
+    }
+
+    uint64_t span = Trace_begin();
+
+    if (poll(fds, num_bound, -1) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    Trace_end("poll", span);
+
+    // Take turns so a busy family cannot starve the other
+    for (int i = 0; i < num_bound; i++) {
+        int j = (worker->next_socket + i) % num_bound;
+
+        if (fds[j].revents & (POLLIN | POLLERR)) {
+            worker->recv_fd = fds[j].fd;
+            worker->recv_index = j;
+            worker->next_socket = (j + 1) % num_bound;
+            span = Trace_begin();
+            int count = recvmmsg(fds[j].fd, msgs, worker->batch, MSG_DONTWAIT, NULL);
+
+            Trace_end("recvmmsg", span);
+
+            return (count < 0 && errno == EAGAIN) ? 0 : count;
+        }
+    }
+
+    return 0;
+}
+
+// Split the batch's reads into datagrams, undoing UDP_GRO coalescing: a read with
+// a segment size holds datagrams of that size, the last of them possibly shorter.
+// Returns the number of datagrams.
+static int split_reads(struct mmsghdr *msgs, int count, Segment *segments) {
+    int num_segments = 0;
+
+    for (int i = 0; i < count; i++) {
+        int first = num_segments;
+        uint8_t *data = msgs[i].msg_hdr.msg_iov->iov_base;
+        size_t length = msgs[i].msg_len;
+        size_t size = length;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                size = segment > 0 ? (size_t)segment : length;
+            }
+        }
+
+        do {
+            size_t part = length < size ? length : size;
+
+            if (num_segments == MAX_SEGMENTS) {
+                printf("<RECV>  Dropped datagrams beyond %d in one batch\n", MAX_SEGMENTS);
+                return num_segments;
+            }
+
+            segments[num_segments++] = (Segment){ .data = data, .length = part, .msg = i };
+            data += part;
+            length -= part;
+        } while (length > 0);
+
+        if (num_segments - first > 1) {
+            Stats_add(STATS_RECV_COALESCED, num_segments - first);
+        }
+    }
+
+    return num_segments;
+}
+
 // Thread for receiving data
-static void *recv_run(void *recv_list) {
-    char recv_buffer[BUFFER_LENGTH] = "";
-    ssize_t bytes = 0;
+static void *recv_run(void *arg) {
+    Recv_worker *worker = arg;
+    struct iovec iovecs[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct sockaddr_storage senders[BATCH_SIZE];
+    uint8_t controls[BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int))]; // SO_RXQ_OVFL, UDP_GRO
+    Segment segments[MAX_SEGMENTS];
+    Packet_header headers[MAX_SEGMENTS]; // Parallel to segments
+    ssize_t lengths[MAX_SEGMENTS];
+    Crypto_message sealed[MAX_SEGMENTS];
+    int sealed_index[MAX_SEGMENTS];
+    char text[SANITIZE_MAX_OUTPUT(BUFFER_LENGTH) + 1];
+    bool exiting = false;
+
+    Trace_thread("recv worker");
+
+    while (!exiting) {
+        memset(msgs, 0, sizeof(msgs));
+
+        for (int i = 0; i < worker->batch; i++) {
+            msgs[i].msg_hdr.msg_name = &senders[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+            iovecs[i].iov_base = worker->reads + i * worker->read_length;
+            iovecs[i].iov_len = worker->read_length;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = controls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
 
-    while (true) {
-        newstr = malloc(BUFFER_LENGTH + 1);
-        memset(newstr, '\0', BUFFER_LENGTH + 1);
-    
-        bytes = recvfrom(socket_fd, recv_buffer, sizeof(recv_buffer), 0,
-                 NULL, NULL); 
+        int count = worker->shm
+            ? Shm_receive(worker->reads, worker->read_length, msgs, worker->batch)
+            : recv_batch(worker, msgs);
 
-        if (bytes < 0) {
-            printf("recvfrom: %s\n", strerror(errno));
+        if (count < 0) {
+            printf("recvmmsg: %s\n", strerror(errno));
+            Stats_add(STATS_RECV_ERRORS, 1);
+            continue;
         }
 
-        recv_buffer[bytes] = '\0';
-        
-        strncpy(newstr, recv_buffer, bytes);
+        count_kernel_drops(worker, msgs, count);
 
-        pthread_mutex_lock(&recv_mutex);
-        {
-            if(List_count(recv_list) == (LIST_MAX_NUM_NODES / 2)) {
-                printf("List is full! -> %s\n", newstr);
+        int num_segments = split_reads(msgs, count, segments);
+
+        // Capture the batch as it came off the socket, before anything is dropped or opened
+        if (Record_enabled()) {
+            for (int i = 0; i < num_segments; i++) {
+                Record_add(RECORD_DATAGRAM, segments[i].data, segments[i].length);
+            }
+        }
+
+        int num_sealed = 0;
+        uint64_t now = Peer_rate_limited() || dedup ? Waiter_now_ns() : 0;
+
+        for (int i = 0; i < num_segments; i++) {
+            struct msghdr *hdr = &msgs[segments[i].msg].msg_hdr;
+
+            // Flooding senders are turned away before any parsing or copying
+            if (Peer_rate_limited()) {
+                Peer *peer = Peer_lookup(worker->peers, hdr->msg_name, hdr->msg_namelen, now);
+
+                if (!Peer_allow(peer, now)) {
+                    Stats_add(STATS_RECV_RATE_LIMITED, 1);
+                    lengths[i] = -1;
+                    continue;
+                }
+            }
+
+            if (hdr->msg_flags & MSG_TRUNC) {
+                printf("<RECV>  Dropped oversized datagram\n");
+                lengths[i] = -1;
+                continue;
+            }
+
+            lengths[i] = check_datagram(worker, segments[i].data, segments[i].length, &headers[i], &sealed[num_sealed]);
+
+            if (lengths[i] >= 0 && Crypto_enabled()) {
+                sealed_index[num_sealed++] = i;
+            }
+        }
+
+        // Open every sealed datagram of the batch together
+        if (num_sealed > 0) {
+            Crypto_open_batch(sealed, num_sealed);
+
+            // Once per batch, and with nothing in between that could cancel the thread
+            pthread_mutex_lock(&replay_mutex);
+            {
+                for (int j = 0; j < num_sealed; j++) {
+                    int i = sealed_index[j];
+
+                    if (!sealed[j].ok) {
+                        continue;
+                    }
+
+                    if (Packet_window_check(&replay_window, headers[i].session, headers[i].seq)) {
+                        Packet_window_update(&replay_window, headers[i].session, headers[i].seq);
+                    } else {
+                        lengths[i] = -1;
+                    }
+                }
+            }
+            pthread_mutex_unlock(&replay_mutex);
+
+            for (int j = 0; j < num_sealed; j++) {
+                int i = sealed_index[j];
+
+                if (!sealed[j].ok) {
+                    printf("<RECV>  Dropped datagram that failed authentication\n");
+                    lengths[i] = -1;
+                } else if (lengths[i] < 0) {
+                    printf("<RECV>  Dropped replayed datagram\n");
+                }
+            }
+        }
+
+        // Answer pings, account for pongs and take up ring offers; none reach the screen
+        for (int i = 0; i < num_segments; i++) {
+            const struct msghdr *hdr = &msgs[segments[i].msg].msg_hdr;
+            const struct sockaddr *sender = hdr->msg_name;
+            const uint8_t *payload = segments[i].data + header_length;
+
+            if (lengths[i] < 0 || headers[i].type == PACKET_CHAT) {
+                continue;
+            }
+
+            // Group pings arrive on the group's port, but are answered from our own
+            if (headers[i].type == PACKET_PING) {
+                send_control(multicast ? socket_fd : worker->recv_fd, sender, hdr->msg_namelen, PACKET_PONG, payload, lengths[i]);
+                Shm_heard(sender, headers[i].session);
+            } else if (headers[i].type == PACKET_SHM_OFFER) {
+                Shm_offered(sender, headers[i].session, payload, lengths[i]);
             } else {
-                List_prepend((List *)recv_list, newstr);
+                Link_pong(sender, payload, lengths[i]);
             }
+
+            lengths[i] = -1;
         }
-        pthread_mutex_unlock(&recv_mutex);
 
-        newstr = NULL;
+        int delivered = 0;
+
+        for (int i = 0; i < num_segments && !exiting; i++) {
+            const struct msghdr *hdr = &msgs[segments[i].msg].msg_hdr;
+
+            if (lengths[i] < 0) {
+                continue;
+            }
+
+            // Copies of a message already delivered go no further. This comes after
+            // authentication, so forged IDs cannot hide real messages.
+            if (dedup) {
+                Peer *peer = Peer_lookup(worker->peers, hdr->msg_name, hdr->msg_namelen, now);
+
+                if (!Dedup_check(&peer->dedup, worker->bloom, headers[i].session, headers[i].seq)) {
+                    continue;
+                }
+            }
+
+            // Messages for channels that were never joined go no further either
+            const uint8_t *payload = segments[i].data + header_length;
+            uint32_t channel = 0;
+
+            if (headers[i].flags & PACKET_FLAG_CHANNEL) {
+                channel = Packet_decode_channel(payload);
+                payload += PACKET_CHANNEL_LENGTH;
+                lengths[i] -= PACKET_CHANNEL_LENGTH;
+
+                if (!Channel_joined(channel)) {
+                    Stats_add(STATS_RECV_UNJOINED, 1);
+                    continue;
+                }
+            }
+
+            // Escape terminal controls before the text goes anywhere
+            size_t replaced;
+            size_t length = Sanitize_text(text, (const char *)payload, lengths[i], &replaced);
+
+            if (replaced > 0) {
+                Stats_add(STATS_RECV_SANITIZED, 1);
+            }
 
-        if (strcmp(recv_buffer, "!\n") == 0) {
-            pthread_cond_signal(&recv_cond);
+            worker->newmsg = Message_create(text, length);
+
+            if (worker->newmsg == NULL) {
+                printf("<RECV>  Out of memory\n");
+                continue;
+            }
+
+            memcpy(&worker->newmsg->sender, hdr->msg_name, hdr->msg_namelen);
+            worker->newmsg->sender_length = hdr->msg_namelen;
+            worker->newmsg->channel = channel;
+
+            // In a group "!" only means that its sender left
+            if (multicast && is_exit(channel, worker->newmsg->text)) {
+                Link_left(hdr->msg_name);
+                free(worker->newmsg);
+                worker->newmsg = NULL;
+                continue;
+            }
+
+            exiting = is_exit(channel, worker->newmsg->text);
+
+            Stats_lock(&worker->mutex, STATS_WORKER_MUTEX_NS, "wait worker mutex");
+            {
+                Message **slot = Message_ring_push(&worker->queue);
+
+                if (slot == NULL) {
+                    printf("List is full! -> %s\n", worker->newmsg->text);
+                    Stats_add(STATS_RECV_LIST_FULL, 1);
+                    free(worker->newmsg);
+                } else {
+                    Stats_add(STATS_MSGS_RECEIVED, 1);
+                    Stats_add(STATS_BYTES_RECEIVED, worker->newmsg->length);
+                    *slot = worker->newmsg;
+                    delivered++;
+                }
+            }
+            pthread_mutex_unlock(&worker->mutex);
+
+            worker->newmsg = NULL;
+        }
+
+        if (dedup) {
+            Dedup_flush(worker->bloom);
+        }
+
+        // Wake the output stage
+        if (delivered > 0) {
+            Stats_lock(&recv_mutex, STATS_RECV_MUTEX_NS, "wait recv_mutex");
+            {
+                int pending = __atomic_add_fetch(&pending_received, delivered, __ATOMIC_RELEASE);
+
+                Stats_max(STATS_RECV_LIST_HIGH, pending);
+                Trace_counter("received", pending);
+                Waiter_notify(&recv_wait);
+                pthread_cond_signal(&recv_cond);
+            }
+            pthread_mutex_unlock(&recv_mutex);
+        }
+
+        if (exiting) {
             break;
         }
 
-        pthread_mutex_lock(&recv_mutex);
+        // Wait for the output stage to drain this worker's queue
+        Stats_lock(&worker->mutex, STATS_WORKER_MUTEX_NS, "wait worker mutex");
+        pthread_cleanup_push(unlock_mutex, &worker->mutex);
         {
-            if(List_count(recv_list) != (LIST_MAX_NUM_NODES / 2)) {
-                pthread_cond_signal(&recv_cond);
-                pthread_cond_wait(&recv_cond, &recv_mutex);
-            } 
+            while (Message_ring_count(&worker->queue) > 0) {
+                Stats_cond_wait(&worker->cond, &worker->mutex, STATS_WORKER_COND_NS, "sleep worker cond");
+            }
         }
-        pthread_mutex_unlock(&recv_mutex);
+        pthread_cleanup_pop(1);
     }
 
     int recv_cancel_result = 0;
     int send_cancel_result = 0;
 
     send_cancel_result = pthread_cancel(send_pthread);
-    recv_cancel_result = pthread_cancel(recv_pthread);
+    recv_cancel_result = cancel_recv_workers(worker);
 
     if (recv_cancel_result < 0 || send_cancel_result < 0) {
         printf("Error cancelling keyboard or screen thread.\n");
@@ -270,16 +1432,195 @@ static void *recv_run(void *recv_list) {
     return NULL;
 }
 
+// Turn on UDP GSO for send_run and UDP GRO on every receive socket, where the
+// kernel has them and --no-offload is not given
+static void enable_offload() {
+    int zero = 0;
+    int enable = 1;
+
+    if (Options_get()->no_offload) {
+        return;
+    }
+
+    gso = setsockopt(socket_fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+    gro = true;
+
+    for (int i = 0; i < num_workers; i++) {
+        for (int j = 0; j < num_bound; j++) {
+            gro = gro && setsockopt(workers[i].socket_fds[j], SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+        }
+    }
+
+    // Coalesced reads need the large buffers, so it is all sockets or none
+    if (!gro) {
+        for (int i = 0; i < num_workers; i++) {
+            for (int j = 0; j < num_bound; j++) {
+                setsockopt(workers[i].socket_fds[j], SOL_UDP, UDP_GRO, &zero, sizeof(zero));
+            }
+        }
+    }
+
+    printf("<DEBUG> UDP GSO %s, UDP GRO %s\n", gso ? "on" : "unavailable", gro ? "on" : "unavailable");
+}
+
 // Helper function to start network threads
-void Network_start_chat(List *recv_list, List *send_list) {
+void Network_start_chat() {
     int recv_result = 0;
     int send_result = 0;
 
-    if ((recv_result = pthread_create(&recv_pthread, NULL, recv_run, recv_list)) != 0
-    || (send_result = pthread_create(&send_pthread, NULL, send_run, send_list)) != 0) {
+    enable_offload();
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        lane_weights[lane] = Options_get()->lane_weights[lane];
+
+        if (Outgoing_ring_init(&lanes[lane], lane_capacity[lane]) < 0) {
+            printf("Error creating send lanes. Exiting\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    num_queues = num_workers;
+
+    // A peer on this host gets a shared-memory ring, read by one more worker
+    if (!multicast && !Options_get()->no_shm
+    && Shm_start(dest_addr->ai_addr, dest_addr->ai_addrlen, session, send_offer)) {
+        workers[num_workers].shm = true;
+        num_queues = num_workers + 1;
+    }
+
+    // Worker queues share RECV_QUEUE_CAPACITY
+    int capacity = RECV_QUEUE_CAPACITY / num_queues;
+
+    for (int i = 0; i < num_queues; i++) {
+        Recv_worker *worker = &workers[i];
+
+        worker->id = i;
+        worker->batch = capacity < BATCH_SIZE ? capacity : BATCH_SIZE;
+        worker->peers = Peer_table_create();
+        worker->bloom = Dedup_bloom_create();
+        worker->read_length = gro && !worker->shm ? GRO_READ_LENGTH : DATAGRAM_LENGTH;
+        worker->reads = malloc(worker->batch * worker->read_length);
+
+        for (int j = 0; j < num_bound && !worker->shm; j++) {
+            size_buffers(worker->socket_fds[j], capacity);
+        }
+
+        if (Message_ring_init(&worker->queue, capacity) < 0
+        || worker->peers == NULL
+        || worker->bloom == NULL
+        || worker->reads == NULL
+        || pthread_mutex_init(&worker->mutex, NULL) != 0
+        || pthread_cond_init(&worker->cond, NULL) != 0) {
+            printf("Error creating receive worker queue. Exiting\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < num_queues && recv_result == 0; i++) {
+        recv_result = pthread_create(&workers[i].pthread, NULL, recv_run, &workers[i]);
+
+        // Each worker gets its own core
+        if (recv_result == 0 && (num_workers > 1 || Options_get()->pin)) {
+            Affinity_pin(workers[i].pthread, "receive worker");
+        }
+    }
+
+    if (recv_result != 0
+    || (send_result = pthread_create(&send_pthread, NULL, send_run, NULL)) != 0) {
         printf("Error creating recv or send thread. Exiting\n");
         exit(EXIT_FAILURE);
     }
+
+    if (Options_get()->pin) {
+        Affinity_pin(send_pthread, "send");
+    }
+
+    Link_start(Options_get()->heartbeat_ms, send_ping);
+    if (multicast) {
+        Link_add_group(dest_addr->ai_addr, dest_addr->ai_addrlen);
+    } else {
+        Link_add(dest_addr->ai_addr, dest_addr->ai_addrlen);
+    }
+
+    if (Options_get()->spool_path != NULL) {
+        Spool_open(Options_get()->spool_path, dest_addr->ai_addr, dest_addr->ai_addrlen, send_spooled);
+    }
+}
+
+// Copy a message into lane for send_run (call with the send mutex held).
+// Returns -1 if the lane is full, or once "!" has been queued: send_run holds
+// "!" until the lanes are empty, so nothing may join them after it.
+int Network_queue_send(Network_lane lane, uint32_t channel, const char *text, size_t length) {
+    Outgoing *outgoing = exit_queued ? NULL : Outgoing_ring_push(&lanes[lane]);
+
+    if (outgoing == NULL) {
+        return -1;
+    }
+
+    assert(length <= BUFFER_LENGTH);
+    outgoing->channel = channel;
+    outgoing->length = length;
+    memcpy(outgoing->text, text, length);
+    outgoing->text[length] = '\0';
+    __atomic_add_fetch(&pending_send, 1, __ATOMIC_RELEASE);
+    exit_queued = is_exit(channel, outgoing->text);
+
+    Stats_max(STATS_SEND_LIST_HIGH, Network_count_send());
+    Trace_counter("send_list", Network_count_send());
+
+    return 0;
+}
+
+// Number of messages waiting for send_run in all lanes (call with the send mutex held)
+int Network_count_send() {
+    return __atomic_load_n(&pending_send, __ATOMIC_ACQUIRE);
+}
+
+// Number of received messages waiting for the output stage (call with the recv mutex held)
+int Network_count_received() {
+    return __atomic_load_n(&pending_received, __ATOMIC_ACQUIRE);
+}
+
+// Lock the recv mutex once a received message is waiting, spinning first in
+// --low-latency mode
+void Network_lock_received() {
+    Waiter_lock_until(&recv_wait, &recv_mutex, &recv_cond, received_ready, NULL);
+}
+
+// Record that a message was queued for send_run (call before signalling the send condition)
+void Network_notify_send() {
+    Waiter_notify(&send_wait);
+}
+
+// Takes the next received message, visiting the worker queues round-robin
+// (call with the recv mutex held). Returns NULL if none is waiting; the caller
+// frees the message.
+Message *Network_take_received() {
+    for (int i = 0; i < num_queues; i++) {
+        Recv_worker *worker = &workers[(next_worker + i) % num_queues];
+        Message *message = NULL;
+
+        Stats_lock(&worker->mutex, STATS_WORKER_MUTEX_NS, "wait worker mutex");
+        {
+            if (Message_ring_count(&worker->queue) > 0) {
+                message = *Message_ring_front(&worker->queue);
+                Message_ring_pop(&worker->queue);
+
+                if (Message_ring_count(&worker->queue) == 0) {
+                    pthread_cond_signal(&worker->cond);
+                }
+            }
+        }
+        pthread_mutex_unlock(&worker->mutex);
+
+        if (message != NULL) {
+            next_worker = (worker->id + 1) % num_queues;
+            __atomic_fetch_sub(&pending_received, 1, __ATOMIC_RELEASE);
+            return message;
+        }
+    }
+
+    return NULL;
 }
 
 // Helper function that cancels pthreads (called by UI)
@@ -299,7 +1640,7 @@ void Network_cancel_pthreads() {
     int recv_cancel_result = 0;
     int send_cancel_result = 0;
 
-    recv_cancel_result = pthread_cancel(recv_pthread);
+    recv_cancel_result = cancel_recv_workers(NULL);
     send_cancel_result = pthread_cancel(send_pthread);
 
     if (recv_cancel_result < 0 || send_cancel_result < 0) {
@@ -330,9 +1671,31 @@ void Network_exit_chat() {
         printf("Error destroying recv or send condition variable.\n");
     }
 
-    if (newstr) {
-        free(newstr);
-        newstr = NULL;
+    for (int i = 0; i < num_queues; i++) {
+        Recv_worker *worker = &workers[i];
+
+        if (pthread_mutex_destroy(&worker->mutex) != 0 || pthread_cond_destroy(&worker->cond) != 0) {
+            printf("Error destroying receive worker mutex or condition variable.\n");
+        }
+
+        if (worker->newmsg) {
+            free(worker->newmsg);
+            worker->newmsg = NULL;
+        }
+
+        Peer_table_free(worker->peers);
+        worker->peers = NULL;
+        Dedup_bloom_free(worker->bloom);
+        worker->bloom = NULL;
+
+        free(worker->reads);
+        worker->reads = NULL;
+
+        Message_ring_destroy(&worker->queue);
+    }
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        Outgoing_ring_destroy(&lanes[lane]);
     }
 }
 
@@ -341,11 +1704,19 @@ void Network_join_threads() {
     int recv_result = 0;
     int send_result = 0;
 
-    if ((recv_result = pthread_join(recv_pthread, NULL)) != 0
+    for (int i = 0; i < num_queues && recv_result == 0; i++) {
+        recv_result = pthread_join(workers[i].pthread, NULL);
+    }
+
+    if (recv_result != 0
     || (send_result = pthread_join(send_pthread, NULL)) != 0) {
         printf("Error joining recv or send thread. Exiting\n");
         exit(EXIT_FAILURE);
     }
+
+    Spool_close();
+    Link_stop();
+    Shm_stop();
 }
 
 // Getter for recv mutex
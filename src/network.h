@@ -7,23 +7,66 @@
 #include <sys/types.h>
 #include <netdb.h>
 
-#include "list.h"
+#include "crypto.h"
+#include "message.h"
+#include "packet.h"
 
 // Macros
 #define ARG_COUNT 4
 #define MIN_PORT 1024
 #define MAX_PORT 65535
 #define BUFFER_LENGTH 512
+#define DATAGRAM_LENGTH (PACKET_HEADER_LENGTH + PACKET_CHANNEL_LENGTH + BUFFER_LENGTH + CRYPTO_TAG_LENGTH)
+#define BATCH_SIZE 16
+#define MAX_RECV_WORKERS 8
+#define SEND_QUEUE_CAPACITY 50  // Messages waiting for send_run, across the lanes
+#define RECV_QUEUE_CAPACITY 50  // Messages waiting for the output stage, across the receive workers
+#define MAX_BOUND_ADDRESSES 2 // One IPv4 and one IPv6 socket
+#define SOCKET_BUFFER_PER_DATAGRAM 2304       // Kernel memory charged for one small datagram
+#define SOCKET_BUFFER_MAX (16 * 1024 * 1024)  // Receive buffers stop growing here
+#define GRO_READ_LENGTH 65535                  // Largest read UDP_GRO can coalesce datagrams into
+#define GRO_MAX_SEGMENTS 64                    // Most datagrams in one coalesced read or UDP_SEGMENT send
+#define MAX_SEGMENTS (BATCH_SIZE * GRO_MAX_SEGMENTS)
+
+// Send lanes, highest priority first. send_run takes up to a lane's weight
+// (--lane-weights) from each in turn, so a backlog in one lane delays the
+// lanes above it by at most one batch, and each lane has its own capacity, so
+// a full lane never turns away messages of another.
+typedef enum Network_lane_e Network_lane;
+enum Network_lane_e {
+    LANE_CONTROL,   // "!" and anything else that must not wait behind chat
+    LANE_CHAT,      // Lines typed one at a time
+    LANE_BULK,      // Pastes and multi-message daemon submits
+    NUM_LANES
+};
+
+#define LANE_CONTROL_CAPACITY 4
+#define LANE_CHAT_CAPACITY 16
+#define LANE_BULK_CAPACITY (SEND_QUEUE_CAPACITY - LANE_CONTROL_CAPACITY - LANE_CHAT_CAPACITY)
 
 // Prototypes
 void Network_connect(char *argv[]);
 void Network_check_args(int argc, char *argv[]);
 void Network_freeaddrinfo();
-void Network_start_chat(List *recv_list, List *send_list);
+void Network_start_chat();
 void Network_join_threads();
 void Network_exit_chat();
 void Network_cancel_pthreads();
 
+// Output stage access to the receive worker queues (call with the recv mutex held)
+int Network_count_received();
+Message *Network_take_received();
+
+// Lock the recv mutex once a received message is waiting
+void Network_lock_received();
+
+// Queue a message for send_run on a lane, or count what is queued (call with the send mutex held)
+int Network_queue_send(Network_lane lane, uint32_t channel, const char *text, size_t length);
+int Network_count_send();
+
+// Record that a message was queued for send_run (call before signalling the send condition)
+void Network_notify_send();
+
 // Mutex and condition variable getters
 pthread_mutex_t *Network_get_recv_mutex();
 pthread_mutex_t *Network_get_send_mutex();
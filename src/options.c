@@ -0,0 +1,286 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "packet.h"
+#include "scrollback.h"
+
+// Default spin budget of --low-latency, in microseconds
+#define OPTIONS_DEFAULT_SPIN_USEC 50
+
+// Default heartbeat interval, in milliseconds
+#define OPTIONS_DEFAULT_HEARTBEAT_MS 1000
+
+// Default period of --stats-file, in milliseconds
+#define OPTIONS_DEFAULT_STATS_INTERVAL_MS 1000
+
+// Default hop limit of --multicast datagrams (stay on the local network)
+#define OPTIONS_DEFAULT_MULTICAST_TTL 1
+
+// Default --lane-weights: control effectively always first, then chat 4 to 1 over bulk
+#define OPTIONS_DEFAULT_CONTROL_WEIGHT 16
+#define OPTIONS_DEFAULT_CHAT_WEIGHT 4
+#define OPTIONS_DEFAULT_BULK_WEIGHT 1
+
+// Static variables
+static Options options;
+static int positional_argc;
+static char **positional_argv;
+
+static const struct option long_options[] = {
+    {"log",  required_argument, NULL, 'l'},
+    {"psk",  required_argument, NULL, 'k'},
+    {"recv-workers", required_argument, NULL, 'w'},
+    {"low-latency", optional_argument, NULL, 'L'},
+    {"pin",  no_argument,       NULL, 'P'},
+    {"daemon", required_argument, NULL, 'd'},
+    {"rate-limit", required_argument, NULL, 'r'},
+    {"heartbeat", required_argument, NULL, 'H'},
+    {"trace", required_argument, NULL, 'T'},
+    {"stats-file", required_argument, NULL, 'S'},
+    {"stats-interval", required_argument, NULL, 'I'},
+    {"spool", required_argument, NULL, 's'},
+    {"record", required_argument, NULL, 'R'},
+    {"multicast", required_argument, NULL, 'M'},
+    {"multicast-ttl", required_argument, NULL, 't'},
+    {"no-multicast-loop", no_argument, NULL, 'N'},
+    {"no-offload", no_argument, NULL, 'G'},
+    {"no-shm", no_argument, NULL, 'u'},
+    {"tui", no_argument, NULL, 'i'},
+    {"scrollback", required_argument, NULL, 'B'},
+    {"no-dedup", no_argument, NULL, 'D'},
+    {"lane-weights", required_argument, NULL, 'W'},
+    {"wire-version", required_argument, NULL, 'V'},
+    {"help", no_argument,       NULL, 'h'},
+    {NULL,   0,                 NULL, 0}
+};
+
+// Print usage and the list of options
+void Options_usage() {
+    printf("Usage: ./t-chat [options] [my port number] [remote machine name] [remote port number]\n");
+    printf("       ./t-chat [options] --multicast <group>:<port>\n");
+    printf("Options:\n");
+    printf("  -l, --log <file>          Persist the chat to <file> and enable /search\n");
+    printf("  -k, --psk <file>          Encrypt datagrams with the pre-shared key in <file> (64 hex characters)\n");
+    printf("  -w, --recv-workers <n>    Receive on n SO_REUSEPORT sockets, one thread per core (default 1)\n");
+    printf("  -L, --low-latency[=usec]  Spin up to usec (default %d) before sleeping, trading CPU for latency\n",
+        OPTIONS_DEFAULT_SPIN_USEC);
+    printf("  -P, --pin                 Pin every thread to its own core\n");
+    printf("  -d, --daemon <socket>     Serve local clients on a Unix domain socket instead of the terminal\n");
+    printf("  -r, --rate-limit <r>[/<b>] Accept r datagrams per second from each sender, b at once (default b = r)\n");
+    printf("  -H, --heartbeat <ms>      Ping the peer every ms milliseconds, 0 to disable (default %d)\n",
+        OPTIONS_DEFAULT_HEARTBEAT_MS);
+    printf("  -T, --trace <file>        Record a thread timeline to <file> (Chrome trace-event JSON)\n");
+    printf("  -S, --stats-file <file>   Keep <file> rewritten with the /stats counters\n");
+    printf("  -I, --stats-interval <ms> How often --stats-file is rewritten (default %d)\n",
+        OPTIONS_DEFAULT_STATS_INTERVAL_MS);
+    printf("  -s, --spool <file>        Keep messages in <file> while the peer is unreachable, send them when it is back\n");
+    printf("  -R, --record <file>       Capture received datagrams and typed lines to <file> for t-chat-replay\n");
+    printf("  -M, --multicast <group>:<port> Chat with everyone in an IPv4 or IPv6 multicast group (e.g. 239.1.2.3:5000, [ff15::1]:5000)\n");
+    printf("  -t, --multicast-ttl <hops> How far multicast datagrams may travel (default %d, the local network)\n",
+        OPTIONS_DEFAULT_MULTICAST_TTL);
+    printf("  -N, --no-multicast-loop   Don't deliver multicast datagrams to other instances on this host\n");
+    printf("  -G, --no-offload          Send and receive datagrams one by one, without UDP GSO/GRO\n");
+    printf("  -u, --no-shm              Use UDP even when the peer is on this host, instead of shared memory\n");
+    printf("  -i, --tui                 Split the terminal into a scrollback pane and an input line\n");
+    printf("  -B, --scrollback <bytes>  Memory the --tui scrollback may use, with an optional K, M or G suffix (default 8M)\n");
+    printf("  -D, --no-dedup            Show every copy of a duplicated message\n");
+    printf("  -W, --lane-weights <c>:<i>:<b> Messages sent per round from the control, chat and bulk lanes (default 16:4:1)\n");
+    printf("  -V, --wire-version <n>    0 to talk to t-chat from before the packet header, without --psk, heartbeats,\n");
+    printf("                            channels, multicast, shared memory or duplicate filtering (default %d)\n", PACKET_VERSION);
+    printf("  -h, --help                Show this message\n");
+}
+
+// Parse options, leaving the positional arguments for Network_check_args
+void Options_parse(int argc, char *argv[]) {
+    int opt;
+    int used;
+    char *end;
+
+    options.recv_workers = 1;
+    options.heartbeat_ms = OPTIONS_DEFAULT_HEARTBEAT_MS;
+    options.stats_interval_ms = OPTIONS_DEFAULT_STATS_INTERVAL_MS;
+    options.multicast_ttl = OPTIONS_DEFAULT_MULTICAST_TTL;
+    options.multicast_loop = true;
+    options.scrollback_bytes = SCROLLBACK_DEFAULT_BYTES;
+    options.lane_weights[0] = OPTIONS_DEFAULT_CONTROL_WEIGHT;
+    options.lane_weights[1] = OPTIONS_DEFAULT_CHAT_WEIGHT;
+    options.lane_weights[2] = OPTIONS_DEFAULT_BULK_WEIGHT;
+    options.wire_version = PACKET_VERSION;
+
+    while ((opt = getopt_long(argc, argv, "+l:k:w:L::Pd:r:H:T:S:I:s:R:M:t:NGuiB:DW:V:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                options.log_path = optarg;
+                break;
+            case 'k':
+                options.psk_path = optarg;
+                break;
+            case 'w':
+                options.recv_workers = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg) {
+                    printf("Invalid number of receive workers: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                options.spin_usec = OPTIONS_DEFAULT_SPIN_USEC;
+                if (optarg != NULL) {
+                    options.spin_usec = strtol(optarg, &end, 10);
+                    if (*end != '\0' || end == optarg || options.spin_usec <= 0) {
+                        printf("Invalid spin time: %s\n", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+            case 'P':
+                options.pin = true;
+                break;
+            case 'd':
+                options.daemon_path = optarg;
+                break;
+            case 'r':
+                options.rate_limit = strtod(optarg, &end);
+                options.rate_burst = options.rate_limit;
+                if (*end == '/') {
+                    char *burst = end + 1;
+                    options.rate_burst = strtod(burst, &end);
+                    if (end == burst) {
+                        end = burst - 1;
+                    }
+                }
+                if (*end != '\0' || end == optarg || options.rate_limit <= 0 || options.rate_burst < 1) {
+                    printf("Invalid rate limit: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                options.heartbeat_ms = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || options.heartbeat_ms < 0) {
+                    printf("Invalid heartbeat interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                options.trace_path = optarg;
+                break;
+            case 'S':
+                options.stats_path = optarg;
+                break;
+            case 's':
+                options.spool_path = optarg;
+                break;
+            case 'R':
+                options.record_path = optarg;
+                break;
+            case 'M':
+                options.multicast = optarg;
+                break;
+            case 't':
+                options.multicast_ttl = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || options.multicast_ttl < 0 || options.multicast_ttl > 255) {
+                    printf("Invalid multicast TTL: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                options.multicast_loop = false;
+                break;
+            case 'G':
+                options.no_offload = true;
+                break;
+            case 'u':
+                options.no_shm = true;
+                break;
+            case 'i':
+                options.tui = true;
+                break;
+            case 'D':
+                options.no_dedup = true;
+                break;
+            case 'W':
+                if (sscanf(optarg, "%d:%d:%d%n", &options.lane_weights[0], &options.lane_weights[1], &options.lane_weights[2], &used) != 3
+                || optarg[used] != '\0' || options.lane_weights[0] < 1 || options.lane_weights[1] < 1 || options.lane_weights[2] < 1) {
+                    printf("Invalid lane weights: %s (three weights of at least 1, e.g. 16:4:1)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'V':
+                options.wire_version = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || (options.wire_version != 0 && options.wire_version != PACKET_VERSION)) {
+                    printf("Invalid wire version: %s (0 or %d)\n", optarg, PACKET_VERSION);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'B':
+                options.scrollback_bytes = strtoull(optarg, &end, 10);
+                if (*end != '\0' && end[1] == '\0' && end != optarg) {
+                    const char *suffixes = "KMG";
+                    const char *suffix = strchr(suffixes, *end);
+
+                    for (int i = 0; suffix != NULL && i <= suffix - suffixes; i++) {
+                        options.scrollback_bytes *= 1024;
+                    }
+
+                    end += suffix != NULL;
+                }
+                if (*end != '\0' || end == optarg || options.scrollback_bytes < SCROLLBACK_MIN_BYTES) {
+                    printf("Invalid scrollback size: %s (at least %d bytes)\n", optarg, SCROLLBACK_MIN_BYTES);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I':
+                options.stats_interval_ms = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || options.stats_interval_ms <= 0) {
+                    printf("Invalid stats interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                Options_usage();
+                exit(EXIT_SUCCESS);
+            default:
+                Options_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options.tui && options.daemon_path != NULL) {
+        printf("--tui cannot be combined with --daemon\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Everything the header carries is unavailable to the bare text of version 0
+    if (options.wire_version == 0) {
+        if (options.psk_path != NULL || options.multicast != NULL) {
+            printf("--wire-version 0 cannot be combined with --psk or --multicast\n");
+            exit(EXIT_FAILURE);
+        }
+
+        options.heartbeat_ms = 0;
+        options.no_shm = true;
+        options.no_dedup = true;
+    }
+
+    // Shift so that the first positional argument sits at index 1
+    positional_argc = argc - optind + 1;
+    positional_argv = argv + optind - 1;
+}
+
+// Getter for parsed options
+const Options *Options_get() {
+    return &options;
+}
+
+// Getter for positional argument count
+int Options_argc() {
+    return positional_argc;
+}
+
+// Getter for positional arguments
+char **Options_argv() {
+    return positional_argv;
+}
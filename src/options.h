@@ -0,0 +1,44 @@
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Options_s Options;
+struct Options_s {
+    char *log_path; // Persisted chat log (NULL if disabled)
+    char *psk_path; // Pre-shared key file (NULL if datagrams are sent in the clear)
+    int recv_workers; // Receive threads, each with its own SO_REUSEPORT socket
+    long spin_usec; // Spin this long before parking or blocking (0 unless --low-latency)
+    bool pin; // Pin every thread to its own core
+    double rate_limit; // Datagrams per second accepted from each sender (0 for no limit)
+    double rate_burst; // Datagrams a sender may send at once
+    int heartbeat_ms; // Interval between pings to the peer (0 disables heartbeats)
+    char *daemon_path; // Unix domain socket served instead of the terminal (NULL if disabled)
+    char *trace_path; // Chrome trace-event JSON written at exit (NULL if disabled)
+    char *stats_path; // File rewritten with the counters every stats_interval_ms (NULL if disabled)
+    int stats_interval_ms;
+    char *spool_path; // Messages for an unreachable peer wait in this file (NULL if disabled)
+    char *record_path; // Received datagrams and typed lines are captured here for t-chat-replay (NULL if disabled)
+    char *multicast; // "<group>:<port>" joined instead of chatting with one peer (NULL if disabled)
+    int multicast_ttl; // Hops multicast datagrams may travel
+    bool multicast_loop; // Deliver multicast datagrams to other instances on this host
+    bool no_offload; // Don't use UDP GSO/GRO even where the kernel supports them
+    bool no_shm; // Use UDP even when the peer is on this host
+    bool tui; // Split-pane terminal interface instead of plain lines
+    size_t scrollback_bytes; // Memory the --tui scrollback may use
+    bool no_dedup; // Deliver every copy of a duplicated datagram
+    int lane_weights[3]; // Messages send_run takes per round from the control, chat and bulk lanes
+    int wire_version; // 0 sends bare text, as t-chat did before the packet header, otherwise PACKET_VERSION
+};
+
+// Prototypes
+void Options_parse(int argc, char *argv[]);
+void Options_usage();
+const Options *Options_get();
+
+// Positional arguments, laid out like argv (index 0 is unused)
+int Options_argc();
+char **Options_argv();
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "packet.h"
+
+static void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Write header into the first PACKET_HEADER_LENGTH bytes of buffer
+void Packet_encode_header(const Packet_header *header, uint8_t *buffer) {
+    buffer[0] = header->version;
+    buffer[1] = header->type;
+    buffer[2] = header->flags;
+    buffer[3] = 0;
+    store32_be(buffer + 4, header->session);
+    store32_be(buffer + 8, (uint32_t)(header->seq >> 32));
+    store32_be(buffer + 12, (uint32_t)header->seq);
+}
+
+// Read the header of a datagram. Returns 0 on success, -1 if the datagram is too
+// short or was framed by a different version.
+int Packet_decode_header(Packet_header *header, const uint8_t *buffer, size_t length) {
+    if (length < PACKET_HEADER_LENGTH || buffer[0] != PACKET_VERSION) {
+        return -1;
+    }
+
+    header->version = buffer[0];
+    header->type = buffer[1];
+    header->flags = buffer[2];
+    header->session = load32_be(buffer + 4);
+    header->seq = ((uint64_t)load32_be(buffer + 8) << 32) | load32_be(buffer + 12);
+
+    return 0;
+}
+
+// Write a channel ID into the first PACKET_CHANNEL_LENGTH bytes of a payload
+void Packet_encode_channel(uint32_t channel, uint8_t *buffer) {
+    store32_be(buffer, channel);
+}
+
+// Read the channel ID at the start of a PACKET_FLAG_CHANNEL payload
+uint32_t Packet_decode_channel(const uint8_t *buffer) {
+    return load32_be(buffer);
+}
+
+// Nonce for sealing a datagram: session followed by seq
+void Packet_nonce(const Packet_header *header, uint8_t nonce[12]) {
+    store32_be(nonce, header->session);
+    store32_be(nonce + 4, (uint32_t)(header->seq >> 32));
+    store32_be(nonce + 8, (uint32_t)header->seq);
+}
+
+static const Packet_window_set *session_set(const Packet_window *window, uint32_t session) {
+    return &window->sets[session & (PACKET_WINDOW_SETS - 1)];
+}
+
+// Slot of the window in set following session, or -1 if it is not followed
+static int find_session(const Packet_window_set *set, uint32_t session) {
+    for (int i = 0; i < PACKET_WINDOW_WAYS; i++) {
+        if (set->sessions[i].started && set->sessions[i].session == session) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool is_retired(const Packet_window_set *set, uint32_t session) {
+    for (int i = 0; i < set->num_retired; i++) {
+        if (set->retired[i] == session) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns false if seq was already accepted or is too old to tell, or if its
+// session was retired. A session never seen before (the peer restarted) is
+// accepted.
+bool Packet_window_check(const Packet_window *window, uint32_t session, uint64_t seq) {
+    const Packet_window_set *set = session_set(window, session);
+    int slot = find_session(set, session);
+
+    if (slot < 0) {
+        return !is_retired(set, session);
+    }
+
+    const Packet_session_window *current = &set->sessions[slot];
+
+    if (seq > current->highest) {
+        return true;
+    }
+
+    uint64_t age = current->highest - seq;
+
+    if (age >= PACKET_WINDOW_SIZE) {
+        return false;
+    }
+
+    return (current->bitmap & ((uint64_t)1 << age)) == 0;
+}
+
+// Record seq as accepted. Must only be called after Packet_window_check and
+// authentication have both succeeded.
+void Packet_window_update(Packet_window *window, uint32_t session, uint64_t seq) {
+    Packet_window_set *set = &window->sets[session & (PACKET_WINDOW_SETS - 1)];
+    int slot = find_session(set, session);
+    Packet_session_window *current;
+
+    window->clock++;
+
+    // A new session takes a free slot of its set, or the least recently used one's
+    if (slot < 0) {
+        current = &set->sessions[0];
+
+        for (int i = 1; i < PACKET_WINDOW_WAYS && current->started; i++) {
+            if (!set->sessions[i].started || set->sessions[i].used < current->used) {
+                current = &set->sessions[i];
+            }
+        }
+
+        if (current->started) {
+            set->retired[set->next_retired] = current->session;
+            set->next_retired = (set->next_retired + 1) % PACKET_RETIRED_WAYS;
+
+            if (set->num_retired < PACKET_RETIRED_WAYS) {
+                set->num_retired++;
+            }
+        }
+
+        current->session = session;
+        current->highest = seq;
+        current->bitmap = 1;
+        current->used = window->clock;
+        current->started = true;
+        return;
+    }
+
+    current = &set->sessions[slot];
+    current->used = window->clock;
+
+    if (seq > current->highest) {
+        uint64_t shift = seq - current->highest;
+
+        current->bitmap = shift >= PACKET_WINDOW_SIZE ? 0 : current->bitmap << shift;
+        current->bitmap |= 1;
+        current->highest = seq;
+    } else {
+        current->bitmap |= (uint64_t)1 << (current->highest - seq);
+    }
+}
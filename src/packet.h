@@ -0,0 +1,89 @@
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Datagram framing.
+ *
+ *  Every datagram starts with a fixed header (all fields in network byte order):
+ *      version (1) | type (1) | flags (1) | reserved (1) | session (4) | seq (8)
+ *  followed by the payload (the message text, without a terminating NUL). A chat
+ *  message in a named channel has PACKET_FLAG_CHANNEL set and its payload starts
+ *  with the 4-byte channel ID (see channel.h); the default channel has none. Sealed
+ *  datagrams carry a CRYPTO_TAG_LENGTH byte tag after the payload, and use the
+ *  header as associated data and session || seq as the nonce. The session is
+ *  random and seq starts at a random point below 2^63, so two sender processes
+ *  sharing a key only reuse a nonce if 95 random bits bring their ranges together.
+ */
+
+#define PACKET_VERSION 1
+#define PACKET_HEADER_LENGTH 16
+#define PACKET_CHANNEL_LENGTH 4
+
+// Types
+#define PACKET_CHAT 1
+#define PACKET_PING 2   // Payload is echoed back in a PACKET_PONG
+#define PACKET_PONG 3
+#define PACKET_SHM_OFFER 4  // Payload is the name of a shared-memory ring (see shm.h)
+
+// Flags
+#define PACKET_FLAG_SEALED 0x01
+#define PACKET_FLAG_CHANNEL 0x02    // Payload starts with a channel ID
+
+// Width of the replay window, in sequence numbers
+#define PACKET_WINDOW_SIZE 64
+#define PACKET_WINDOW_SETS 64       // Sets of the session table, a power of two
+#define PACKET_WINDOW_WAYS 4        // Sessions followed at once in each set
+#define PACKET_RETIRED_WAYS 8       // Sessions each set remembers after they stop being followed, so they stay rejected
+
+typedef struct Packet_header_s Packet_header;
+struct Packet_header_s {
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t session;  // Random per sender process
+    uint64_t seq;      // Starts at a random value below 2^63, incremented for every datagram sent
+};
+
+// Sliding window over the sequence numbers accepted from one session
+typedef struct Packet_session_window_s Packet_session_window;
+struct Packet_session_window_s {
+    uint32_t session;
+    uint64_t highest;
+    uint64_t bitmap;   // Bit i set if highest - i was accepted
+    uint64_t used;     // Value of the table's clock when last updated
+    bool started;
+};
+
+typedef struct Packet_window_set_s Packet_window_set;
+struct Packet_window_set_s {
+    Packet_session_window sessions[PACKET_WINDOW_WAYS];
+    uint32_t retired[PACKET_RETIRED_WAYS];
+    int num_retired;
+    int next_retired;  // Slot of retired the next retired session overwrites
+};
+
+// Replay windows of every session accepted, from any sender or address, keyed
+// by the (authenticated) session. A new session gets a window of its own and
+// never resets another's. The table is set associative: when a set is full,
+// its least recently used session is retired, and rejected until
+// PACKET_RETIRED_WAYS more sessions of the set have been retired after it.
+typedef struct Packet_window_s Packet_window;
+struct Packet_window_s {
+    Packet_window_set sets[PACKET_WINDOW_SETS];
+    uint64_t clock;    // Counts updates
+};
+
+// Prototypes
+void Packet_encode_header(const Packet_header *header, uint8_t *buffer);
+int Packet_decode_header(Packet_header *header, const uint8_t *buffer, size_t length);
+void Packet_encode_channel(uint32_t channel, uint8_t *buffer);
+uint32_t Packet_decode_channel(const uint8_t *buffer);
+void Packet_nonce(const Packet_header *header, uint8_t nonce[12]);
+bool Packet_window_check(const Packet_window *window, uint32_t session, uint64_t seq);
+void Packet_window_update(Packet_window *window, uint32_t session, uint64_t seq);
+
+#endif
@@ -0,0 +1,152 @@
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "peer.h"
+#include "stats.h"
+
+// Static variables
+static uint64_t token_interval_ns = 0;  // Time to earn one token (0 if rate limiting is off)
+static uint64_t bucket_depth_ns = 0;    // Time to fill an empty bucket
+
+// Create an empty table with a fresh hash key. Returns NULL if out of memory.
+Peer_table *Peer_table_create() {
+    Peer_table *table = calloc(1, sizeof(Peer_table));
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    if (getrandom(table->key, sizeof(table->key), 0) != sizeof(table->key)) {
+        printf("<DEBUG> Failed to read random peer table key: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return table;
+}
+
+void Peer_table_free(Peer_table *table) {
+    free(table);
+}
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// Hash of the family, port and address of addr under a random key
+uint64_t Peer_hash_address(const uint64_t key[2], const struct sockaddr *addr) {
+    uint64_t words[3] = {0, 0, 0};
+
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(&words[0], &in6->sin6_addr, 16);
+        words[2] = in6->sin6_port;
+    } else if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memcpy(&words[0], &in->sin_addr, 4);
+        words[2] = in->sin_port;
+    }
+
+    words[2] |= (uint64_t)addr->sa_family << 32;
+
+    uint64_t h = key[0];
+
+    for (int i = 0; i < 3; i++) {
+        h = mix(h ^ words[i] ^ key[1]);
+    }
+
+    return h;
+}
+
+// True if a and b are the same family, address and port
+bool Peer_same_address(const struct sockaddr *a, const struct sockaddr *b) {
+    if (a->sa_family != b->sa_family) {
+        return false;
+    }
+
+    if (a->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a, *y = (const struct sockaddr_in6 *)b;
+        return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, 16) == 0;
+    }
+
+    const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+    return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+}
+
+// Find the state of the sender at addr, making room for it if it is new
+Peer *Peer_lookup(Peer_table *table, const struct sockaddr *addr, socklen_t addr_length, uint64_t now_ns) {
+    Peer *set = &table->slots[(Peer_hash_address(table->key, addr) % PEER_TABLE_SETS) * PEER_TABLE_WAYS];
+    Peer *victim = &set[0];
+
+    for (int i = 0; i < PEER_TABLE_WAYS; i++) {
+        Peer *peer = &set[i];
+
+        if (peer->addr_length != 0 && Peer_same_address((const struct sockaddr *)&peer->addr, addr)) {
+            peer->last_seen_ns = now_ns;
+            return peer;
+        }
+
+        // Prefer a free slot, then the sender heard from longest ago
+        if (victim->addr_length != 0 && (peer->addr_length == 0 || peer->last_seen_ns < victim->last_seen_ns)) {
+            victim = peer;
+        }
+    }
+
+    if (victim->addr_length != 0) {
+        Stats_add(STATS_PEERS_EVICTED, 1);
+    }
+
+    memset(victim, 0, sizeof(Peer));
+    memcpy(&victim->addr, addr, addr_length < sizeof(victim->addr) ? addr_length : sizeof(victim->addr));
+    victim->addr_length = addr_length;
+    victim->last_seen_ns = now_ns;
+
+    return victim;
+}
+
+// Allow each sender rate datagrams per second on average and burst at once
+void Peer_configure_rate(double rate, double burst) {
+    if (rate <= 0) {
+        token_interval_ns = 0;
+        return;
+    }
+
+    token_interval_ns = (uint64_t)(1e9 / rate);
+    bucket_depth_ns = (uint64_t)((burst < 1 ? 1 : burst) * token_interval_ns);
+}
+
+// True if rate limiting is on
+bool Peer_rate_limited() {
+    return token_interval_ns > 0;
+}
+
+// Take a token from the peer's bucket. Returns false if the bucket is empty.
+bool Peer_allow(Peer *peer, uint64_t now_ns) {
+    if (token_interval_ns == 0) {
+        return true;
+    }
+
+    // The bucket is kept as the time it will be full again: a datagram may pass
+    // if that is less than a full bucket away, and pushes it one token later.
+    uint64_t full_at = peer->allowed_at_ns > now_ns ? peer->allowed_at_ns : now_ns;
+
+    if (full_at + token_interval_ns - now_ns > bucket_depth_ns) {
+        return false;
+    }
+
+    peer->allowed_at_ns = full_at + token_interval_ns;
+
+    return true;
+}
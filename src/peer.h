@@ -0,0 +1,51 @@
+#ifndef _PEER_H_
+#define _PEER_H_
+
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dedup.h"
+
+/**
+ *  Per-sender state, looked up by source address.
+ *
+ *  The table is set associative: an address hashes (with a random key, so
+ *  senders cannot aim for one set) to a set of PEER_TABLE_WAYS slots, and a new
+ *  sender takes a free slot or evicts the least recently seen one. Lookups cost
+ *  the same however many addresses a flood is spoofed from.
+ *
+ *  A table is owned by one receive worker and is not locked.
+ */
+
+#define PEER_TABLE_SETS 256
+#define PEER_TABLE_WAYS 8
+
+typedef struct Peer_s Peer;
+struct Peer_s {
+    struct sockaddr_storage addr;
+    socklen_t addr_length;              // 0 if the slot is free
+    uint64_t last_seen_ns;
+    uint64_t allowed_at_ns;             // Token bucket, as the time the bucket is next full
+    Dedup_window dedup;                 // Sequence numbers seen from this address
+};
+
+typedef struct Peer_table_s Peer_table;
+struct Peer_table_s {
+    uint64_t key[2];
+    Peer slots[PEER_TABLE_SETS * PEER_TABLE_WAYS];
+};
+
+// Prototypes
+Peer_table *Peer_table_create();
+void Peer_table_free(Peer_table *table);
+uint64_t Peer_hash_address(const uint64_t key[2], const struct sockaddr *addr);
+bool Peer_same_address(const struct sockaddr *a, const struct sockaddr *b);
+Peer *Peer_lookup(Peer_table *table, const struct sockaddr *addr, socklen_t addr_length, uint64_t now_ns);
+
+// Token bucket applied to every sender: rate datagrams per second, up to burst at once (0 disables)
+void Peer_configure_rate(double rate, double burst);
+bool Peer_rate_limited();
+bool Peer_allow(Peer *peer, uint64_t now_ns);
+
+#endif
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+#include "waiter.h"
+
+// Static variables
+static int record_fd = -1;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t buffer[RECORD_BUFFER_LENGTH];
+static size_t used = 0;             // Complete records in buffer, published with a release store
+static bool writing = false;        // A thread is writing buffer out
+static uint64_t start_ns;
+static uint64_t last_write_ns;
+static struct sigaction previous_int;
+static struct sigaction previous_term;
+
+static void store16_be(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void store64_be(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+// write() all of length bytes, returning false on error (async-signal-safe)
+static bool write_all(const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = write(record_fd, data, length);
+
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += bytes;
+        length -= bytes;
+    }
+
+    return true;
+}
+
+// Write the buffer out (call with record_mutex held)
+static void write_buffer() {
+    __atomic_store_n(&writing, true, __ATOMIC_RELEASE);
+
+    if (!write_all(buffer, used)) {
+        printf("<RECORD> Failed to write capture: %s\n", strerror(errno));
+    }
+
+    __atomic_store_n(&used, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&writing, false, __ATOMIC_RELEASE);
+    last_write_ns = Waiter_now_ns();
+}
+
+// Save the buffered records, then let the signal do what it did before recording
+static void on_signal(int signum) {
+    if (!__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+        write_all(buffer, __atomic_load_n(&used, __ATOMIC_ACQUIRE));
+    }
+
+    sigaction(signum, signum == SIGINT ? &previous_int : &previous_term, NULL);
+    raise(signum);
+}
+
+// Begin capturing received datagrams and typed lines to path
+void Record_start(const char *path) {
+    uint8_t header[RECORD_HEADER_LENGTH];
+    struct timespec now;
+
+    if ((record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        printf("<RECORD> Failed to open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(header, RECORD_MAGIC, 8);
+    store64_be(header + 8, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+
+    if (!write_all(header, sizeof(header))) {
+        printf("<RECORD> Failed to write %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    start_ns = last_write_ns = Waiter_now_ns();
+
+    // Chains to the handler --trace installed, if any
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+
+    if (atexit(Record_stop) != 0) {
+        printf("<RECORD> Failed to register the capture writer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write what is buffered and close the capture
+void Record_stop() {
+    if (record_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&record_mutex);
+    {
+        write_buffer();
+        close(record_fd);
+        record_fd = -1;
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
+
+// True if --record is on
+bool Record_enabled() {
+    return record_fd >= 0;
+}
+
+// Append a record of length bytes of data (longer data is cut to RECORD_MAX_LENGTH)
+void Record_add(Record_kind kind, const void *data, size_t length) {
+    if (record_fd < 0) {
+        return;
+    }
+
+    if (length > RECORD_MAX_LENGTH) {
+        length = RECORD_MAX_LENGTH;
+    }
+
+    pthread_mutex_lock(&record_mutex);
+    {
+        uint64_t now = Waiter_now_ns();
+
+        if (record_fd >= 0) {
+            if (used + RECORD_PREFIX_LENGTH + length > sizeof(buffer)) {
+                write_buffer();
+            }
+
+            uint8_t *prefix = buffer + used;
+
+            store64_be(prefix, now - start_ns);
+            store16_be(prefix + 8, length);
+            prefix[10] = kind;
+            memcpy(prefix + RECORD_PREFIX_LENGTH, data, length);
+
+            __atomic_store_n(&used, used + RECORD_PREFIX_LENGTH + length, __ATOMIC_RELEASE);
+
+            if (now - last_write_ns >= (uint64_t)RECORD_FLUSH_MS * 1000000) {
+                write_buffer();
+            }
+        }
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
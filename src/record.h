@@ -0,0 +1,42 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Traffic capture (--record <file>) for t-chat-replay.
+ *
+ *  Every datagram recv_run reads, as it came off the socket (still sealed when
+ *  --psk is on), and every line keyboard_run reads are appended to the capture
+ *  with the time since recording started. Records collect in a buffer that is
+ *  written out when it fills, with the first record added RECORD_FLUSH_MS or
+ *  more after the last write, at exit and when SIGINT or SIGTERM ends the program.
+ *
+ *  File layout (integers big-endian):
+ *      u8[8] RECORD_MAGIC, u64 wall clock time recording started (ns since the epoch),
+ *      then per record { u64 ns since the start, u16 length, u8 kind, data }
+ *  A capture cut short by a crash ends in a partial record, which readers ignore.
+ */
+
+#define RECORD_MAGIC "TCCAPT01"
+#define RECORD_HEADER_LENGTH 16
+#define RECORD_PREFIX_LENGTH 11
+#define RECORD_MAX_LENGTH UINT16_MAX
+#define RECORD_BUFFER_LENGTH (256 * 1024)
+#define RECORD_FLUSH_MS 200
+
+typedef enum Record_kind_e Record_kind;
+enum Record_kind_e {
+    RECORD_DATAGRAM = 1,    // A datagram received by a recv worker
+    RECORD_LINE = 2,        // A line read from the keyboard
+};
+
+// Prototypes
+void Record_start(const char *path);
+void Record_stop();
+bool Record_enabled();
+void Record_add(Record_kind kind, const void *data, size_t length);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANITIZE_X86
+#endif
+
+#include "sanitize.h"
+
+// Length of the leading run of bytes in [0x20, 0x7e]
+typedef size_t (*PREFIX_FN)(const uint8_t *in, size_t length);
+
+typedef struct Kernel_s Kernel;
+struct Kernel_s {
+    const char *name;
+    PREFIX_FN plain_prefix;
+    bool (*supported)();
+};
+
+// Static variables
+static const Kernel *kernel = NULL;
+
+static bool is_plain(uint8_t c) {
+    return c >= 0x20 && c < 0x7f;
+}
+
+/*
+ * Plain ASCII prefix kernels
+ */
+
+static size_t plain_prefix_scalar(const uint8_t *in, size_t length) {
+    size_t i = 0;
+
+    while (i < length && is_plain(in[i])) {
+        i++;
+    }
+
+    return i;
+}
+
+static bool always_supported() {
+    return true;
+}
+
+#ifdef SANITIZE_X86
+
+// Bit i is set if byte i needs attention: as signed bytes, everything from 0x80
+// up is negative, so one compare catches C0 controls and non-ASCII, and DEL is
+// compared separately
+__attribute__((target("sse2")))
+static inline int unplain_mask_sse2(const uint8_t *in) {
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+    return _mm_movemask_epi8(bad);
+}
+
+__attribute__((target("sse2")))
+static size_t plain_prefix_sse2(const uint8_t *in, size_t length) {
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        int m0 = unplain_mask_sse2(in + i);
+        int m1 = unplain_mask_sse2(in + i + 16);
+        int m2 = unplain_mask_sse2(in + i + 32);
+        int m3 = unplain_mask_sse2(in + i + 48);
+
+        if ((m0 | m1 | m2 | m3) != 0) {
+            uint64_t mask = (uint64_t)m0 | ((uint64_t)m1 << 16) | ((uint64_t)m2 << 32) | ((uint64_t)m3 << 48);
+            return i + __builtin_ctzll(mask);
+        }
+    }
+
+    for (; i + 16 <= length; i += 16) {
+        int mask = unplain_mask_sse2(in + i);
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + plain_prefix_scalar(in + i, length - i);
+}
+
+static bool sse2_supported() {
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t unplain_mask_avx2(const uint8_t *in) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)in);
+    __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+
+    return (uint32_t)_mm256_movemask_epi8(bad);
+}
+
+__attribute__((target("avx2")))
+static size_t plain_prefix_avx2(const uint8_t *in, size_t length) {
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        uint64_t mask = (uint64_t)unplain_mask_avx2(in + i) | ((uint64_t)unplain_mask_avx2(in + i + 32) << 32);
+
+        if (mask != 0) {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+
+    for (; i + 32 <= length; i += 32) {
+        uint32_t mask = unplain_mask_avx2(in + i);
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + plain_prefix_sse2(in + i, length - i);
+}
+
+static bool avx2_supported() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+// Kernels in order of preference
+static const Kernel kernels[] = {
+#ifdef SANITIZE_X86
+    {"avx2", plain_prefix_avx2, avx2_supported},
+    {"sse2", plain_prefix_sse2, sse2_supported},
+#endif
+    {"scalar", plain_prefix_scalar, always_supported},
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/*
+ * Everything else, one character at a time
+ */
+
+// Length of the well-formed UTF-8 sequence at in (RFC 3629), or 0 if it is malformed
+static size_t utf8_length(const uint8_t *in, size_t length, uint32_t *code_point) {
+    uint8_t c = in[0];
+    size_t n;
+    uint8_t low = 0x80;   // Bounds of the second byte, which exclude overlong
+    uint8_t high = 0xbf;  // forms, surrogates and code points past U+10FFFF
+
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+        *code_point = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        *code_point = c & 0x0f;
+        low = c == 0xe0 ? 0xa0 : 0x80;
+        high = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        *code_point = c & 0x07;
+        low = c == 0xf0 ? 0x90 : 0x80;
+        high = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+
+    if (n > length || in[1] < low || in[1] > high) {
+        return 0;
+    }
+
+    for (size_t i = 1; i < n; i++) {
+        if ((in[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+
+        *code_point = (*code_point << 6) | (in[i] & 0x3f);
+    }
+
+    return n;
+}
+
+#define SELF_TEST_LENGTH 150 // Covers the 64-byte loop, both shorter loops and the tail
+
+// Checks that kernel k stops at an ESC, DEL or non-ASCII byte wherever it is
+static bool self_test_kernel(const Kernel *k) {
+    static const uint8_t stoppers[] = {0x1b, 0x00, 0x7f, 0x80, 0xff};
+    uint8_t text[SELF_TEST_LENGTH];
+
+    for (size_t i = 0; i < SELF_TEST_LENGTH; i++) {
+        text[i] = 0x20 + i % 0x5f;
+    }
+
+    if (k->plain_prefix(text, SELF_TEST_LENGTH) != SELF_TEST_LENGTH) {
+        return false;
+    }
+
+    for (size_t at = 0; at < SELF_TEST_LENGTH; at++) {
+        for (size_t s = 0; s < sizeof(stoppers); s++) {
+            uint8_t saved = text[at];
+            text[at] = stoppers[s];
+
+            bool passed = k->plain_prefix(text, SELF_TEST_LENGTH) == at;
+            text[at] = saved;
+
+            if (!passed) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Pick the fastest kernel the CPU supports that passes its self-test
+void Sanitize_init() {
+    for (size_t i = 0; i < NUM_KERNELS && kernel == NULL; i++) {
+        if (!kernels[i].supported()) {
+            continue;
+        }
+
+        if (!self_test_kernel(&kernels[i])) {
+            printf("<SANITIZE> %s kernel failed its self-test\n", kernels[i].name);
+            continue;
+        }
+
+        kernel = &kernels[i];
+    }
+}
+
+// Name of the kernel in use
+const char *Sanitize_kernel_name() {
+    return kernel ? kernel->name : "none";
+}
+
+// Write the sanitized form of length bytes of in to out, which must hold
+// SANITIZE_MAX_OUTPUT(length) + 1 bytes, and NUL-terminate it. Returns the output
+// length; replaced, if not NULL, receives the number of characters escaped or replaced.
+size_t Sanitize_text(char *out, const char *in, size_t length, size_t *replaced) {
+    const uint8_t *src = (const uint8_t *)in;
+    size_t o = 0;
+    size_t changes = 0;
+
+    for (size_t i = 0; i < length;) {
+        size_t plain = kernel->plain_prefix(src + i, length - i);
+
+        memcpy(out + o, src + i, plain);
+        i += plain;
+        o += plain;
+
+        if (i == length) {
+            break;
+        }
+
+        uint8_t c = src[i];
+        uint32_t code_point;
+        size_t n;
+
+        if (c == '\t' || (c == '\n' && i == length - 1)) {
+            out[o++] = c;
+            i++;
+        } else if (c < 0x20 || c == 0x7f) {
+            out[o++] = '^';
+            out[o++] = c == 0x7f ? '?' : c + 0x40;
+            changes++;
+            i++;
+        } else if ((n = utf8_length(src + i, length - i, &code_point)) > 0 && code_point > 0x9f) {
+            memcpy(out + o, src + i, n);
+            o += n;
+            i += n;
+        } else {
+            // Malformed UTF-8 is replaced a byte at a time, C1 controls whole
+            memcpy(out + o, "\xef\xbf\xbd", 3);
+            o += 3;
+            changes++;
+            i += n > 0 ? n : 1;
+        }
+    }
+
+    out[o] = '\0';
+
+    if (replaced != NULL) {
+        *replaced = changes;
+    }
+
+    return o;
+}
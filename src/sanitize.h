@@ -0,0 +1,28 @@
+#ifndef _SANITIZE_H_
+#define _SANITIZE_H_
+
+#include <stddef.h>
+
+/**
+ *  Makes received text safe to print on a terminal.
+ *
+ *  Printable ASCII, tabs, a final newline and well-formed UTF-8 pass through.
+ *  C0 controls (including NUL and the ESC that starts every escape sequence)
+ *  and DEL are shown in caret notation ("^[", "^@", "^?"), so a sequence can no
+ *  longer drive the terminal and an embedded NUL no longer truncates the
+ *  message. Malformed UTF-8 bytes and C1 controls (U+0080 to U+009F) become
+ *  U+FFFD.
+ *
+ *  Runs of plain ASCII are found 64 bytes at a time with AVX2 or SSE2 where the
+ *  CPU has them (picked at startup), falling back to a scalar loop.
+ */
+
+// Longest output for length bytes of input, excluding the terminating NUL
+#define SANITIZE_MAX_OUTPUT(length) (3 * (length))
+
+// Prototypes
+void Sanitize_init();
+const char *Sanitize_kernel_name();
+size_t Sanitize_text(char *out, const char *in, size_t length, size_t *replaced);
+
+#endif
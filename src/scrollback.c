@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scrollback.h"
+#include "stats.h"
+
+typedef struct Slot_s Slot;
+struct Slot_s {
+    uint64_t position;  // Where the text starts, counting every arena byte ever used
+    uint32_t length;
+    uint8_t kind;
+};
+
+// Static variables
+static pthread_mutex_t scrollback_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SCROLLBACK_NOTIFY_FN notify_fn = NULL;
+static bool started = false;
+
+// Guarded by scrollback_mutex
+static Slot *slots = NULL;
+static uint64_t slot_mask = 0;      // Number of slots, a power of two, minus one
+static char *arena = NULL;
+static uint64_t arena_length = 0;
+static uint64_t arena_end = 0;      // Position after the newest line's text
+static uint64_t first = 0;          // Oldest line kept
+static uint64_t end = 0;            // Number the next line gets
+
+// Split cap_bytes between the slots and the arena and allocate both
+void Scrollback_start(size_t cap_bytes, SCROLLBACK_NOTIFY_FN notify) {
+    uint64_t num_slots = 1;
+
+    while (num_slots * 2 * (sizeof(Slot) + SCROLLBACK_AVERAGE_LENGTH) <= cap_bytes) {
+        num_slots *= 2;
+    }
+
+    arena_length = cap_bytes - num_slots * sizeof(Slot);
+    slots = calloc(num_slots, sizeof(Slot));
+    arena = malloc(arena_length);
+
+    if (slots == NULL || arena == NULL || arena_length < SCROLLBACK_LINE_LENGTH) {
+        printf("Failed to allocate a %zu byte scrollback\n", cap_bytes);
+        exit(EXIT_FAILURE);
+    }
+
+    slot_mask = num_slots - 1;
+    notify_fn = notify;
+    started = true;
+}
+
+// Free the scrollback; lines added afterwards are dropped
+void Scrollback_stop() {
+    pthread_mutex_lock(&scrollback_mutex);
+    {
+        started = false;
+        free(slots);
+        free(arena);
+        slots = NULL;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&scrollback_mutex);
+}
+
+// Append a line (its final newline is dropped), evicting the oldest ones to
+// make room. Returns its number, or 0 if the scrollback is not running.
+uint64_t Scrollback_add(Scrollback_kind kind, const char *text) {
+    size_t length = strlen(text);
+    uint64_t index = 0;
+    uint64_t evicted = 0;
+
+    if (!started) {
+        return 0;
+    }
+
+    if (length > 0 && text[length - 1] == '\n') {
+        length--;
+    }
+
+    if (length > SCROLLBACK_LINE_LENGTH) {
+        length = SCROLLBACK_LINE_LENGTH;
+    }
+
+    pthread_mutex_lock(&scrollback_mutex);
+    {
+        if (!started) {
+            pthread_mutex_unlock(&scrollback_mutex);
+            return 0;
+        }
+
+        // Text never wraps, so a line that would cross the end starts over at 0
+        uint64_t position = arena_end;
+
+        if (position % arena_length + length > arena_length) {
+            position += arena_length - position % arena_length;
+        }
+
+        while (first < end && (end - first > slot_mask || position + length - slots[first & slot_mask].position > arena_length)) {
+            first++;
+            evicted++;
+        }
+
+        Slot *slot = &slots[end & slot_mask];
+
+        slot->position = position;
+        slot->length = length;
+        slot->kind = kind;
+        memcpy(arena + position % arena_length, text, length);
+        arena_end = position + length;
+        index = end++;
+    }
+    pthread_mutex_unlock(&scrollback_mutex);
+
+    if (evicted > 0) {
+        Stats_add(STATS_SCROLLBACK_EVICTED, evicted);
+    }
+
+    if (notify_fn != NULL) {
+        notify_fn();
+    }
+
+    return index;
+}
+
+// Number of the oldest line kept
+uint64_t Scrollback_first() {
+    uint64_t index;
+
+    pthread_mutex_lock(&scrollback_mutex);
+    {
+        index = first;
+    }
+    pthread_mutex_unlock(&scrollback_mutex);
+
+    return index;
+}
+
+// Number the next line will get; lines [Scrollback_first(), Scrollback_end()) are kept
+uint64_t Scrollback_end() {
+    uint64_t index;
+
+    pthread_mutex_lock(&scrollback_mutex);
+    {
+        index = end;
+    }
+    pthread_mutex_unlock(&scrollback_mutex);
+
+    return index;
+}
+
+// Copy line index into buffer as a string, cut to fit. Returns false if the
+// line was evicted or has not been added yet.
+bool Scrollback_get(uint64_t index, char *buffer, size_t size, Scrollback_kind *kind) {
+    bool found = false;
+
+    pthread_mutex_lock(&scrollback_mutex);
+    {
+        if (started && index >= first && index < end) {
+            const Slot *slot = &slots[index & slot_mask];
+            size_t length = slot->length < size - 1 ? slot->length : size - 1;
+
+            memcpy(buffer, arena + slot->position % arena_length, length);
+            buffer[length] = '\0';
+            *kind = slot->kind;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&scrollback_mutex);
+
+    return found;
+}
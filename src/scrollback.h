@@ -0,0 +1,48 @@
+#ifndef _SCROLLBACK_H_
+#define _SCROLLBACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Bounded in-memory scrollback of the lines shown by --tui.
+ *
+ *  Everything is allocated once, by Scrollback_start, from a cap in bytes: a
+ *  ring of fixed-size slots, one per line, and a byte arena that holds the
+ *  text. Lines are numbered from 0 in the order they were added; line i lives
+ *  in slot i % slots and its text is one contiguous run of the arena, which is
+ *  filled as a ring too. Adding a line copies its text after the previous
+ *  one, skipping to the start of the arena when it would not fit before the
+ *  end, and evicts the oldest lines until both a slot and the bytes are free,
+ *  so appends never allocate and eviction is O(1) per line evicted.
+ *
+ *  Any line still kept is found from its number in O(1), so a reader can page
+ *  or jump anywhere and only touch the lines it draws. Memory stays at the cap
+ *  however long the session runs.
+ */
+
+#define SCROLLBACK_DEFAULT_BYTES (8 * 1024 * 1024)
+#define SCROLLBACK_MIN_BYTES (64 * 1024)
+#define SCROLLBACK_LINE_LENGTH 4096     // Longer lines are cut
+#define SCROLLBACK_AVERAGE_LENGTH 64    // Bytes of text per line the slots are sized for
+
+typedef enum Scrollback_kind_e Scrollback_kind;
+enum Scrollback_kind_e {
+    SCROLLBACK_RECEIVED,    // From the peer
+    SCROLLBACK_SENT,        // Typed here
+    SCROLLBACK_SYSTEM,      // Printed by t-chat itself
+};
+
+// Called, with no lock held, after every line added
+typedef void (*SCROLLBACK_NOTIFY_FN)();
+
+// Prototypes
+void Scrollback_start(size_t cap_bytes, SCROLLBACK_NOTIFY_FN notify);
+void Scrollback_stop();
+uint64_t Scrollback_add(Scrollback_kind kind, const char *text);
+uint64_t Scrollback_first();
+uint64_t Scrollback_end();
+bool Scrollback_get(uint64_t index, char *buffer, size_t size, Scrollback_kind *kind);
+
+#endif
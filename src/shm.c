@@ -0,0 +1,529 @@
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "peer.h"
+#include "shm.h"
+#include "stats.h"
+#include "trace.h"
+#include "waiter.h"
+
+#define SHM_WRAP UINT32_MAX         // Record length that sends the reader back to the start of the ring
+#define SHM_MASK (SHM_RING_LENGTH - 1)
+
+// Start of the shared mapping. Fields are grouped by the side that writes them,
+// so that the reader and the writer don't share a cache line.
+typedef struct Shm_header_s Shm_header;
+struct Shm_header_s {
+    char magic[8];
+    uint32_t length;
+    uint32_t owner_pid;
+
+    // Written by the reader
+    uint64_t head __attribute__((aligned(64)));     // Bytes consumed
+    uint32_t reader_sleeping;
+    uint32_t space_futex;   // Bumped to wake a sleeping writer
+    uint32_t closed;        // The reader has gone
+
+    // Written by the writer
+    uint64_t tail __attribute__((aligned(64)));     // Bytes published
+    uint32_t writer_sleeping;
+    uint32_t data_futex;    // Bumped to wake a sleeping reader
+    uint32_t writer_session; // Session of the peer writing to the ring (0 until one attaches)
+};
+
+#define SHM_MAPPING_LENGTH (sizeof(Shm_header) + SHM_RING_LENGTH)
+
+// One side's view of a ring
+typedef struct Shm_ring_s Shm_ring;
+struct Shm_ring_s {
+    Shm_header *header;
+    uint8_t *data;
+    uint64_t position;      // Our copy of head (reading) or tail (writing)
+};
+
+// Static variables
+static bool enabled = false;
+static struct sockaddr_storage peer;
+static socklen_t peer_length;
+static uint32_t session;
+static SHM_OFFER_FN send_offer = NULL;
+
+static char own_name[SHM_NAME_LENGTH];  // Our receive ring, read by the shared-memory worker
+static Shm_ring own;
+
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char attached_name[SHM_NAME_LENGTH]; // Last peer ring mapped (guarded by shm_mutex)
+static Shm_ring *offered = NULL;        // Peer ring mapped by a recv worker, waiting for send_run
+static Shm_ring *target = NULL;         // Peer ring send_run writes to (send_run only)
+
+static void futex_wait(uint32_t *word, uint32_t value, long timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+
+    // Not FUTEX_PRIVATE_FLAG: the word is shared with the other process
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Bytes a record of a length byte datagram takes in the ring
+static size_t record_size(size_t length) {
+    return (sizeof(uint32_t) + length + 7) & ~(size_t)7;
+}
+
+// True if addr is a loopback address or one of this host's interfaces
+static bool is_local(const struct sockaddr *addr) {
+    if (addr->sa_family == AF_INET) {
+        if ((ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr) >> 24) == 127) {
+            return true;
+        }
+    } else if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *ip = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+
+        if (IN6_IS_ADDR_LOOPBACK(ip) || (IN6_IS_ADDR_V4MAPPED(ip) && ip->s6_addr[12] == 127)) {
+            return true;
+        }
+    } else {
+        return false;
+    }
+
+    struct ifaddrs *interfaces;
+    bool local = false;
+
+    if (getifaddrs(&interfaces) < 0) {
+        return false;
+    }
+
+    for (struct ifaddrs *i = interfaces; i != NULL && !local; i = i->ifa_next) {
+        struct sockaddr_storage candidate;
+
+        if (i->ifa_addr == NULL || i->ifa_addr->sa_family != addr->sa_family) {
+            continue;
+        }
+
+        // Compare addresses only, with the port copied over
+        if (addr->sa_family == AF_INET6) {
+            memcpy(&candidate, i->ifa_addr, sizeof(struct sockaddr_in6));
+            ((struct sockaddr_in6 *)&candidate)->sin6_port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+        } else {
+            memcpy(&candidate, i->ifa_addr, sizeof(struct sockaddr_in));
+            ((struct sockaddr_in *)&candidate)->sin_port = ((const struct sockaddr_in *)addr)->sin_port;
+        }
+
+        local = Peer_same_address((struct sockaddr *)&candidate, addr);
+    }
+
+    freeifaddrs(interfaces);
+
+    return local;
+}
+
+static void unlink_ring() {
+    if (own_name[0] != '\0') {
+        shm_unlink(own_name);
+        own_name[0] = '\0';
+    }
+}
+
+// Map the peer's ring for writing. Returns NULL if it can't be used.
+static Shm_ring *attach(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    struct stat status;
+
+    if (fd < 0) {
+        printf("<SHM>   Failed to open the peer's ring %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    // Only rings of our own user, of the size we expect
+    if (fstat(fd, &status) < 0 || status.st_uid != geteuid() || (size_t)status.st_size != SHM_MAPPING_LENGTH) {
+        printf("<SHM>   Ignoring the peer's ring %s: wrong owner or size\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, SHM_MAPPING_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        printf("<SHM>   Failed to map the peer's ring %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    Shm_ring *ring = malloc(sizeof(Shm_ring));
+    Shm_header *header = mapping;
+
+    if (ring == NULL || memcmp(header->magic, SHM_MAGIC, 8) != 0 || header->length != SHM_RING_LENGTH) {
+        printf("<SHM>   Ignoring the peer's ring %s: not a t-chat ring\n", name);
+        munmap(mapping, SHM_MAPPING_LENGTH);
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = header;
+    ring->data = (uint8_t *)mapping + sizeof(Shm_header);
+    ring->position = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+
+    return ring;
+}
+
+static void detach(Shm_ring *ring) {
+    if (ring != NULL) {
+        munmap(ring->header, SHM_MAPPING_LENGTH);
+        free(ring);
+    }
+}
+
+// Offer our ring to the sender if it is the peer and not yet writing to it
+static void offer_if_needed(const struct sockaddr *sender, uint32_t sender_session) {
+    if (!enabled || !Peer_same_address(sender, (struct sockaddr *)&peer)) {
+        return;
+    }
+
+    if (__atomic_load_n(&own.header->writer_session, __ATOMIC_ACQUIRE) != sender_session) {
+        send_offer((const uint8_t *)own_name, strlen(own_name));
+    }
+}
+
+// Create our receive ring and offer it to the peer if the peer is on this host.
+// Returns true if the ring was created, in which case a receive worker must read
+// it with Shm_receive.
+bool Shm_start(const struct sockaddr *peer_addr, socklen_t peer_addr_length, uint32_t own_session, SHM_OFFER_FN offer) {
+    if (!is_local(peer_addr)) {
+        return false;
+    }
+
+    snprintf(own_name, sizeof(own_name), SHM_PREFIX "%d-%08x", (int)getpid(), own_session);
+
+    int fd = shm_open(own_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) {
+        printf("<SHM>   Failed to create %s (%s), staying on UDP\n", own_name, strerror(errno));
+        own_name[0] = '\0';
+        return false;
+    }
+
+    void *mapping = MAP_FAILED;
+
+    if (ftruncate(fd, SHM_MAPPING_LENGTH) == 0) {
+        mapping = mmap(NULL, SHM_MAPPING_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        printf("<SHM>   Failed to map %s (%s), staying on UDP\n", own_name, strerror(errno));
+        unlink_ring();
+        return false;
+    }
+
+    if (atexit(unlink_ring) != 0) {
+        printf("<SHM>   Failed to register the ring cleanup\n");
+        exit(EXIT_FAILURE);
+    }
+
+    own.header = mapping;
+    own.data = (uint8_t *)mapping + sizeof(Shm_header);
+    own.position = 0;
+    own.header->length = SHM_RING_LENGTH;
+    own.header->owner_pid = getpid();
+    memcpy(own.header->magic, SHM_MAGIC, 8);
+
+    memcpy(&peer, peer_addr, peer_addr_length);
+    peer_length = peer_addr_length;
+    session = own_session;
+    send_offer = offer;
+    enabled = true;
+
+    printf("<SHM>   Peer is on this host, offering shared-memory ring %s\n", own_name);
+    send_offer((const uint8_t *)own_name, strlen(own_name));
+
+    return true;
+}
+
+// Close our ring, waking a writer that is waiting for room, and unmap both rings
+// (call once the worker and send threads have stopped)
+void Shm_stop() {
+    if (!enabled) {
+        return;
+    }
+
+    __atomic_store_n(&own.header->closed, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&own.header->space_futex);
+    unlink_ring();
+    munmap(own.header, SHM_MAPPING_LENGTH);
+
+    detach(target);
+    detach(__atomic_exchange_n(&offered, NULL, __ATOMIC_ACQUIRE));
+    target = NULL;
+    enabled = false;
+}
+
+// True if the peer is on this host and has a ring of ours to write to
+bool Shm_enabled() {
+    return enabled;
+}
+
+// A ping arrived: offer our ring again if the sender is a peer session that
+// hasn't attached to it yet (the first offer was lost, or the peer restarted)
+void Shm_heard(const struct sockaddr *sender, uint32_t sender_session) {
+    offer_if_needed(sender, sender_session);
+}
+
+// The peer offered its ring: map it for send_run, and offer ours in return
+void Shm_offered(const struct sockaddr *sender, uint32_t sender_session, const uint8_t *name, size_t length) {
+    char ring_name[SHM_NAME_LENGTH];
+
+    if (!enabled || !Peer_same_address(sender, (struct sockaddr *)&peer)) {
+        return;
+    }
+
+    // A single component under SHM_PREFIX, nothing else
+    if (length >= sizeof(ring_name) || length <= strlen(SHM_PREFIX)
+    || memcmp(name, SHM_PREFIX, strlen(SHM_PREFIX)) != 0 || memchr(name + 1, '/', length - 1) != NULL
+    || memchr(name, '\0', length) != NULL) {
+        printf("<SHM>   Ignoring an invalid ring offer\n");
+        return;
+    }
+
+    memcpy(ring_name, name, length);
+    ring_name[length] = '\0';
+
+    pthread_mutex_lock(&shm_mutex);
+    {
+        // Offers are repeated, but each ring only needs mapping once
+        if (strcmp(ring_name, attached_name) != 0) {
+            Shm_ring *ring = attach(ring_name);
+
+            if (ring != NULL) {
+                __atomic_store_n(&ring->header->writer_session, session, __ATOMIC_RELEASE);
+                detach(__atomic_exchange_n(&offered, ring, __ATOMIC_ACQ_REL));
+                strcpy(attached_name, ring_name);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shm_mutex);
+
+    offer_if_needed(sender, sender_session);
+}
+
+// Publish what has been written to the ring, waking the reader if it sleeps
+static void publish(Shm_ring *ring) {
+    Shm_header *header = ring->header;
+
+    if (__atomic_load_n(&header->tail, __ATOMIC_RELAXED) == ring->position) {
+        return;
+    }
+
+    __atomic_store_n(&header->tail, ring->position, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&header->reader_sleeping, __ATOMIC_SEQ_CST)) {
+        futex_wake(&header->data_futex);
+    }
+}
+
+// Wait until bytes more can be written, or the reader closes the ring. Returns
+// false if the reader made no room for SHM_STALL_MS.
+static bool wait_for_space(Shm_ring *ring, size_t bytes) {
+    Shm_header *header = ring->header;
+    uint64_t deadline = Waiter_now_ns() + (uint64_t)SHM_STALL_MS * 1000000;
+    uint64_t span = Trace_begin();
+    bool room = false;
+
+    while (!room && Waiter_now_ns() < deadline) {
+        uint32_t seen = __atomic_load_n(&header->space_futex, __ATOMIC_ACQUIRE);
+
+        __atomic_store_n(&header->writer_sleeping, 1, __ATOMIC_SEQ_CST);
+
+        room = ring->position + bytes - __atomic_load_n(&header->head, __ATOMIC_SEQ_CST) <= SHM_RING_LENGTH
+            || __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE);
+
+        if (!room) {
+            futex_wait(&header->space_futex, seen, SHM_WAIT_MS);
+        }
+
+        __atomic_store_n(&header->writer_sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    Trace_end("shm wait for space", span);
+
+    return room;
+}
+
+// Write datagrams to the ring until one doesn't fit or the ring is lost
+static int write_ring(Shm_ring *ring, const struct iovec *datagrams, int count) {
+    Shm_header *header = ring->header;
+    int written = 0;
+
+    while (written < count) {
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+            printf("<SHM>   The peer closed its ring, sending over UDP\n");
+            return -written - 1;
+        }
+
+        uint32_t length = datagrams[written].iov_len;
+        size_t size = record_size(length);
+        size_t offset = ring->position & SHM_MASK;
+        size_t skip = SHM_RING_LENGTH - offset < size ? SHM_RING_LENGTH - offset : 0;
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+        if (ring->position + skip + size - head > SHM_RING_LENGTH) {
+            publish(ring);
+
+            if (!wait_for_space(ring, skip + size)) {
+                printf("<SHM>   The peer stopped reading its ring, sending over UDP\n");
+                return -written - 1;
+            }
+
+            continue;
+        }
+
+        // Records never wrap; the reader skips the end of the ring instead
+        if (skip > 0) {
+            uint32_t wrap = SHM_WRAP;
+
+            memcpy(ring->data + offset, &wrap, sizeof(wrap));
+            ring->position += skip;
+            offset = 0;
+        }
+
+        memcpy(ring->data + offset, &length, sizeof(length));
+        memcpy(ring->data + offset + sizeof(length), datagrams[written].iov_base, length);
+        ring->position += size;
+        written++;
+    }
+
+    publish(ring);
+
+    return written;
+}
+
+// Hand as many of count framed datagrams as possible to a peer on this host.
+// Returns the number taken, which the caller must not send again; the rest go
+// over UDP (all of them while no peer ring is attached).
+int Shm_send(const struct iovec *datagrams, int count) {
+    Shm_ring *next = __atomic_exchange_n(&offered, NULL, __ATOMIC_ACQUIRE);
+
+    if (next != NULL) {
+        detach(target);
+        target = next;
+        printf("<SHM>   Sending to the peer through shared memory\n");
+    }
+
+    if (target == NULL || count == 0) {
+        return 0;
+    }
+
+    int written = write_ring(target, datagrams, count);
+
+    // A ring that failed once is given up on; UDP carries the rest of the session
+    if (written < 0) {
+        written = -written - 1;
+        detach(target);
+        target = NULL;
+    }
+
+    Stats_add(STATS_SHM_SENT, written);
+
+    return written;
+}
+
+// Wait for data in our ring, spinning first in --low-latency mode. Returns the tail.
+static uint64_t wait_for_data() {
+    Shm_header *header = own.header;
+    uint64_t start = Waiter_now_ns();
+    uint64_t tail;
+
+    while ((tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE)) == own.position) {
+        if (Waiter_now_ns() - start < Waiter_spin_ns()) {
+            Waiter_relax();
+            continue;
+        }
+
+        uint32_t seen = __atomic_load_n(&header->data_futex, __ATOMIC_ACQUIRE);
+
+        __atomic_store_n(&header->reader_sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) == own.position) {
+            uint64_t span = Trace_begin();
+
+            futex_wait(&header->data_futex, seen, SHM_WAIT_MS);
+            Trace_end("shm wait", span);
+        }
+
+        __atomic_store_n(&header->reader_sleeping, 0, __ATOMIC_RELAXED);
+        pthread_testcancel();
+    }
+
+    return tail;
+}
+
+// Read up to count datagrams from our ring into reads (read_length bytes each),
+// filling in msgs as recvmmsg would, with the peer as the sender. Blocks until
+// at least one datagram is waiting.
+int Shm_receive(uint8_t *reads, size_t read_length, struct mmsghdr *msgs, int count) {
+    Shm_header *header = own.header;
+    uint64_t tail = wait_for_data();
+    int n = 0;
+
+    while (n < count && own.position != tail) {
+        size_t offset = own.position & SHM_MASK;
+        uint32_t length;
+
+        memcpy(&length, own.data + offset, sizeof(length));
+
+        if (length == SHM_WRAP) {
+            own.position += SHM_RING_LENGTH - offset;
+            continue;
+        }
+
+        // The writer is another process; don't trust it to stay in bounds
+        if (offset + record_size(length) > SHM_RING_LENGTH) {
+            printf("<SHM>   Corrupt record in our ring, closing it\n");
+            __atomic_store_n(&header->closed, 1, __ATOMIC_SEQ_CST);
+            own.position = tail;
+            break;
+        }
+
+        struct msghdr *hdr = &msgs[n].msg_hdr;
+        size_t copied = length < read_length ? length : read_length;
+
+        memcpy(reads + n * read_length, own.data + offset + sizeof(length), copied);
+        memcpy(hdr->msg_name, &peer, peer_length);
+        hdr->msg_namelen = peer_length;
+        hdr->msg_controllen = 0;
+        hdr->msg_flags = length > read_length ? MSG_TRUNC : 0;
+        msgs[n].msg_len = copied;
+
+        own.position += record_size(length);
+        n++;
+    }
+
+    __atomic_store_n(&header->head, own.position, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&header->writer_sleeping, __ATOMIC_SEQ_CST)) {
+        futex_wake(&header->space_futex);
+    }
+
+    Stats_add(STATS_SHM_RECEIVED, n);
+
+    return n;
+}
@@ -0,0 +1,52 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Shared-memory transport to a peer on the same host.
+ *
+ *  When the peer's address is one of this host's, each instance creates a
+ *  receive ring with shm_open and offers its name to the peer in a
+ *  PACKET_SHM_OFFER datagram over the UDP socket. The peer maps the ring and
+ *  send_run writes its chat datagrams there instead of to the socket, framed
+ *  and sealed exactly as they would be sent, and a receive worker of our own
+ *  reads them back into recv_run. Heartbeats, pongs and spooled messages stay
+ *  on UDP.
+ *
+ *  A ring is single-producer, single-consumer: records of { u32 length, datagram }
+ *  padded to 8 bytes, between a head the reader advances and a tail the writer
+ *  advances. Each side sleeps on a futex in the shared mapping and is woken by
+ *  the other only when it has said it is sleeping, so a busy ring costs no
+ *  system calls. The writer falls back to UDP when the reader closes the ring or
+ *  stops making room for SHM_STALL_MS.
+ *
+ *  Offers are repeated whenever a ping or offer arrives from a peer session that
+ *  is not yet writing to our ring, so a lost offer or a restarted peer only
+ *  costs a heartbeat. The ring is unlinked at exit.
+ */
+
+#define SHM_MAGIC "TCSHM001"
+#define SHM_PREFIX "/t-chat-"
+#define SHM_NAME_LENGTH 40
+#define SHM_RING_LENGTH (4 * 1024 * 1024) // Data bytes of each ring, a power of two
+#define SHM_STALL_MS 1000
+#define SHM_WAIT_MS 100                   // Longest futex sleep, so that cancellation and closing are noticed
+
+// Sends our ring's name to the peer in a PACKET_SHM_OFFER
+typedef void (*SHM_OFFER_FN)(const uint8_t *name, size_t length);
+
+// Prototypes
+bool Shm_start(const struct sockaddr *peer, socklen_t peer_length, uint32_t session, SHM_OFFER_FN offer);
+void Shm_stop();
+bool Shm_enabled();
+void Shm_heard(const struct sockaddr *sender, uint32_t sender_session);
+void Shm_offered(const struct sockaddr *sender, uint32_t sender_session, const uint8_t *name, size_t length);
+int Shm_send(const struct iovec *datagrams, int count);
+int Shm_receive(uint8_t *reads, size_t read_length, struct mmsghdr *msgs, int count);
+
+#endif
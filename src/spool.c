@@ -0,0 +1,362 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
+#include "waiter.h"
+
+// Static variables
+static int spool_fd = -1;
+static const char *spool_path;
+static struct sockaddr_storage peer;
+static SPOOL_SEND_FN send_message = NULL;
+
+static uint64_t read_offset;    // First message not yet replayed
+static uint64_t write_offset;   // End of the last complete message
+static int pending = 0;         // Messages between the two
+static int replayed = 0;        // Messages replayed since the spool last emptied
+static bool spooling = false;   // Whether the user has been told that messages are spooled
+static bool dirty = false;      // Appended or replayed since the last fsync
+static uint64_t last_sync_ns = 0;
+
+static pthread_t spool_pthread;
+static pthread_mutex_t spool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void store16_be(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static uint16_t load16_be(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | (uint16_t)p[1];
+}
+
+static void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store64_be(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static uint64_t load64_be(const uint8_t *p) {
+    uint64_t v = 0;
+
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+// pread or pwrite all of length bytes, returning false on error or end of file
+static bool transfer(bool writing, void *buffer, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t bytes = writing
+            ? pwrite(spool_fd, buffer, length, offset)
+            : pread(spool_fd, buffer, length, offset);
+
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        buffer = (uint8_t *)buffer + bytes;
+        length -= bytes;
+        offset += bytes;
+    }
+
+    return true;
+}
+
+// Rewrite the header with the current read offset
+static bool write_header() {
+    uint8_t header[SPOOL_HEADER_LENGTH];
+
+    memcpy(header, SPOOL_MAGIC, 8);
+    store64_be(header + 8, read_offset);
+
+    return transfer(true, header, sizeof(header), 0);
+}
+
+// Bytes before the text of a record whose length field is prefix
+static size_t prefix_length(uint16_t prefix) {
+    return (prefix & SPOOL_CHANNEL_BIT) ? 6 : 2;
+}
+
+// Append a message to the end of the spool (call with spool_mutex held)
+static void append(uint32_t channel, const char *text, size_t length) {
+    uint8_t record[6 + SPOOL_CHANNEL_BIT];
+    uint16_t prefix = channel != 0 ? SPOOL_CHANNEL_BIT : 0;
+
+    if (length > SPOOL_CHANNEL_BIT - 1) {
+        length = SPOOL_CHANNEL_BIT - 1;
+    }
+
+    if (!spooling) {
+        printf("<SPOOL> Peer unreachable, spooling messages to %s\n", spool_path);
+        spooling = true;
+    }
+
+    store16_be(record, prefix | length);
+    store32_be(record + 2, channel);
+    memcpy(record + prefix_length(prefix), text, length);
+
+    if (!transfer(true, record, prefix_length(prefix) + length, write_offset)) {
+        printf("<SPOOL> Failed to spool message: %s\n", strerror(errno));
+        return;
+    }
+
+    write_offset += prefix_length(prefix) + length;
+    pending++;
+    dirty = true;
+    Stats_add(STATS_SPOOLED, 1);
+}
+
+// Send up to a batch of spooled messages, in order (call with spool_mutex held)
+static void replay() {
+    char text[SPOOL_CHANNEL_BIT];
+    int sent = 0;
+
+    while (sent < SPOOL_REPLAY_BATCH && read_offset < write_offset) {
+        uint8_t prefix[6];
+
+        if (!transfer(false, prefix, 2, read_offset)
+        || !transfer(false, prefix + 2, prefix_length(load16_be(prefix)) - 2, read_offset + 2)) {
+            printf("<SPOOL> Failed to read %s: %s\n", spool_path, strerror(errno));
+            break;
+        }
+
+        size_t start = prefix_length(load16_be(prefix));
+        size_t length = load16_be(prefix) & ~SPOOL_CHANNEL_BIT;
+        uint32_t channel = start > 2 ? load32_be(prefix + 2) : 0;
+
+        if (!transfer(false, text, length, read_offset + start)) {
+            printf("<SPOOL> Failed to read %s: %s\n", spool_path, strerror(errno));
+            break;
+        }
+
+        // Keep the message if the peer can't be reached; it is retried next tick
+        if (!send_message(channel, text, length)) {
+            break;
+        }
+
+        read_offset += start + length;
+        pending--;
+        replayed++;
+        sent++;
+    }
+
+    if (sent == 0) {
+        return;
+    }
+
+    Stats_add(STATS_SPOOL_REPLAYED, sent);
+    dirty = true;
+
+    // Start over at the header once everything is replayed, so the file stays small
+    if (read_offset == write_offset) {
+        read_offset = write_offset = SPOOL_HEADER_LENGTH;
+
+        if (ftruncate(spool_fd, SPOOL_HEADER_LENGTH) < 0) {
+            printf("<SPOOL> Failed to truncate %s: %s\n", spool_path, strerror(errno));
+        }
+
+        printf("<SPOOL> Peer is back, replayed %d spooled messages\n", replayed);
+        replayed = 0;
+        spooling = false;
+    }
+
+    if (!write_header()) {
+        printf("<SPOOL> Failed to update %s: %s\n", spool_path, strerror(errno));
+    }
+}
+
+// Spool thread: replays at a steady pace while the peer is up, and syncs the file
+static void *spool_run(void *unused) {
+    struct timespec tick = {0, SPOOL_REPLAY_TICK_MS * 1000000L};
+
+    Trace_thread("spool");
+
+    while (true) {
+        nanosleep(&tick, NULL);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&spool_mutex);
+        {
+            if (pending > 0 && Link_is_up((struct sockaddr *)&peer)) {
+                replay();
+            }
+
+            uint64_t now = Waiter_now_ns();
+
+            if (dirty && now - last_sync_ns >= (uint64_t)SPOOL_SYNC_MS * 1000000) {
+                fdatasync(spool_fd);
+                dirty = false;
+                last_sync_ns = now;
+            }
+        }
+        pthread_mutex_unlock(&spool_mutex);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+// Open (or create) the spool at path for messages to peer, and start replaying
+// what an earlier session left in it
+void Spool_open(const char *path, const struct sockaddr *peer_addr, socklen_t peer_length, SPOOL_SEND_FN send) {
+    struct stat st;
+    uint8_t header[SPOOL_HEADER_LENGTH];
+
+    spool_path = path;
+    send_message = send;
+    memcpy(&peer, peer_addr, peer_length);
+
+    if ((spool_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 || fstat(spool_fd, &st) < 0) {
+        printf("<SPOOL> Failed to open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    read_offset = write_offset = SPOOL_HEADER_LENGTH;
+
+    if (st.st_size == 0) {
+        if (!write_header()) {
+            printf("<SPOOL> Failed to write %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (st.st_size < SPOOL_HEADER_LENGTH
+        || !transfer(false, header, sizeof(header), 0)
+        || memcmp(header, SPOOL_MAGIC, 8) != 0
+        || load64_be(header + 8) < SPOOL_HEADER_LENGTH
+        || load64_be(header + 8) > (uint64_t)st.st_size) {
+            printf("<SPOOL> %s is not a spool file\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        read_offset = write_offset = load64_be(header + 8);
+
+        // Count what is left, stopping at a message cut short by a crash
+        while (write_offset + 2 <= (uint64_t)st.st_size) {
+            uint8_t prefix[2];
+
+            if (!transfer(false, prefix, 2, write_offset)) {
+                break;
+            }
+
+            uint64_t end = write_offset + prefix_length(load16_be(prefix)) + (load16_be(prefix) & ~SPOOL_CHANNEL_BIT);
+
+            if (end > (uint64_t)st.st_size) {
+                break;
+            }
+
+            write_offset = end;
+            pending++;
+        }
+
+        if (write_offset < (uint64_t)st.st_size) {
+            printf("<SPOOL> Discarding a partly written message at the end of %s\n", path);
+
+            if (ftruncate(spool_fd, write_offset) < 0) {
+                printf("<SPOOL> Failed to truncate %s: %s\n", path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (pending > 0) {
+            printf("<SPOOL> %d messages from an earlier session will be sent once the peer answers\n", pending);
+            spooling = true;
+        }
+    }
+
+    if (pthread_create(&spool_pthread, NULL, spool_run, NULL) != 0) {
+        printf("Error creating spool thread. Exiting\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Stop replaying and sync the spool, leaving what is left for the next session
+void Spool_close() {
+    if (spool_fd < 0) {
+        return;
+    }
+
+    pthread_cancel(spool_pthread);
+    pthread_join(spool_pthread, NULL);
+
+    if (pending > 0) {
+        printf("<SPOOL> %d messages stay spooled in %s for the next session\n", pending, spool_path);
+    }
+
+    fdatasync(spool_fd);
+    close(spool_fd);
+    spool_fd = -1;
+}
+
+// True if --spool is on
+bool Spool_enabled() {
+    return spool_fd >= 0;
+}
+
+// Spool the message instead of sending it if the peer is down or older messages
+// are still spooled. Returns true if the message was spooled.
+bool Spool_offer(uint32_t channel, const char *text, size_t length) {
+    bool spooled = false;
+
+    if (spool_fd < 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&spool_mutex);
+    {
+        if (pending > 0 || !Link_is_up((struct sockaddr *)&peer)) {
+            append(channel, text, length);
+            spooled = true;
+        }
+    }
+    pthread_mutex_unlock(&spool_mutex);
+
+    return spooled;
+}
+
+// Spool a message that could not be sent
+void Spool_store(uint32_t channel, const char *text, size_t length) {
+    if (spool_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&spool_mutex);
+    {
+        append(channel, text, length);
+    }
+    pthread_mutex_unlock(&spool_mutex);
+}
@@ -0,0 +1,44 @@
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Disk spool for messages the peer cannot receive (--spool <file>).
+ *
+ *  While heartbeats report the peer as down, or after a send fails, typed
+ *  messages are appended to the spool file instead of being sent. Once the peer
+ *  answers again a spool thread replays them in order, SPOOL_REPLAY_BATCH every
+ *  SPOOL_REPLAY_TICK_MS, and new messages keep going through the spool until it
+ *  is empty so that they never overtake older ones. The file is fsynced every
+ *  SPOOL_SYNC_MS while it has unsynced appends, and what is still spooled at
+ *  exit is replayed by the next session using the same file.
+ *
+ *  File layout (integers big-endian):
+ *      u8[8] SPOOL_MAGIC, u64 offset of the first message not yet replayed,
+ *      then per message { u16 length, [u32 channel,] text }
+ *  where the channel ID is only there, for messages in a named channel, if
+ *  SPOOL_CHANNEL_BIT is set in the length.
+ */
+
+#define SPOOL_MAGIC "TCSPOOL1"
+#define SPOOL_HEADER_LENGTH 16
+#define SPOOL_REPLAY_TICK_MS 20
+#define SPOOL_REPLAY_BATCH 8
+#define SPOOL_SYNC_MS 1000
+#define SPOOL_CHANNEL_BIT 0x8000
+
+// Sends one replayed message to the peer, returning false if it could not be sent
+typedef bool (*SPOOL_SEND_FN)(uint32_t channel, const char *text, size_t length);
+
+// Prototypes
+void Spool_open(const char *path, const struct sockaddr *peer, socklen_t peer_length, SPOOL_SEND_FN send);
+void Spool_close();
+bool Spool_enabled();
+bool Spool_offer(uint32_t channel, const char *text, size_t length);
+void Spool_store(uint32_t channel, const char *text, size_t length);
+
+#endif
@@ -0,0 +1,334 @@
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+
+typedef struct Histogram_s Histogram;
+struct Histogram_s {
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS]; // Bucket i counts samples in [2^(i-1), 2^i)
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+// One thread's counters, on cache lines of their own
+typedef struct Shard_s Shard;
+struct Shard_s {
+    uint64_t counters[STATS_NUM_COUNTERS];
+} __attribute__((aligned(64)));
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+    [STATS_WAIT_SPIN_HITS] = "wait spin hits",
+    [STATS_WAIT_PARKS]     = "wait parks",
+    [STATS_WAIT_SPIN_NS]   = "wait spin ns",
+    [STATS_RECV_SPIN_HITS] = "recv spin hits",
+    [STATS_RECV_BLOCKS]    = "recv blocking calls",
+    [STATS_RECV_RATE_LIMITED] = "recv rate limited",
+    [STATS_PEERS_EVICTED]  = "peers evicted",
+    [STATS_MSGS_SENT]      = "messages sent",
+    [STATS_BYTES_SENT]     = "bytes sent",
+    [STATS_MSGS_RECEIVED]  = "messages received",
+    [STATS_BYTES_RECEIVED] = "bytes received",
+    [STATS_SEND_LIST_FULL] = "send list full drops",
+    [STATS_RECV_LIST_FULL] = "recv list full drops",
+    [STATS_SEND_ERRORS]    = "send errors",
+    [STATS_RECV_ERRORS]    = "recv errors",
+    [STATS_SEND_MUTEX_NS]  = "send_mutex blocked ns",
+    [STATS_RECV_MUTEX_NS]  = "recv_mutex blocked ns",
+    [STATS_WORKER_MUTEX_NS] = "worker mutex blocked ns",
+    [STATS_SEND_COND_NS]   = "send_cond blocked ns",
+    [STATS_RECV_COND_NS]   = "recv_cond blocked ns",
+    [STATS_WORKER_COND_NS] = "worker cond blocked ns",
+    [STATS_SEND_LIST_HIGH] = "send_list high water",
+    [STATS_RECV_LIST_HIGH] = "recv queues high water",
+    [STATS_SPOOLED]        = "messages spooled",
+    [STATS_SPOOL_REPLAYED] = "spooled messages replayed",
+    [STATS_RECV_KERNEL_DROPS] = "recv kernel drops",
+    [STATS_RECV_BUFFER_BYTES] = "recv buffer bytes",
+    [STATS_RECV_SANITIZED] = "recv sanitized",
+    [STATS_SEND_SEGMENTED] = "send gso datagrams",
+    [STATS_RECV_COALESCED] = "recv gro datagrams",
+    [STATS_SHM_SENT] = "shm datagrams sent",
+    [STATS_SHM_RECEIVED] = "shm datagrams received",
+    [STATS_TUI_FRAMES] = "tui frames",
+    [STATS_TUI_BYTES] = "tui bytes written",
+    [STATS_SCROLLBACK_EVICTED] = "scrollback lines evicted",
+    [STATS_RECV_DUPLICATES] = "recv duplicates",
+    [STATS_RECV_BLOOM_DUPLICATES] = "recv bloom duplicates",
+    [STATS_DEDUP_BLOOM_CHECKS] = "dedup bloom checks",
+    [STATS_DEDUP_BLOOM_FALSE_PPB] = "dedup bloom false ppb",
+    [STATS_SEND_CONTROL] = "send control lane",
+    [STATS_SEND_CHAT] = "send chat lane",
+    [STATS_SEND_BULK] = "send bulk lane",
+    [STATS_RECV_UNJOINED] = "recv unjoined channel",
+    [STATS_CHANNEL_BACKLOG_DROPPED] = "channel backlog drops",
+};
+
+// Counters aggregated by maximum rather than by sum
+static const bool counter_is_max[STATS_NUM_COUNTERS] = {
+    [STATS_SEND_LIST_HIGH] = true,
+    [STATS_RECV_LIST_HIGH] = true,
+    [STATS_RECV_BUFFER_BYTES] = true,
+};
+
+static const char *histogram_names[STATS_NUM_HISTOGRAMS] = {
+    [STATS_SEND_HANDOFF]   = "send handoff",
+    [STATS_SCREEN_HANDOFF] = "screen handoff",
+};
+
+// Static variables
+static Shard shards[STATS_MAX_THREADS];
+static int num_shards = 0;
+static __thread Shard *local_shard = NULL;
+static Histogram histograms[STATS_NUM_HISTOGRAMS];
+
+static pthread_t dump_pthread;
+static bool dump_started = false;
+static const char *dump_path = NULL;
+static int dump_interval_ms;
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The calling thread's counters, assigned on first use
+static Shard *shard() {
+    if (local_shard == NULL) {
+        local_shard = &shards[__atomic_fetch_add(&num_shards, 1, __ATOMIC_RELAXED) % STATS_MAX_THREADS];
+    }
+
+    return local_shard;
+}
+
+// Add amount to counter
+void Stats_add(Stats_counter counter, uint64_t amount) {
+    __atomic_fetch_add(&shard()->counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+// Raise a high-water mark to value if it is higher
+void Stats_max(Stats_counter counter, uint64_t value) {
+    uint64_t *mark = &shard()->counters[counter];
+    uint64_t max = __atomic_load_n(mark, __ATOMIC_RELAXED);
+
+    while (value > max && !__atomic_compare_exchange_n(mark, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Record a latency sample in nanoseconds
+void Stats_record(Stats_histogram histogram, uint64_t ns) {
+    Histogram *h = &histograms[histogram];
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    if (bucket >= STATS_HISTOGRAM_BUCKETS) {
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Current value of counter, aggregated over every thread
+uint64_t Stats_get(Stats_counter counter) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < STATS_MAX_THREADS; i++) {
+        uint64_t part = __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+
+        if (counter_is_max[counter]) {
+            value = part > value ? part : value;
+        } else {
+            value += part;
+        }
+    }
+
+    return value;
+}
+
+// Upper bound of the bucket holding the given fraction of samples
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double fraction) {
+    uint64_t target = (uint64_t)(count * fraction);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+
+        if (seen > target) {
+            return i == 0 ? 0 : (i >= 63 ? UINT64_MAX : ((uint64_t)1 << i) - 1);
+        }
+    }
+
+    return 0;
+}
+
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Print every counter and histogram, plus the CPU time used so far
+void Stats_print(FILE *out) {
+    fprintf(out, "Counters:\n");
+
+    for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+        fprintf(out, "  %-24s %llu\n", counter_names[i], (unsigned long long)Stats_get(i));
+    }
+
+    fprintf(out, "Latency (ns):              count       mean        p50        p99        max\n");
+
+    for (int i = 0; i < STATS_NUM_HISTOGRAMS; i++) {
+        uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+        uint64_t count = 0;
+
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            buckets[b] = __atomic_load_n(&histograms[i].buckets[b], __ATOMIC_RELAXED);
+            count += buckets[b];
+        }
+
+        uint64_t sum = __atomic_load_n(&histograms[i].sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&histograms[i].max, __ATOMIC_RELAXED);
+
+        fprintf(out, "  %-20s %10llu %10llu %10llu %10llu %10llu\n", histogram_names[i],
+            (unsigned long long)count,
+            (unsigned long long)(count ? sum / count : 0),
+            (unsigned long long)percentile(buckets, count, 0.50),
+            (unsigned long long)percentile(buckets, count, 0.99),
+            (unsigned long long)max);
+    }
+
+    uint64_t checks = Stats_get(STATS_DEDUP_BLOOM_CHECKS);
+
+    if (checks > 0) {
+        fprintf(out, "Duplicate filter: estimated false positive rate %.6f%% over %llu Bloom checks\n",
+            Stats_get(STATS_DEDUP_BLOOM_FALSE_PPB) / 1e7 / checks, (unsigned long long)checks);
+    }
+
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(out, "CPU time: %.3f s user, %.3f s system\n",
+            timeval_seconds(usage.ru_utime), timeval_seconds(usage.ru_stime));
+    }
+}
+
+// pthread_mutex_lock, adding the time spent waiting for a contended mutex to
+// blocked and recording it as a trace span
+void Stats_lock(pthread_mutex_t *mutex, Stats_counter blocked, const char *span) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+
+    uint64_t start = now_ns();
+
+    pthread_mutex_lock(mutex);
+    Stats_add(blocked, now_ns() - start);
+    Trace_end(span, Trace_enabled() ? start : 0);
+}
+
+// pthread_cond_wait, adding the time asleep to blocked and recording it as a trace span
+void Stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, Stats_counter blocked, const char *span) {
+    uint64_t start = now_ns();
+
+    pthread_cond_wait(cond, mutex);
+    Stats_add(blocked, now_ns() - start);
+    Trace_end(span, Trace_enabled() ? start : 0);
+}
+
+// Replace the dump file with the current values
+static void dump() {
+    char tmp_path[4096];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dump_path);
+
+    FILE *out = fopen(tmp_path, "w");
+
+    if (out == NULL) {
+        printf("Failed to write stats to %s: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+
+    Stats_print(out);
+
+    if (fclose(out) != 0 || rename(tmp_path, dump_path) != 0) {
+        printf("Failed to write stats to %s: %s\n", dump_path, strerror(errno));
+    }
+}
+
+// Thread that prints the stats on SIGUSR1 and rewrites the dump file periodically
+static void *dump_run(void *unused) {
+    sigset_t usr1;
+    struct timespec interval = {dump_interval_ms / 1000, (dump_interval_ms % 1000) * 1000000L};
+
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+
+    while (true) {
+        int signum = dump_path != NULL ? sigtimedwait(&usr1, NULL, &interval) : sigwaitinfo(&usr1, NULL);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (signum == SIGUSR1) {
+            Stats_print(stdout);
+            fflush(stdout);
+        } else if (signum < 0 && errno == EAGAIN) {
+            dump();
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+// Start serving SIGUSR1, and dump_path every interval_ms if it is not NULL. Call
+// before creating any other thread, so that they all inherit SIGUSR1 blocked.
+void Stats_start(const char *path, int interval_ms) {
+    sigset_t usr1;
+
+    dump_path = path;
+    dump_interval_ms = interval_ms;
+
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+
+    if (pthread_sigmask(SIG_BLOCK, &usr1, NULL) != 0
+    || pthread_create(&dump_pthread, NULL, dump_run, NULL) != 0) {
+        printf("Error creating stats thread. Exiting\n");
+        exit(EXIT_FAILURE);
+    }
+
+    dump_started = true;
+}
+
+// Stop the stats thread, leaving the final values in the dump file
+void Stats_stop() {
+    if (!dump_started) {
+        return;
+    }
+
+    pthread_cancel(dump_pthread);
+    pthread_join(dump_pthread, NULL);
+    dump_started = false;
+
+    if (dump_path != NULL) {
+        dump();
+    }
+}
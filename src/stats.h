@@ -0,0 +1,90 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ *  Process-wide counters and latency histograms.
+ *
+ *  Every thread updates its own cache line of counters with relaxed atomics,
+ *  so the counters are cheap enough to leave on everywhere; reading one sums
+ *  (or, for high-water marks, takes the maximum of) every thread's copy.
+ *  Histograms bucket nanosecond samples by powers of two.
+ *
+ *  Besides /stats, SIGUSR1 prints everything to stdout and --stats-file keeps
+ *  a file rewritten with the latest values every --stats-interval.
+ */
+
+typedef enum Stats_counter_e Stats_counter;
+enum Stats_counter_e {
+    STATS_WAIT_SPIN_HITS,   // Queue waits satisfied while spinning
+    STATS_WAIT_PARKS,       // Queue waits that parked on a condition variable
+    STATS_WAIT_SPIN_NS,     // Time spent spinning in queue waits
+    STATS_RECV_SPIN_HITS,   // Receive polls that found data while spinning
+    STATS_RECV_BLOCKS,      // Receives that fell back to a blocking call
+    STATS_RECV_RATE_LIMITED, // Datagrams dropped by a sender's token bucket
+    STATS_PEERS_EVICTED,    // Senders forgotten to make room for new ones
+    STATS_MSGS_SENT,        // Chat messages handed to the kernel
+    STATS_BYTES_SENT,       // Their datagram bytes
+    STATS_MSGS_RECEIVED,    // Chat messages queued for the screen
+    STATS_BYTES_RECEIVED,   // Their text bytes
+    STATS_SEND_LIST_FULL,   // Typed messages dropped because send_list was full
+    STATS_RECV_LIST_FULL,   // Received messages dropped because a receive queue was full
+    STATS_SEND_ERRORS,      // Failed sendmmsg/sendto calls
+    STATS_RECV_ERRORS,      // Failed recvmmsg calls
+    STATS_SEND_MUTEX_NS,    // Time blocked on each mutex and condition variable
+    STATS_RECV_MUTEX_NS,
+    STATS_WORKER_MUTEX_NS,
+    STATS_SEND_COND_NS,
+    STATS_RECV_COND_NS,
+    STATS_WORKER_COND_NS,
+    STATS_SEND_LIST_HIGH,   // High-water marks of the queues (maxima, not sums)
+    STATS_RECV_LIST_HIGH,
+    STATS_SPOOLED,          // Messages written to the --spool file
+    STATS_SPOOL_REPLAYED,   // Spooled messages sent once the peer was back
+    STATS_RECV_KERNEL_DROPS, // Datagrams the kernel dropped because a receive buffer was full
+    STATS_RECV_BUFFER_BYTES, // Largest receive buffer (SO_RCVBUF) in use
+    STATS_RECV_SANITIZED,   // Received messages with control characters or bad UTF-8 escaped
+    STATS_SEND_SEGMENTED,   // Datagrams sent as part of a UDP GSO message
+    STATS_RECV_COALESCED,   // Datagrams received as part of a UDP GRO read
+    STATS_SHM_SENT,         // Datagrams written to a local peer's shared-memory ring
+    STATS_SHM_RECEIVED,     // Datagrams read from our own ring
+    STATS_TUI_FRAMES,       // Frames --tui drew
+    STATS_TUI_BYTES,        // Bytes of escapes and text they wrote to the terminal
+    STATS_SCROLLBACK_EVICTED, // Lines dropped from the --tui scrollback to stay under its cap
+    STATS_RECV_DUPLICATES,  // Chat datagrams a peer's sequence bitmap had already seen
+    STATS_RECV_BLOOM_DUPLICATES, // Chat datagrams the Bloom filter had (probably) already seen
+    STATS_DEDUP_BLOOM_CHECKS,
+    STATS_DEDUP_BLOOM_FALSE_PPB, // Sum of the expected false positive rate of each check, in billionths
+    STATS_SEND_CONTROL,     // Messages send_run took from each lane
+    STATS_SEND_CHAT,
+    STATS_SEND_BULK,
+    STATS_RECV_UNJOINED,    // Chat datagrams for a channel that was never joined
+    STATS_CHANNEL_BACKLOG_DROPPED, // Unread messages dropped because their channel's queue was full
+    STATS_NUM_COUNTERS
+};
+
+typedef enum Stats_histogram_e Stats_histogram;
+enum Stats_histogram_e {
+    STATS_SEND_HANDOFF,     // Keyboard enqueue to send_run wakeup
+    STATS_SCREEN_HANDOFF,   // Worker enqueue to screen_run wakeup
+    STATS_NUM_HISTOGRAMS
+};
+
+#define STATS_HISTOGRAM_BUCKETS 64
+#define STATS_MAX_THREADS 64 // Threads beyond this share counters (still atomically)
+
+// Prototypes
+void Stats_add(Stats_counter counter, uint64_t amount);
+void Stats_max(Stats_counter counter, uint64_t value);
+void Stats_record(Stats_histogram histogram, uint64_t ns);
+uint64_t Stats_get(Stats_counter counter);
+void Stats_print(FILE *out);
+void Stats_lock(pthread_mutex_t *mutex, Stats_counter blocked, const char *span);
+void Stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, Stats_counter blocked, const char *span);
+void Stats_start(const char *dump_path, int interval_ms);
+void Stats_stop();
+
+#endif
@@ -0,0 +1,718 @@
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "container.h"
+#include "list.h"
+
+/**
+ *  Microbenchmarks of the list.c operations, and of the container.h containers
+ *  that replace it for t-chat's queues, run by `make bench-list`.
+ *
+ *  list.c is built for this program with a larger node pool and more list heads
+ *  (see the Makefile).
+ *  Every benchmark builds its lists outside the timed region, times one kind of
+ *  operation, and is repeated until BENCH_MIN_OPS operations have run. The best
+ *  of BENCH_REPEATS runs is reported as CSV on stdout:
+ *      op,pattern,size,ops,ns_per_op,cache_misses_per_op
+ *  cache_misses_per_op is empty when hardware counters are not available.
+ *
+ *  Patterns:
+ *      fresh      nodes taken from the pool in address order
+ *      scattered  the pool's free list shuffled first, so neighbouring list
+ *                 nodes sit far apart in memory, as after long uptime
+ *  The containers take no nodes from the pool, so the pattern does not apply
+ *  to them; they run under both for comparison.
+ *
+ *  Each container op has a list counterpart doing the same work, with an int
+ *  stored inline where the list holds a pointer to it:
+ *      ring_push_pop    prepend_trim       deque_pop_front  remove_front
+ *      deque_push_back  add                deque_pop_back   remove_back
+ *      deque_push_front insert             deque_find       search
+ *      deque_free       free
+ *  map_put and map_get time the hash map, per key, against no list op.
+ */
+
+#define BENCH_MIN_OPS (1 << 20)
+#define BENCH_REPEATS 5
+#define BENCH_MAX_SIZE 65536
+#define BENCH_SPAN_OPS 4096
+#define BENCH_MAX_LISTS (LIST_MAX_NUM_HEADS - 1)
+
+typedef struct Result_s Result;
+struct Result_s {
+    uint64_t ns;
+    uint64_t ops;
+    uint64_t misses;
+};
+
+typedef void (*BENCH_FN)(int size, Result *result);
+
+typedef struct Bench_s Bench;
+struct Bench_s {
+    const char *op;
+    BENCH_FN run;
+};
+
+// Static variables
+static int values[2 * BENCH_MAX_SIZE];
+static int perf_fd = -1;
+static uint64_t span_start_ns;
+static uint64_t span_overhead_ns = 0;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t random_u64() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+
+    return rng_state;
+}
+
+// Count cache misses of this thread if the kernel lets us
+static void open_perf() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void span_start() {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    span_start_ns = now_ns();
+}
+
+// Add the time (and cache misses) since span_start to result
+static void span_stop(Result *result, uint64_t ops) {
+    uint64_t elapsed = now_ns() - span_start_ns;
+
+    if (perf_fd >= 0) {
+        uint64_t misses = 0;
+
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (read(perf_fd, &misses, sizeof(misses)) == sizeof(misses)) {
+            result->misses += misses;
+        }
+    }
+
+    result->ns += elapsed > span_overhead_ns ? elapsed - span_overhead_ns : 0;
+    result->ops += ops;
+}
+
+static void free_nothing(void *item) {
+}
+
+static bool equals(void *item, void *arg) {
+    return item == arg;
+}
+
+#define INT_EQUAL(a, b) (*(a) == *(b))
+#define INT_HASH(key) ((uint64_t)*(key) * 0x9e3779b97f4a7c15ULL >> 32)
+
+CONTAINER_RING(Int_ring, int, CONTAINER_NO_FREE)
+CONTAINER_DEQUE(Int_deque, int, CONTAINER_NO_FREE, INT_EQUAL)
+CONTAINER_MAP(Int_map, int, int, INT_HASH, INT_EQUAL, CONTAINER_NO_FREE)
+
+static List *create() {
+    List *list = List_create();
+
+    if (list == NULL) {
+        printf("List_create failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return list;
+}
+
+static List *build(int size) {
+    List *list = create();
+
+    for (int i = 0; i < size; i++) {
+        if (List_append(list, &values[i]) < 0) {
+            printf("List_append failed, is LIST_MAX_NUM_NODES large enough?\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return list;
+}
+
+// Shuffle the node pool's free list by freeing a full list's nodes in random order
+static void scatter_pool() {
+    List *list = build(LIST_MAX_NUM_NODES);
+
+    while (List_count(list) > 0) {
+        List_first(list);
+
+        while (List_curr(list) != NULL) {
+            if (random_u64() & 1) {
+                List_remove(list);
+            } else {
+                List_next(list);
+            }
+        }
+    }
+
+    List_free(list, free_nothing);
+}
+
+// Lists processed per timed span, so that small lists still give spans long
+// enough to dwarf the cost of reading the clock and counters
+static int batch_for(int size) {
+    int batch = BENCH_SPAN_OPS / size;
+
+    return batch < 1 ? 1 : batch;
+}
+
+static void free_all(List **lists, int batch) {
+    for (int j = 0; j < batch; j++) {
+        List_free(lists[j], free_nothing);
+    }
+}
+
+// List_add after the current item, growing a list at its end
+static void bench_add(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = create();
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            List_add(lists[j], &values[i]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+// List_insert before the current item, growing a list at its front
+static void bench_insert(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = create();
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            List_insert(lists[j], &values[i]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+// List_insert in the middle of a list
+static void bench_insert_middle(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = build(size);
+        List_first(lists[j]);
+
+        for (int i = 0; i < size / 2; i++) {
+            List_next(lists[j]);
+        }
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            List_insert(lists[j], &values[size + i]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+// List_prepend then List_trim, the FIFO pattern t-chat's queues use
+static void bench_prepend_trim(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = build(size);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            List_prepend(lists[j], &values[i]);
+            List_trim(lists[j]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+// List_remove from the front
+static void bench_remove_front(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = build(size);
+        List_first(lists[j]);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            List_remove(lists[j]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+// List_last then List_remove, from the back
+static void bench_remove_back(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = build(size);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            List_last(lists[j]);
+            List_remove(lists[j]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+// List_concat of two lists of size / 2, per concatenation
+static void bench_concat(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    batch = batch > BENCH_MAX_LISTS / 2 ? BENCH_MAX_LISTS / 2 : batch;
+
+    for (int j = 0; j < batch; j++) {
+        lists[2 * j] = build(size / 2);
+        lists[2 * j + 1] = build(size - size / 2);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        List_concat(lists[2 * j], lists[2 * j + 1]);
+    }
+    span_stop(result, batch);
+
+    for (int j = 0; j < batch; j++) {
+        List_free(lists[2 * j], free_nothing);
+    }
+}
+
+// List_free, per node
+static void bench_free(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = build(size);
+    }
+
+    span_start();
+    free_all(lists, batch);
+    span_stop(result, (uint64_t)batch * size);
+}
+
+// List_search for the last item, per node visited
+static void bench_search(int size, Result *result) {
+    List *lists[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        lists[j] = build(size);
+        List_first(lists[j]);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        List_search(lists[j], equals, &values[size - 1]);
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    free_all(lists, batch);
+}
+
+static Int_deque build_deque(int size) {
+    Int_deque deque;
+
+    Int_deque_init(&deque);
+
+    for (int i = 0; i < size; i++) {
+        int *slot = Int_deque_push_back(&deque);
+
+        if (slot == NULL) {
+            printf("Int_deque_push_back failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        *slot = values[i];
+    }
+
+    return deque;
+}
+
+static void destroy_deques(Int_deque *deques, int batch) {
+    for (int j = 0; j < batch; j++) {
+        Int_deque_destroy(&deques[j]);
+    }
+}
+
+// Int_ring_push then Int_ring_pop on a ring holding size ints
+static void bench_ring_push_pop(int size, Result *result) {
+    Int_ring rings[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        if (Int_ring_init(&rings[j], size + 1) < 0) {
+            printf("Int_ring_init failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < size; i++) {
+            *Int_ring_push(&rings[j]) = values[i];
+        }
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            *Int_ring_push(&rings[j]) = values[i];
+            Int_ring_pop(&rings[j]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    for (int j = 0; j < batch; j++) {
+        Int_ring_destroy(&rings[j]);
+    }
+}
+
+// Int_deque_push_back, growing from empty
+static void bench_deque_push_back(int size, Result *result) {
+    Int_deque deques[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        Int_deque_init(&deques[j]);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            *Int_deque_push_back(&deques[j]) = values[i];
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    destroy_deques(deques, batch);
+}
+
+// Int_deque_push_front, growing from empty
+static void bench_deque_push_front(int size, Result *result) {
+    Int_deque deques[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        Int_deque_init(&deques[j]);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            *Int_deque_push_front(&deques[j]) = values[i];
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    destroy_deques(deques, batch);
+}
+
+// Int_deque_pop_front, reading each element as it goes
+static void bench_deque_pop_front(int size, Result *result) {
+    Int_deque deques[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+    int sum = 0;
+
+    for (int j = 0; j < batch; j++) {
+        deques[j] = build_deque(size);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            sum += *Int_deque_front(&deques[j]);
+            Int_deque_pop_front(&deques[j]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    // Keep the reads from being optimised out
+    values[0] += sum == -1;
+    destroy_deques(deques, batch);
+}
+
+// Int_deque_pop_back, reading each element as it goes
+static void bench_deque_pop_back(int size, Result *result) {
+    Int_deque deques[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+    int sum = 0;
+
+    for (int j = 0; j < batch; j++) {
+        deques[j] = build_deque(size);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            sum += *Int_deque_back(&deques[j]);
+            Int_deque_pop_back(&deques[j]);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    values[0] += sum == -1;
+    destroy_deques(deques, batch);
+}
+
+// Int_deque_find for the last element, per element visited
+static void bench_deque_find(int size, Result *result) {
+    Int_deque deques[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+    int found = 0;
+
+    for (int j = 0; j < batch; j++) {
+        deques[j] = build_deque(size);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        found += Int_deque_find(&deques[j], &values[size - 1]) - deques[j].slots;
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    values[0] += found == -1;
+    destroy_deques(deques, batch);
+}
+
+// Int_deque_destroy, per element
+static void bench_deque_free(int size, Result *result) {
+    Int_deque deques[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+
+    for (int j = 0; j < batch; j++) {
+        deques[j] = build_deque(size);
+    }
+
+    span_start();
+    destroy_deques(deques, batch);
+    span_stop(result, (uint64_t)batch * size);
+}
+
+// Int_map_put of size new keys, growing from empty
+static void bench_map_put(int size, Result *result) {
+    Int_map maps[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+    bool added;
+
+    for (int j = 0; j < batch; j++) {
+        Int_map_init(&maps[j]);
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            *Int_map_put(&maps[j], &i, &added) = values[i];
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    for (int j = 0; j < batch; j++) {
+        Int_map_destroy(&maps[j]);
+    }
+}
+
+// Int_map_get of every key of a map of size
+static void bench_map_get(int size, Result *result) {
+    Int_map maps[BENCH_MAX_LISTS];
+    int batch = batch_for(size);
+    bool added;
+    int sum = 0;
+
+    for (int j = 0; j < batch; j++) {
+        Int_map_init(&maps[j]);
+
+        for (int i = 0; i < size; i++) {
+            *Int_map_put(&maps[j], &i, &added) = values[i];
+        }
+    }
+
+    span_start();
+    for (int j = 0; j < batch; j++) {
+        for (int i = 0; i < size; i++) {
+            sum += *Int_map_get(&maps[j], &i);
+        }
+    }
+    span_stop(result, (uint64_t)batch * size);
+
+    values[0] += sum == -1;
+
+    for (int j = 0; j < batch; j++) {
+        Int_map_destroy(&maps[j]);
+    }
+}
+
+static const Bench benches[] = {
+    {"add",           bench_add},
+    {"insert",        bench_insert},
+    {"insert_middle", bench_insert_middle},
+    {"prepend_trim",  bench_prepend_trim},
+    {"remove_front",  bench_remove_front},
+    {"remove_back",   bench_remove_back},
+    {"concat",        bench_concat},
+    {"free",          bench_free},
+    {"search",        bench_search},
+    {"ring_push_pop",    bench_ring_push_pop},
+    {"deque_push_back",  bench_deque_push_back},
+    {"deque_push_front", bench_deque_push_front},
+    {"deque_pop_front",  bench_deque_pop_front},
+    {"deque_pop_back",   bench_deque_pop_back},
+    {"deque_find",       bench_deque_find},
+    {"deque_free",       bench_deque_free},
+    {"map_put",          bench_map_put},
+    {"map_get",          bench_map_get},
+};
+
+static const int sizes[] = {16, 256, 4096, BENCH_MAX_SIZE};
+
+// Cost of an empty span, subtracted from every measurement
+static void calibrate() {
+    Result result = {0, 0, 0};
+
+    for (int i = 0; i < 100000; i++) {
+        span_start();
+        span_stop(&result, 1);
+    }
+
+    span_overhead_ns = result.ns / result.ops;
+}
+
+int main (int argc, char* argv[]) {
+    const char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt == 'o') {
+            only = optarg;
+            continue;
+        }
+
+        printf("Usage: ./t-chat-bench-list [-o operation]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Distinct values, so that deque_find matches only the last element
+    for (int i = 0; i < 2 * BENCH_MAX_SIZE; i++) {
+        values[i] = i;
+    }
+
+    open_perf();
+    calibrate();
+
+    if (perf_fd < 0) {
+        fprintf(stderr, "Hardware cache miss counter unavailable, leaving cache_misses_per_op empty\n");
+    }
+
+    printf("op,pattern,size,ops,ns_per_op,cache_misses_per_op\n");
+
+    for (int pattern = 0; pattern < 2; pattern++) {
+        if (pattern == 1) {
+            scatter_pool();
+        }
+
+        for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+            if (only != NULL && strcmp(only, benches[b].op) != 0) {
+                continue;
+            }
+
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                Result best = {0, 0, 0};
+
+                for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                    Result result = {0, 0, 0};
+
+                    // A concatenation costs one op but needs size nodes built
+                    while (result.ops < BENCH_MIN_OPS / (benches[b].run == bench_concat ? sizes[s] : 1)) {
+                        benches[b].run(sizes[s], &result);
+                    }
+
+                    if (repeat == 0 || result.ns * best.ops < best.ns * result.ops) {
+                        best = result;
+                    }
+                }
+
+                printf("%s,%s,%d,%llu,%.2f,", benches[b].op, pattern == 0 ? "fresh" : "scattered", sizes[s],
+                    (unsigned long long)best.ops, (double)best.ns / best.ops);
+
+                if (perf_fd >= 0) {
+                    printf("%.3f", (double)best.misses / best.ops);
+                }
+
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
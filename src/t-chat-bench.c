@@ -0,0 +1,479 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ *  Throughput and latency benchmark of two t-chat instances on loopback.
+ *
+ *  Peer A's keyboard is fed numbered messages stamped with CLOCK_MONOTONIC, and
+ *  peer B's screen is read back, so every message crosses keyboard_run, send_run,
+ *  the socket, recv_run and screen_run. Options after -- are passed to
+ *  t-chat-netem, which is then placed between the peers.
+ */
+
+#define BENCH_MAX_OPTIONS 16
+#define BENCH_MAX_NETEM_OPTIONS 32
+#define BENCH_LINE_LENGTH 512
+#define BENCH_MAX_SIZE 500  // Longest line t-chat reads from the keyboard, minus the newline
+#define BENCH_TAG "bench "
+#define BENCH_STARTUP_MS 300 // Time given to the peers to bind their sockets
+
+typedef struct Child_s Child;
+struct Child_s {
+    pid_t pid;
+    int stdin_fd;           // -1 unless the benchmark writes to it
+    int stdout_fd;          // -1 unless the benchmark reads from it
+    char line[BENCH_LINE_LENGTH];
+    size_t line_length;
+};
+
+// Static variables
+static int count = 1000;
+static double rate = 0;     // Messages per second (0 sends as fast as peer A accepts them)
+static int size = 64;
+static int base_port = 6000;
+static int drain_ms = 1000;
+static char *chat_options[BENCH_MAX_OPTIONS];
+static int num_chat_options = 0;
+static char directory[PATH_MAX];
+
+static uint64_t *latencies;
+static uint8_t *seen;
+static int received = 0;
+static int duplicates = 0;
+static int reordered = 0;
+static int app_drops = 0;
+static int highest_seq = -1;
+static uint64_t first_send_ns = 0;
+static uint64_t last_recv_ns = 0;
+
+static void usage() {
+    printf("Usage: ./t-chat-bench [options] [-- t-chat-netem options]\n");
+    printf("Options:\n");
+    printf("  -n <count>      Messages to send (default 1000)\n");
+    printf("  -r <rate>       Messages per second (default 0, as fast as possible)\n");
+    printf("  -s <bytes>      Message size, at least 32 and at most %d (default 64)\n", BENCH_MAX_SIZE);
+    printf("  -p <port>       First of the three ports to use (default 6000)\n");
+    printf("  -d <ms>         Wait this long for stragglers after the last message (default 1000)\n");
+    printf("  -o <option>     Pass option to both t-chat instances (repeatable)\n");
+    printf("Example:\n");
+    printf("  ./t-chat-bench -n 5000 -r 2000 -o --low-latency -- --loss 1 --delay 20 --jitter 5\n");
+}
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Start a program from this directory, optionally connected to pipes
+static Child spawn(char *argv[], bool pipe_stdin, bool pipe_stdout) {
+    Child child = { .stdin_fd = -1, .stdout_fd = -1 };
+    int in[2], out[2];
+
+    if ((pipe_stdin && pipe(in) < 0) || (pipe_stdout && pipe(out) < 0)) {
+        printf("pipe: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if ((child.pid = fork()) < 0) {
+        printf("fork: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (child.pid == 0) {
+        if (pipe_stdin) {
+            dup2(in[0], STDIN_FILENO);
+            close(in[0]);
+            close(in[1]);
+        }
+
+        if (pipe_stdout) {
+            dup2(out[1], STDOUT_FILENO);
+            close(out[0]);
+            close(out[1]);
+        } else {
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/%s", directory, argv[0]);
+        execv(path, argv);
+
+        fprintf(stderr, "Failed to run %s: %s\n", path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    if (pipe_stdin) {
+        close(in[0]);
+        child.stdin_fd = in[1];
+        fcntl(child.stdin_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    if (pipe_stdout) {
+        close(out[1]);
+        child.stdout_fd = out[0];
+    }
+
+    return child;
+}
+
+// Start t-chat listening on port and sending to dest_port. Behind the proxy the
+// instances must stay on UDP: both see a local peer and would otherwise switch
+// to shared memory, around t-chat-netem.
+static Child spawn_chat(int port, int dest_port, bool proxied) {
+    char *argv[BENCH_MAX_OPTIONS + 6];
+    char port_str[16], dest_port_str[16];
+    int argc = 0;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    snprintf(dest_port_str, sizeof(dest_port_str), "%d", dest_port);
+
+    argv[argc++] = "t-chat";
+
+    for (int i = 0; i < num_chat_options; i++) {
+        argv[argc++] = chat_options[i];
+    }
+
+    if (proxied) {
+        argv[argc++] = "--no-shm";
+    }
+
+    argv[argc++] = port_str;
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = dest_port_str;
+    argv[argc] = NULL;
+
+    return spawn(argv, true, true);
+}
+
+// Account for one line printed by peer B's screen
+static void receive_line(const char *line, uint64_t now) {
+    if (strncmp(line, "List is full!", 13) == 0) {
+        app_drops++;
+        return;
+    }
+
+    if (strncmp(line, BENCH_TAG, strlen(BENCH_TAG)) != 0) {
+        return;
+    }
+
+    int seq;
+    unsigned long long sent_ns;
+
+    if (sscanf(line + strlen(BENCH_TAG), "%d %llu", &seq, &sent_ns) != 2 || seq < 0 || seq >= count) {
+        return;
+    }
+
+    if (seen[seq]) {
+        duplicates++;
+        return;
+    }
+
+    if (seq < highest_seq) {
+        reordered++;
+    } else {
+        highest_seq = seq;
+    }
+
+    seen[seq] = 1;
+    latencies[received++] = now - sent_ns;
+    last_recv_ns = now;
+}
+
+// Read whatever child printed, handing complete lines to receive_line if wanted
+static void read_child(Child *child, bool account) {
+    char buffer[4096];
+    ssize_t bytes = read(child->stdout_fd, buffer, sizeof(buffer));
+    uint64_t now = now_ns();
+
+    if (bytes <= 0) {
+        close(child->stdout_fd);
+        child->stdout_fd = -1;
+        return;
+    }
+
+    for (ssize_t i = 0; i < bytes; i++) {
+        if (buffer[i] != '\n') {
+            if (child->line_length < sizeof(child->line) - 1) {
+                child->line[child->line_length++] = buffer[i];
+            }
+            continue;
+        }
+
+        child->line[child->line_length] = '\0';
+        child->line_length = 0;
+
+        if (account) {
+            receive_line(child->line, now);
+        }
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double fraction) {
+    int i = (int)(fraction * (received - 1));
+
+    return received > 0 ? latencies[i] / 1e3 : 0;
+}
+
+static void print_report() {
+    double elapsed = (last_recv_ns > first_send_ns ? last_recv_ns - first_send_ns : 0) / 1e9;
+    uint64_t sum = 0;
+
+    qsort(latencies, received, sizeof(uint64_t), compare_u64);
+
+    for (int i = 0; i < received; i++) {
+        sum += latencies[i];
+    }
+
+    printf("sent=%d received=%d lost=%d duplicated=%d reordered=%d app_drops=%d\n",
+        count, received, count - received, duplicates, reordered, app_drops);
+    printf("loss_pct=%.3f throughput_msgs=%.1f throughput_mbit=%.3f\n",
+        100.0 * (count - received) / count,
+        elapsed > 0 ? received / elapsed : 0,
+        elapsed > 0 ? received * (size + 1) * 8 / elapsed / 1e6 : 0);
+    printf("latency_us_mean=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+        received > 0 ? sum / 1e3 / received : 0,
+        percentile_us(0.50), percentile_us(0.90), percentile_us(0.99), percentile_us(0.999),
+        percentile_us(1.0));
+}
+
+int main (int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+n:r:s:p:d:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            case 'd':
+                drain_ms = atoi(optarg);
+                break;
+            case 'o':
+                if (num_chat_options == BENCH_MAX_OPTIONS) {
+                    printf("Too many t-chat options\n");
+                    exit(EXIT_FAILURE);
+                }
+                chat_options[num_chat_options++] = optarg;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (count <= 0 || rate < 0 || size < 32 || size > BENCH_MAX_SIZE
+    || base_port < 1024 || base_port > 65533 || drain_ms < 0) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // Everything after -- configures the proxy
+    bool use_netem = optind < argc;
+
+    if (argc - optind > BENCH_MAX_NETEM_OPTIONS) {
+        printf("Too many t-chat-netem options\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ssize_t exe_length = readlink("/proc/self/exe", directory, sizeof(directory) - 1);
+
+    if (exe_length < 0) {
+        printf("Failed to find the t-chat binaries: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    directory[exe_length] = '\0';
+    *strrchr(directory, '/') = '\0';
+
+    latencies = calloc(count, sizeof(uint64_t));
+    seen = calloc(count, 1);
+
+    if (latencies == NULL || seen == NULL) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int port_a = base_port, port_b = base_port + 1, proxy_port = base_port + 2;
+    Child netem = { .pid = -1 };
+
+    if (use_netem) {
+        char *netem_argv[BENCH_MAX_NETEM_OPTIONS + 5];
+        char ports[3][16];
+        int netem_argc = 0;
+
+        snprintf(ports[0], sizeof(ports[0]), "%d", proxy_port);
+        snprintf(ports[1], sizeof(ports[1]), "%d", port_a);
+        snprintf(ports[2], sizeof(ports[2]), "%d", port_b);
+
+        netem_argv[netem_argc++] = "t-chat-netem";
+
+        for (int i = optind; i < argc; i++) {
+            netem_argv[netem_argc++] = argv[i];
+        }
+
+        netem_argv[netem_argc++] = ports[0];
+        netem_argv[netem_argc++] = ports[1];
+        netem_argv[netem_argc++] = ports[2];
+        netem_argv[netem_argc] = NULL;
+
+        netem = spawn(netem_argv, false, false);
+    }
+
+    Child peers[2] = {
+        spawn_chat(port_a, use_netem ? proxy_port : port_b, use_netem),
+        spawn_chat(port_b, use_netem ? proxy_port : port_a, use_netem),
+    };
+    Child *sender = &peers[0], *receiver = &peers[1];
+
+    char message[BENCH_LINE_LENGTH];
+    size_t message_length = 0, message_written = 0;
+    int next_seq = 0;
+    uint64_t interval_ns = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t next_send_ns = 0;
+    uint64_t idle_since_ns = 0;
+    uint64_t start_ns = now_ns() + BENCH_STARTUP_MS * 1000000ULL;
+
+    while (received < count) {
+        struct pollfd fds[3];
+        int num_fds = 0;
+        uint64_t now = now_ns();
+        bool started = now >= start_ns;
+
+        if (started && next_seq == count && message_length == 0) {
+            if (idle_since_ns == 0 || last_recv_ns > idle_since_ns) {
+                idle_since_ns = now;
+            } else if (now - idle_since_ns > (uint64_t)drain_ms * 1000000) {
+                break;
+            }
+        }
+
+        // Build the next message once it is due
+        if (started && message_length == 0 && next_seq < count && now >= next_send_ns) {
+            int length = snprintf(message, sizeof(message), BENCH_TAG "%d %llu ",
+                next_seq, (unsigned long long)now);
+
+            while (length < size) {
+                message[length++] = 'x';
+            }
+
+            message[length++] = '\n';
+            message_length = length;
+            message_written = 0;
+
+            if (first_send_ns == 0) {
+                first_send_ns = now;
+            }
+
+            next_send_ns = (next_send_ns == 0 ? now : next_send_ns) + interval_ns;
+            next_seq++;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (peers[i].stdout_fd >= 0) {
+                fds[num_fds++] = (struct pollfd){ .fd = peers[i].stdout_fd, .events = POLLIN };
+            }
+        }
+
+        if (message_length > 0) {
+            fds[num_fds++] = (struct pollfd){ .fd = sender->stdin_fd, .events = POLLOUT };
+        }
+
+        int timeout_ms = 10;
+
+        if (message_length == 0 && next_seq < count && next_send_ns > now) {
+            timeout_ms = (next_send_ns - now) / 1000000;
+        }
+
+        if (poll(fds, num_fds, timeout_ms) < 0 && errno != EINTR) {
+            printf("poll: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < num_fds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+
+            if (fds[i].fd == sender->stdin_fd) {
+                ssize_t bytes = write(sender->stdin_fd, message + message_written, message_length - message_written);
+
+                if (bytes > 0 && (message_written += bytes) == message_length) {
+                    message_length = 0;
+                }
+            } else if (fds[i].fd == receiver->stdout_fd) {
+                read_child(receiver, true);
+            } else {
+                read_child(sender, false);
+            }
+        }
+
+        if (receiver->stdout_fd < 0 || sender->stdout_fd < 0) {
+            printf("A t-chat instance exited early\n");
+            break;
+        }
+    }
+
+    // End the session and collect the children
+    if (write(sender->stdin_fd, "!\n", 2) < 0) {
+        // The sender is already gone
+    }
+
+    usleep(100000);
+
+    for (int i = 0; i < 2; i++) {
+        kill(peers[i].pid, SIGTERM);
+        waitpid(peers[i].pid, NULL, 0);
+        close(peers[i].stdin_fd);
+
+        if (peers[i].stdout_fd >= 0) {
+            close(peers[i].stdout_fd);
+        }
+    }
+
+    if (use_netem) {
+        kill(netem.pid, SIGTERM);
+        waitpid(netem.pid, NULL, 0);
+    }
+
+    print_report();
+
+    free(latencies);
+    free(seen);
+
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+
+/**
+ *  Check that "!" never overtakes the messages queued before it, run by
+ *  `make check`.
+ *
+ *  Two t-chat daemons are started on loopback. A client subscribes to peer B,
+ *  and another sends peer A a single submit frame of numbered messages ending
+ *  in "!". The messages travel in the bulk lane and "!" in the control lane, so
+ *  peer B must still show every message, in order, before the "!". Exits with
+ *  status 0 if it does.
+ */
+
+#define CHECK_MAX_COUNT 2000
+#define CHECK_TIMEOUT_MS 5000
+#define CHECK_STARTUP_MS 2000 // Time given to the daemons to open their sockets
+#define CHECK_TAG "order "
+
+// Static variables
+static int count = 200;
+static int base_port = 6100;
+static char directory[PATH_MAX];
+static char sockets_directory[] = "/tmp/t-chat-check-XXXXXX";
+static char socket_paths[2][PATH_MAX];
+static pid_t pids[2] = {-1, -1};
+
+static void usage() {
+    printf("Usage: ./t-chat-check-order [options]\n");
+    printf("Options:\n");
+    printf("  -n <count>      Messages to send ahead of \"!\", at most %d (default 200)\n", CHECK_MAX_COUNT);
+    printf("  -p <port>       First of the two ports to use (default 6100)\n");
+}
+
+static uint64_t now_ms() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void store16_be(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void store32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t load16_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static uint32_t load32_be(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Stop the daemons and remove their sockets
+static void cleanup() {
+    for (int i = 0; i < 2; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+            pids[i] = -1;
+        }
+
+        unlink(socket_paths[i]);
+    }
+
+    rmdir(sockets_directory);
+}
+
+static void fail(const char *reason) {
+    printf("FAIL: %s\n", reason);
+    cleanup();
+    exit(EXIT_FAILURE);
+}
+
+// Start a t-chat daemon on socket_path, listening on port and sending to dest_port
+static pid_t spawn_daemon(const char *socket_path, int port, int dest_port) {
+    char port_str[16], dest_port_str[16], path[PATH_MAX + 32];
+    pid_t pid = fork();
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    snprintf(dest_port_str, sizeof(dest_port_str), "%d", dest_port);
+
+    if (pid < 0) {
+        fail("fork failed");
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        dup2(null_fd, STDOUT_FILENO);
+        snprintf(path, sizeof(path), "%s/t-chat", directory);
+        execl(path, "t-chat", "--daemon", socket_path, port_str, "localhost", dest_port_str, (char *)NULL);
+
+        fprintf(stderr, "Failed to run %s: %s\n", path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+// Connect to a daemon, retrying while it starts up
+static int connect_daemon(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    uint64_t deadline = now_ms() + CHECK_STARTUP_MS;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    while (now_ms() < deadline) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        usleep(20000);
+    }
+
+    fail("a daemon did not open its socket");
+    return -1;
+}
+
+static void write_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = write(fd, data, length);
+
+        if (bytes <= 0) {
+            fail("lost the connection to a daemon");
+        }
+
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+// Read exactly length bytes, or fail once the deadline has passed
+static void read_all(int fd, uint8_t *data, size_t length, uint64_t deadline) {
+    while (length > 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        uint64_t now = now_ms();
+
+        if (now >= deadline || poll(&pfd, 1, deadline - now) <= 0) {
+            fail("timed out waiting for \"!\"");
+        }
+
+        ssize_t bytes = read(fd, data, length);
+
+        if (bytes <= 0) {
+            fail("lost the connection to a daemon");
+        }
+
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+// Send one submit frame holding the numbered messages and then "!"
+static void submit(int fd) {
+    static uint8_t frame[DAEMON_MAX_FRAME + 4];
+    size_t length = 4;
+
+    frame[length++] = DAEMON_SUBMIT;
+    store16_be(frame + length, count + 1);
+    length += 2;
+
+    for (int i = 0; i <= count; i++) {
+        char text[32];
+        int text_length = i < count ? snprintf(text, sizeof(text), CHECK_TAG "%d", i) : snprintf(text, sizeof(text), "!");
+
+        store16_be(frame + length, text_length);
+        memcpy(frame + length + 2, text, text_length);
+        length += 2 + text_length;
+    }
+
+    store32_be(frame, length - 4);
+    write_all(fd, frame, length);
+}
+
+// Read peer B's messages until "!", checking that the numbered ones all came first and in order
+static void expect_order(int fd) {
+    static uint8_t body[DAEMON_MAX_FRAME];
+    uint64_t deadline = now_ms() + CHECK_TIMEOUT_MS;
+    int next = 0;
+
+    while (true) {
+        uint8_t header[4];
+
+        read_all(fd, header, 4, deadline);
+
+        uint32_t length = load32_be(header);
+
+        if (length == 0 || length > sizeof(body)) {
+            fail("malformed frame from peer B");
+        }
+
+        read_all(fd, body, length, deadline);
+
+        if (body[0] != DAEMON_MESSAGES) {
+            continue;
+        }
+
+        size_t offset = 3;
+
+        for (uint32_t m = 0; m < load16_be(body + 1); m++) {
+            // u64 time, u8 family, u8[16] address and u16 port come before the length
+            size_t text_length = load16_be(body + offset + 27);
+            const char *text = (const char *)body + offset + 29;
+            char expected[32];
+            char reason[128];
+
+            offset += 29 + text_length;
+
+            if (text_length == 1 && text[0] == '!') {
+                if (next < count) {
+                    snprintf(reason, sizeof(reason), "\"!\" arrived after %d of the %d messages before it", next, count);
+                    fail(reason);
+                }
+
+                return;
+            }
+
+            int expected_length = snprintf(expected, sizeof(expected), CHECK_TAG "%d", next);
+
+            if (text_length != (size_t)expected_length || memcmp(text, expected, text_length) != 0) {
+                snprintf(reason, sizeof(reason), "expected \"%s\", got \"%.*s\"", expected, (int)text_length, text);
+                fail(reason);
+            }
+
+            next++;
+        }
+    }
+}
+
+int main (int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (count <= 0 || count > CHECK_MAX_COUNT || base_port < 1024 || base_port > 65534) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    ssize_t exe_length = readlink("/proc/self/exe", directory, sizeof(directory) - 1);
+
+    if (exe_length < 0) {
+        printf("Failed to find the t-chat binaries: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    directory[exe_length] = '\0';
+    *strrchr(directory, '/') = '\0';
+
+    if (mkdtemp(sockets_directory) == NULL) {
+        printf("mkdtemp: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < 2; i++) {
+        snprintf(socket_paths[i], sizeof(socket_paths[i]), "%s/%c.sock", sockets_directory, 'a' + i);
+        pids[i] = spawn_daemon(socket_paths[i], base_port + i, base_port + 1 - i);
+    }
+
+    int receiver = connect_daemon(socket_paths[1]);
+    uint8_t subscribe[5] = {0, 0, 0, 1, DAEMON_SUBSCRIBE};
+
+    write_all(receiver, subscribe, sizeof(subscribe));
+
+    // Let peer B take the subscription before anything can arrive
+    usleep(100000);
+
+    int sender = connect_daemon(socket_paths[0]);
+
+    submit(sender);
+    expect_order(receiver);
+
+    printf("PASS: %d messages, then \"!\"\n", count);
+
+    close(sender);
+    close(receiver);
+    cleanup();
+
+    return 0;
+}
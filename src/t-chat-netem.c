@@ -0,0 +1,398 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ *  Lossy-link simulator for two t-chat instances on loopback.
+ *
+ *  Both peers send to the proxy port; datagrams from peer A's port are forwarded
+ *  to peer B and the other way round. Every datagram goes through the same
+ *  pipeline, per direction:
+ *      loss -> duplication -> bandwidth cap -> delay +/- jitter -> reordering
+ *  All random choices come from one seeded generator, so a run with the same
+ *  seed and the same input makes the same decisions.
+ */
+
+#define NETEM_MAX_DATAGRAM 65536
+#define NETEM_MAX_PENDING 4096
+#define NETEM_NUM_DIRECTIONS 2
+
+typedef struct Netem_config_s Netem_config;
+struct Netem_config_s {
+    double loss;            // Probability a datagram is dropped
+    double duplicate;       // Probability a datagram is sent twice
+    double reorder;         // Probability a datagram is held back behind later ones
+    uint64_t delay_ns;
+    uint64_t jitter_ns;     // Delay varies uniformly by up to this much either way
+    uint64_t reorder_ns;    // Extra delay of a reordered datagram
+    uint64_t rate_bps;      // Bandwidth cap in bits per second (0 for none)
+    uint64_t seed;
+};
+
+typedef struct Pending_s Pending;
+struct Pending_s {
+    uint64_t release_ns;
+    uint64_t order;         // Breaks ties so equal release times stay in arrival order
+    int direction;
+    size_t length;
+    uint8_t *data;
+};
+
+typedef struct Direction_stats_s Direction_stats;
+struct Direction_stats_s {
+    uint64_t received;
+    uint64_t forwarded;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t overflowed;    // Dropped because too many datagrams were in flight
+};
+
+// Static variables
+static Netem_config config = { .reorder_ns = 10000000, .seed = 1 };
+static uint64_t rng_state;
+static Pending heap[NETEM_MAX_PENDING];
+static int heap_size = 0;
+static uint64_t next_order = 0;
+static uint64_t link_free_ns[NETEM_NUM_DIRECTIONS]; // When each direction's link is idle again
+static Direction_stats stats[NETEM_NUM_DIRECTIONS];
+static volatile sig_atomic_t stopping = 0;
+
+static const struct option long_options[] = {
+    {"loss",      required_argument, NULL, 'l'},
+    {"duplicate", required_argument, NULL, 'd'},
+    {"reorder",   required_argument, NULL, 'r'},
+    {"delay",     required_argument, NULL, 'D'},
+    {"jitter",    required_argument, NULL, 'j'},
+    {"gap",       required_argument, NULL, 'g'},
+    {"rate",      required_argument, NULL, 'b'},
+    {"seed",      required_argument, NULL, 's'},
+    {"help",      no_argument,       NULL, 'h'},
+    {NULL,        0,                 NULL, 0}
+};
+
+static void usage() {
+    printf("Usage: ./t-chat-netem [options] [proxy port] [peer A port] [peer B port]\n");
+    printf("Forwards datagrams between two t-chat instances on 127.0.0.1, e.g.\n");
+    printf("  ./t-chat-netem --loss 2 --delay 40 --jitter 10 5000 4000 4001\n");
+    printf("  ./t-chat 4000 127.0.0.1 5000\n");
+    printf("  ./t-chat 4001 127.0.0.1 5000\n");
+    printf("Options:\n");
+    printf("  -l, --loss <percent>      Drop datagrams with this probability\n");
+    printf("  -d, --duplicate <percent> Send datagrams twice with this probability\n");
+    printf("  -r, --reorder <percent>   Hold datagrams back behind later ones with this probability\n");
+    printf("  -g, --gap <ms>            How long reordered datagrams are held back (default 10)\n");
+    printf("  -D, --delay <ms>          One-way delay\n");
+    printf("  -j, --jitter <ms>         Vary the delay uniformly by up to this much\n");
+    printf("  -b, --rate <kbit/s>       Cap the bandwidth of each direction\n");
+    printf("  -s, --seed <n>            Seed of the random number generator (default 1)\n");
+    printf("  -h, --help                Show this message\n");
+}
+
+static double parse_number(const char *arg, const char *name, double max) {
+    char *end;
+    double value = strtod(arg, &end);
+
+    if (*end != '\0' || end == arg || value < 0 || value > max) {
+        printf("Invalid %s: %s\n", name, arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+static int parse_port(const char *arg) {
+    return (int)parse_number(arg, "port", 65535);
+}
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double random_unit() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool pending_before(const Pending *a, const Pending *b) {
+    return a->release_ns < b->release_ns || (a->release_ns == b->release_ns && a->order < b->order);
+}
+
+static void heap_swap(int i, int j) {
+    Pending tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+static void heap_push(Pending pending) {
+    int i = heap_size++;
+
+    heap[i] = pending;
+
+    while (i > 0 && pending_before(&heap[i], &heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static Pending heap_pop() {
+    Pending top = heap[0];
+    int i = 0;
+
+    heap[0] = heap[--heap_size];
+
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < heap_size && pending_before(&heap[left], &heap[smallest])) {
+            smallest = left;
+        }
+
+        if (right < heap_size && pending_before(&heap[right], &heap[smallest])) {
+            smallest = right;
+        }
+
+        if (smallest == i) {
+            break;
+        }
+
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+
+    return top;
+}
+
+// Schedule one copy of a datagram travelling in direction
+static void schedule(int direction, const uint8_t *data, size_t length, uint64_t now) {
+    Direction_stats *s = &stats[direction];
+
+    if (heap_size == NETEM_MAX_PENDING) {
+        s->overflowed++;
+        return;
+    }
+
+    // The link sends one datagram at a time at rate_bps
+    uint64_t departure = now > link_free_ns[direction] ? now : link_free_ns[direction];
+
+    if (config.rate_bps > 0) {
+        link_free_ns[direction] = departure + length * 8 * 1000000000ULL / config.rate_bps;
+        departure = link_free_ns[direction];
+    }
+
+    int64_t delay = config.delay_ns;
+
+    if (config.jitter_ns > 0) {
+        delay += (int64_t)((random_unit() * 2 - 1) * config.jitter_ns);
+    }
+
+    if (config.reorder > 0 && random_unit() < config.reorder) {
+        delay += config.reorder_ns;
+        s->reordered++;
+    }
+
+    Pending pending = {
+        .release_ns = departure + (delay > 0 ? delay : 0),
+        .order = next_order++,
+        .direction = direction,
+        .length = length,
+        .data = malloc(length),
+    };
+
+    if (pending.data == NULL) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(pending.data, data, length);
+    heap_push(pending);
+}
+
+static void on_signal(int signum) {
+    stopping = 1;
+}
+
+static void print_stats() {
+    const char *names[NETEM_NUM_DIRECTIONS] = {"A -> B", "B -> A"};
+
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n",
+        "", "received", "forwarded", "lost", "duplicated", "reordered", "overflowed");
+
+    for (int i = 0; i < NETEM_NUM_DIRECTIONS; i++) {
+        printf("%-8s %10llu %10llu %10llu %10llu %10llu %10llu\n", names[i],
+            (unsigned long long)stats[i].received, (unsigned long long)stats[i].forwarded,
+            (unsigned long long)stats[i].lost, (unsigned long long)stats[i].duplicated,
+            (unsigned long long)stats[i].reordered, (unsigned long long)stats[i].overflowed);
+    }
+}
+
+int main (int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "+l:d:r:g:D:j:b:s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                config.loss = parse_number(optarg, "loss", 100) / 100;
+                break;
+            case 'd':
+                config.duplicate = parse_number(optarg, "duplication", 100) / 100;
+                break;
+            case 'r':
+                config.reorder = parse_number(optarg, "reordering", 100) / 100;
+                break;
+            case 'g':
+                config.reorder_ns = parse_number(optarg, "gap", 1e6) * 1e6;
+                break;
+            case 'D':
+                config.delay_ns = parse_number(optarg, "delay", 1e6) * 1e6;
+                break;
+            case 'j':
+                config.jitter_ns = parse_number(optarg, "jitter", 1e6) * 1e6;
+                break;
+            case 'b':
+                config.rate_bps = parse_number(optarg, "rate", 1e9) * 1000;
+                break;
+            case 's':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 3) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // xorshift must not start at zero
+    rng_state = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    struct sockaddr_in proxy = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    struct sockaddr_in peers[NETEM_NUM_DIRECTIONS] = {
+        { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) },
+        { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) },
+    };
+
+    proxy.sin_port = htons(parse_port(argv[optind]));
+    peers[0].sin_port = htons(parse_port(argv[optind + 1]));
+    peers[1].sin_port = htons(parse_port(argv[optind + 2]));
+
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (socket_fd < 0 || bind(socket_fd, (struct sockaddr *)&proxy, sizeof(proxy)) < 0) {
+        printf("Failed to bind proxy port %s: %s\n", argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    printf("Forwarding 127.0.0.1:%s <-> %s and %s (seed %llu)\n",
+        argv[optind], argv[optind + 1], argv[optind + 2], (unsigned long long)config.seed);
+    fflush(stdout);
+
+    static uint8_t buffer[NETEM_MAX_DATAGRAM];
+
+    while (!stopping) {
+        uint64_t now = now_ns();
+
+        // Release everything that is due
+        while (heap_size > 0 && heap[0].release_ns <= now) {
+            Pending pending = heap_pop();
+
+            if (sendto(socket_fd, pending.data, pending.length, 0,
+                (struct sockaddr *)&peers[1 - pending.direction], sizeof(peers[0])) < 0) {
+                printf("sendto: %s\n", strerror(errno));
+            } else {
+                stats[pending.direction].forwarded++;
+            }
+
+            free(pending.data);
+        }
+
+        int timeout_ms = -1;
+
+        if (heap_size > 0) {
+            timeout_ms = (heap[0].release_ns - now + 999999) / 1000000;
+        }
+
+        struct pollfd fds = { .fd = socket_fd, .events = POLLIN };
+
+        if (poll(&fds, 1, timeout_ms) <= 0) {
+            continue;
+        }
+
+        struct sockaddr_in from;
+        socklen_t from_length = sizeof(from);
+        ssize_t length = recvfrom(socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT,
+            (struct sockaddr *)&from, &from_length);
+
+        if (length < 0) {
+            continue;
+        }
+
+        // Datagrams from anyone but the two peers are ignored
+        int direction = -1;
+
+        for (int i = 0; i < NETEM_NUM_DIRECTIONS; i++) {
+            if (from.sin_port == peers[i].sin_port && from.sin_addr.s_addr == peers[i].sin_addr.s_addr) {
+                direction = i;
+            }
+        }
+
+        if (direction < 0) {
+            continue;
+        }
+
+        stats[direction].received++;
+        now = now_ns();
+
+        if (random_unit() < config.loss) {
+            stats[direction].lost++;
+            continue;
+        }
+
+        schedule(direction, buffer, length, now);
+
+        if (random_unit() < config.duplicate) {
+            stats[direction].duplicated++;
+            schedule(direction, buffer, length, now);
+        }
+    }
+
+    while (heap_size > 0) {
+        free(heap_pop().data);
+    }
+
+    close(socket_fd);
+    print_stats();
+
+    return 0;
+}
@@ -0,0 +1,324 @@
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+/**
+ *  Replays a --record capture into a t-chat instance.
+ *
+ *  Captured datagrams are sent, byte for byte, to the given host and port, and
+ *  with --keyboard the captured keyboard lines are written to stdout, so that
+ *      ./t-chat-replay --keyboard capture localhost 4000 | ./t-chat 4000 localhost 5000
+ *  drives both ends of the pipeline the capture came from. Records keep their
+ *  recorded spacing divided by --speed, or are sent back to back with --max;
+ *  datagrams that are due together go out in one sendmmsg call. Sealed
+ *  datagrams need the same --psk on the receiving side, and are only accepted
+ *  once per session, so replay into a freshly started instance.
+ *
+ *  The summary goes to stderr, out of the way of the replayed lines.
+ */
+
+#define REPLAY_BATCH 64
+
+// Static variables
+static double speed = 1;
+static bool max_speed = false;
+static bool keyboard = false;
+static int source_port = 0;
+
+static uint8_t batch[REPLAY_BATCH][RECORD_MAX_LENGTH];
+static struct iovec iovecs[REPLAY_BATCH];
+static struct mmsghdr msgs[REPLAY_BATCH];
+static int batch_size = 0;
+
+static uint64_t datagrams_sent = 0;
+static uint64_t datagrams_failed = 0;
+static uint64_t datagrams_skipped = 0;
+static uint64_t lines_written = 0;
+static uint64_t max_late_ns = 0;    // Furthest a record fell behind its schedule
+
+static const struct option long_options[] = {
+    {"speed",    required_argument, NULL, 'x'},
+    {"max",      no_argument,       NULL, 'm'},
+    {"keyboard", no_argument,       NULL, 'k'},
+    {"port",     required_argument, NULL, 'p'},
+    {"help",     no_argument,       NULL, 'h'},
+    {NULL,       0,                 NULL, 0}
+};
+
+static void usage() {
+    printf("Usage: ./t-chat-replay [options] [capture] [remote machine name] [remote port number]\n");
+    printf("Sends the datagrams in a --record capture to a t-chat instance, e.g.\n");
+    printf("  ./t-chat-replay --speed 2 burst.cap localhost 4000\n");
+    printf("  ./t-chat-replay --keyboard burst.cap localhost 4000 | ./t-chat 4000 localhost 5000\n");
+    printf("Options:\n");
+    printf("  -x, --speed <factor>      Replay factor times faster than recorded (default 1)\n");
+    printf("  -m, --max                 Replay as fast as possible\n");
+    printf("  -k, --keyboard            Write the captured keyboard lines to stdout\n");
+    printf("  -p, --port <port>         Send datagrams from this local port (default any)\n");
+    printf("  -h, --help                Show this message\n");
+}
+
+static double parse_number(const char *arg, const char *name, double max) {
+    char *end;
+    double value = strtod(arg, &end);
+
+    if (*end != '\0' || end == arg || value <= 0 || value > max) {
+        printf("Invalid %s: %s\n", name, arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec deadline = { deadline_ns / 1000000000, deadline_ns % 1000000000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+static uint16_t load16_be(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | (uint16_t)p[1];
+}
+
+static uint64_t load64_be(const uint8_t *p) {
+    uint64_t v = 0;
+
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+// Resolve host and port and open a socket to send to them from
+static int open_socket(const char *host, const char *port, struct sockaddr_storage *dest, socklen_t *dest_length) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *result;
+    int status = getaddrinfo(host, port, &hints, &result);
+
+    if (status != 0) {
+        printf("Failed to resolve %s:%s: %s\n", host, port, gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(dest, result->ai_addr, result->ai_addrlen);
+    *dest_length = result->ai_addrlen;
+
+    int socket_fd = socket(result->ai_family, SOCK_DGRAM, 0);
+
+    if (socket_fd < 0) {
+        printf("socket: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (source_port != 0) {
+        struct sockaddr_storage local = { .ss_family = result->ai_family };
+
+        if (result->ai_family == AF_INET6) {
+            ((struct sockaddr_in6 *)&local)->sin6_port = htons(source_port);
+        } else {
+            ((struct sockaddr_in *)&local)->sin_port = htons(source_port);
+        }
+
+        if (bind(socket_fd, (struct sockaddr *)&local, result->ai_addrlen) < 0) {
+            printf("Failed to bind port %d: %s\n", source_port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    freeaddrinfo(result);
+
+    return socket_fd;
+}
+
+// Send the datagrams collected so far
+static void send_batch(int socket_fd) {
+    int sent = 0;
+
+    while (sent < batch_size) {
+        int result = sendmmsg(socket_fd, msgs + sent, batch_size - sent, 0);
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // Count the datagram that failed and carry on with the rest
+            datagrams_failed++;
+            sent++;
+            continue;
+        }
+
+        datagrams_sent += result;
+        sent += result;
+    }
+
+    batch_size = 0;
+}
+
+static void print_report(uint64_t records, uint64_t elapsed_ns, uint64_t recorded_ns) {
+    fprintf(stderr, "Replayed %llu records in %.3f s (recorded over %.3f s)\n",
+        (unsigned long long)records, elapsed_ns / 1e9, recorded_ns / 1e9);
+    fprintf(stderr, "  datagrams sent    %llu\n", (unsigned long long)datagrams_sent);
+    fprintf(stderr, "  datagrams failed  %llu\n", (unsigned long long)datagrams_failed);
+    fprintf(stderr, "  datagrams skipped %llu\n", (unsigned long long)datagrams_skipped);
+    fprintf(stderr, "  lines written     %llu\n", (unsigned long long)lines_written);
+
+    if (!max_speed) {
+        fprintf(stderr, "  furthest behind   %.3f ms\n", max_late_ns / 1e6);
+    }
+}
+
+int main (int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "+x:mkp:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'x':
+                speed = parse_number(optarg, "speed", 1e6);
+                break;
+            case 'm':
+                max_speed = true;
+                break;
+            case 'k':
+                keyboard = true;
+                break;
+            case 'p':
+                source_port = (int)parse_number(optarg, "port", 65535);
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    int positional = argc - optind;
+
+    if (positional != 1 && positional != 3) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *capture = fopen(argv[optind], "rb");
+    uint8_t header[RECORD_HEADER_LENGTH];
+
+    if (capture == NULL) {
+        printf("Failed to open %s: %s\n", argv[optind], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (fread(header, 1, sizeof(header), capture) != sizeof(header) || memcmp(header, RECORD_MAGIC, 8) != 0) {
+        printf("%s is not a t-chat capture\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Without a destination only the keyboard lines are replayed
+    int socket_fd = -1;
+    struct sockaddr_storage dest;
+    socklen_t dest_length = 0;
+
+    if (positional == 3) {
+        socket_fd = open_socket(argv[optind + 1], argv[optind + 2], &dest, &dest_length);
+    }
+
+    for (int i = 0; i < REPLAY_BATCH; i++) {
+        iovecs[i].iov_base = batch[i];
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &dest;
+        msgs[i].msg_hdr.msg_namelen = dest_length;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t records = 0;
+    uint64_t recorded_ns = 0;
+    uint8_t prefix[RECORD_PREFIX_LENGTH];
+    static uint8_t line[RECORD_MAX_LENGTH];
+
+    while (fread(prefix, 1, sizeof(prefix), capture) == sizeof(prefix)) {
+        uint64_t at = load64_be(prefix);
+        size_t length = load16_be(prefix + 8);
+        Record_kind kind = prefix[10];
+
+        // Wait for the record's time, sending what is due before sleeping
+        if (!max_speed) {
+            uint64_t due = start + (uint64_t)(at / speed);
+            uint64_t now = now_ns();
+
+            if (due > now) {
+                send_batch(socket_fd);
+                sleep_until(due);
+            } else if (now - due > max_late_ns) {
+                max_late_ns = now - due;
+            }
+        }
+
+        // Read after sending, so that a datagram lands in the batch it goes out with
+        uint8_t *data = kind == RECORD_DATAGRAM && socket_fd >= 0 ? batch[batch_size] : line;
+
+        if (fread(data, 1, length, capture) != length) {
+            fprintf(stderr, "Ignoring a partial record at the end of %s\n", argv[optind]);
+            break;
+        }
+
+        recorded_ns = at;
+        records++;
+
+        if (kind == RECORD_DATAGRAM) {
+            if (socket_fd < 0) {
+                datagrams_skipped++;
+                continue;
+            }
+
+            iovecs[batch_size].iov_len = length;
+
+            if (++batch_size == REPLAY_BATCH) {
+                send_batch(socket_fd);
+            }
+        } else if (kind == RECORD_LINE) {
+            // Lines are written in order with the datagrams around them
+            send_batch(socket_fd);
+
+            if (keyboard) {
+                fwrite(line, 1, length, stdout);
+                fflush(stdout);
+                lines_written++;
+            }
+        }
+    }
+
+    send_batch(socket_fd);
+    print_report(records, now_ns() - start, recorded_ns);
+
+    fclose(capture);
+
+    if (socket_fd >= 0) {
+        close(socket_fd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "history.h"
+
+// Offline search over a chat log written by ./t-chat --log <file>
+int main (int argc, char* argv[]) {
+    int limit = HISTORY_SEARCH_LIMIT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+n:")) != -1) {
+        if (opt == 'n' && (limit = atoi(optarg)) > 0) {
+            continue;
+        }
+
+        printf("Usage: ./t-chat-search [-n max results] [log file] [terms...]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc - optind < 2) {
+        printf("Usage: ./t-chat-search [-n max results] [log file] [terms...]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Join the remaining arguments into one query
+    size_t query_length = 1;
+
+    for (int i = optind + 1; i < argc; i++) {
+        query_length += strlen(argv[i]) + 1;
+    }
+
+    char *query = calloc(query_length, 1);
+
+    if (query == NULL) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = optind + 1; i < argc; i++) {
+        strcat(query, argv[i]);
+        strcat(query, " ");
+    }
+
+    History_open(argv[optind], true);
+    History_search(query, limit, stdout);
+    History_close();
+
+    free(query);
+
+    return 0;
+}
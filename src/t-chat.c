@@ -2,56 +2,93 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "list.h"
+#include "crypto.h"
+#include "daemon.h"
+#include "history.h"
 #include "network.h"
+#include "options.h"
+#include "record.h"
+#include "sanitize.h"
+#include "stats.h"
+#include "trace.h"
 #include "ui.h"
+#include "waiter.h"
 
-// Static Lists
-static List *recv_list;
-static List *send_list;
+int main (int argc, char* argv[]) {
+    Options_parse(argc, argv);
 
-// Prototypes
-static void create_lists();
-static void free_lists();
+    // Thread timeline, written at exit
+    if (Options_get()->trace_path != NULL) {
+        Trace_start(Options_get()->trace_path);
+    }
+
+    // Traffic capture for t-chat-replay (after --trace, whose signal handler it chains to)
+    if (Options_get()->record_path != NULL) {
+        Record_start(Options_get()->record_path);
+    }
+
+    // Counters on SIGUSR1 and in --stats-file (before any other thread starts)
+    Stats_start(Options_get()->stats_path, Options_get()->stats_interval_ms);
+
+    // Encryption
+    if (Options_get()->psk_path != NULL) {
+        Crypto_load_key(Options_get()->psk_path);
+    }
+
+    // Pick the kernel that escapes control characters in received text
+    Sanitize_init();
+
+    // Spin before parking in --low-latency mode
+    Waiter_configure((uint64_t)Options_get()->spin_usec * 1000);
 
-int main (int argc, char* argv[]) {
     // Network startup
-    Network_check_args(argc, argv);
-    Network_connect(argv);
+    Network_check_args(Options_argc(), Options_argv());
+    Network_connect(Options_argv());
 
-    create_lists();
+    // Chat history
+    if (Options_get()->log_path != NULL) {
+        History_open(Options_get()->log_path, false);
+    }
 
     printf("\nT-chat session started.\n\n");
     
     // Start threads
-    Network_start_chat(recv_list, send_list);
-    Ui_start_chat(recv_list, send_list);
+    Network_start_chat();
+
+    if (Options_get()->daemon_path != NULL) {
+        Daemon_start_chat(Options_get()->daemon_path);
+    } else {
+        Ui_start_chat();
+    }
 
     // Join threads
     Network_join_threads();
-    Ui_join_threads();
+
+    if (Options_get()->daemon_path != NULL) {
+        Daemon_join_threads();
+    } else {
+        Ui_join_threads();
+    }
+
+    // Leave the final counters in --stats-file
+    Stats_stop();
 
     // Cleanup, free, and destroy remnants
     Network_exit_chat();
-    Ui_exit_chat();
+
+    if (Options_get()->daemon_path != NULL) {
+        Daemon_exit_chat();
+    } else {
+        Ui_exit_chat();
+    }
     
     // Free network information
     Network_freeaddrinfo();
 
-    // Free lists
-    free_lists();
+    // Save the search index and close the log
+    History_close();
 
     printf("\nT-chat session closed.\n");
 
     return 0;
 }
-
-static void create_lists() {
-    recv_list = List_create();
-    send_list = List_create();
-}
-
-static void free_lists() {
-    List_free(recv_list, free);
-    List_free(send_list, free);
-}
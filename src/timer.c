@@ -0,0 +1,133 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "timer.h"
+
+// Start an empty wheel at tick now
+void Timer_wheel_init(Timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Timer *head = &wheel->slots[level][slot];
+            head->next = head;
+            head->previous = head;
+        }
+    }
+}
+
+// Prepare a timer that calls fn(timer, arg) when it expires
+void Timer_init(Timer *timer, TIMER_FN fn, void *arg) {
+    timer->next = NULL;
+    timer->previous = NULL;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+// File timer in the slot its expiry falls in
+static void place(Timer_wheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= ((uint64_t)TIMER_SLOTS << (level * TIMER_LEVEL_BITS))) {
+        level++;
+    }
+
+    // Past the last level, wait in its furthest slot and be filed again from there
+    uint64_t expires = timer->expires;
+    uint64_t span = (uint64_t)TIMER_SLOTS << (level * TIMER_LEVEL_BITS);
+
+    if (delta >= span) {
+        expires = wheel->now + span - 1;
+    }
+
+    // Due or overdue timers go in the next tick's slot
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    }
+
+    Timer *head = &wheel->slots[level][(expires >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1)];
+
+    timer->next = head;
+    timer->previous = head->previous;
+    head->previous->next = timer;
+    head->previous = timer;
+}
+
+// Schedule timer for tick expires (rescheduling it if it is pending)
+void Timer_add(Timer_wheel *wheel, Timer *timer, uint64_t expires) {
+    Timer_cancel(timer);
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+// Unschedule timer if it is pending
+void Timer_cancel(Timer *timer) {
+    if (timer->next == NULL) {
+        return;
+    }
+
+    timer->previous->next = timer->next;
+    timer->next->previous = timer->previous;
+    timer->next = NULL;
+    timer->previous = NULL;
+}
+
+// True if timer is scheduled
+bool Timer_pending(const Timer *timer) {
+    return timer->next != NULL;
+}
+
+// Move every timer in a slot to a private list headed by list
+static void take_slot(Timer *head, Timer *list) {
+    if (head->next == head) {
+        list->next = list;
+        list->previous = list;
+        return;
+    }
+
+    list->next = head->next;
+    list->previous = head->previous;
+    list->next->previous = list;
+    list->previous->next = list;
+    head->next = head;
+    head->previous = head;
+}
+
+// Run every timer that expires up to tick now. Callbacks may add or cancel timers.
+void Timer_advance(Timer_wheel *wheel, uint64_t now) {
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // Each time a level's slot index wraps, refile the next slot of the level above
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            uint64_t mask = ((uint64_t)1 << (level * TIMER_LEVEL_BITS)) - 1;
+
+            if ((wheel->now & mask) != 0) {
+                break;
+            }
+
+            Timer list;
+            take_slot(&wheel->slots[level][(wheel->now >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1)], &list);
+
+            while (list.next != &list) {
+                Timer *timer = list.next;
+
+                list.next = timer->next;
+                timer->next->previous = &list;
+                place(wheel, timer);
+            }
+        }
+
+        Timer list;
+        take_slot(&wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)], &list);
+
+        while (list.next != &list) {
+            Timer *timer = list.next;
+
+            Timer_cancel(timer);
+            timer->fn(timer, timer->arg);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ *  Hierarchical timer wheel.
+ *
+ *  Time is counted in ticks. Level 0 has one slot per tick for the next
+ *  TIMER_SLOTS ticks, level 1 one slot per TIMER_SLOTS ticks, and so on. A timer
+ *  is filed in the coarsest level it fits and cascades to finer levels as its
+ *  expiry approaches, so adding, cancelling and expiring a timer are O(1)
+ *  however many are pending.
+ */
+
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct Timer_s Timer;
+typedef void (*TIMER_FN)(Timer *timer, void *arg);
+
+struct Timer_s {
+    Timer *next;
+    Timer *previous;
+    uint64_t expires;       // Tick at which fn runs
+    TIMER_FN fn;
+    void *arg;
+};
+
+typedef struct Timer_wheel_s Timer_wheel;
+struct Timer_wheel_s {
+    uint64_t now;           // Last tick processed
+    Timer slots[TIMER_LEVELS][TIMER_SLOTS]; // List heads
+};
+
+// Prototypes
+void Timer_wheel_init(Timer_wheel *wheel, uint64_t now);
+void Timer_init(Timer *timer, TIMER_FN fn, void *arg);
+void Timer_add(Timer_wheel *wheel, Timer *timer, uint64_t expires);
+void Timer_cancel(Timer *timer);
+bool Timer_pending(const Timer *timer);
+void Timer_advance(Timer_wheel *wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,308 @@
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct Trace_event_s Trace_event;
+struct Trace_event_s {
+    const char *name;
+    uint64_t start_ns;  // Since the trace started
+    int64_t value;      // Duration of a span, or the sample of a counter
+    bool is_counter;
+};
+
+typedef struct Trace_buffer_s Trace_buffer;
+struct Trace_buffer_s {
+    pid_t tid;
+    const char *name;   // Set atomically by Trace_thread
+    uint32_t count;     // Finished events, published with a release store
+    uint64_t dropped;
+    Trace_event events[TRACE_MAX_EVENTS];
+};
+
+// Static variables
+static bool enabled = false;
+static bool flushed = false;
+static int trace_fd = -1;
+static uint64_t origin_ns;
+
+static Trace_buffer *buffers[TRACE_MAX_THREADS];
+static int num_buffers = 0;
+
+static __thread Trace_buffer *local = NULL;
+static __thread bool local_failed = false;
+
+// Output buffer of the writer, which sticks to async-signal-safe calls
+static char out[65536];
+static size_t out_length = 0;
+
+static uint64_t now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The calling thread's buffer, created on first use. NULL if there are no slots left.
+static Trace_buffer *local_buffer() {
+    if (local != NULL || local_failed) {
+        return local;
+    }
+
+    int index = __atomic_fetch_add(&num_buffers, 1, __ATOMIC_RELAXED);
+    Trace_buffer *buffer = index < TRACE_MAX_THREADS ? calloc(1, sizeof(Trace_buffer)) : NULL;
+
+    if (buffer == NULL) {
+        local_failed = true;
+        return NULL;
+    }
+
+    buffer->tid = syscall(SYS_gettid);
+    buffer->name = "thread";
+    __atomic_store_n(&buffers[index], buffer, __ATOMIC_RELEASE);
+
+    return local = buffer;
+}
+
+static void record(const char *name, uint64_t start_ns, int64_t value, bool is_counter) {
+    Trace_buffer *buffer = local_buffer();
+
+    if (buffer == NULL) {
+        return;
+    }
+
+    if (buffer->count == TRACE_MAX_EVENTS) {
+        __atomic_fetch_add(&buffer->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    Trace_event *event = &buffer->events[buffer->count];
+
+    event->name = name;
+    event->start_ns = start_ns - origin_ns;
+    event->value = value;
+    event->is_counter = is_counter;
+
+    __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+}
+
+static void flush_out() {
+    size_t written = 0;
+
+    while (written < out_length) {
+        ssize_t bytes = write(trace_fd, out + written, out_length - written);
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        written += bytes;
+    }
+
+    out_length = 0;
+}
+
+static void put_char(char c) {
+    if (out_length == sizeof(out)) {
+        flush_out();
+    }
+
+    out[out_length++] = c;
+}
+
+static void put_raw(const char *s) {
+    for (; *s != '\0'; s++) {
+        put_char(*s);
+    }
+}
+
+// Write a string as the inside of a JSON string
+static void put_string(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            put_char('\\');
+        }
+
+        put_char((unsigned char)*s < 0x20 ? ' ' : *s);
+    }
+}
+
+static void put_u64(uint64_t n) {
+    char digits[20];
+    int length = 0;
+
+    do {
+        digits[length++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+
+    while (length > 0) {
+        put_char(digits[--length]);
+    }
+}
+
+static void put_i64(int64_t n) {
+    if (n < 0) {
+        put_char('-');
+        put_u64(-(uint64_t)n);
+    } else {
+        put_u64(n);
+    }
+}
+
+// Nanoseconds as the microseconds trace events use, keeping nanosecond precision
+static void put_usec(uint64_t ns) {
+    put_u64(ns / 1000);
+    put_char('.');
+    put_char('0' + ns / 100 % 10);
+    put_char('0' + ns / 10 % 10);
+    put_char('0' + ns % 10);
+}
+
+// Start an event of the given phase and thread, up to its timestamp or arguments
+static void put_event(const char *name, const char *phase, pid_t tid, bool first) {
+    put_raw(first ? "\n" : ",\n");
+    put_raw("{\"name\":\"");
+    put_string(name);
+    put_raw("\",\"ph\":\"");
+    put_string(phase);
+    put_raw("\",\"pid\":");
+    put_u64(getpid());
+    put_raw(",\"tid\":");
+    put_u64(tid);
+}
+
+static void on_signal(int signum) {
+    Trace_flush();
+
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+// Begin tracing to path, which is written at exit or when SIGINT or SIGTERM arrives
+void Trace_start(const char *path) {
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("Failed to open trace file %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    origin_ns = now_ns();
+    enabled = true;
+
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (atexit(Trace_flush) != 0) {
+        printf("Failed to register the trace writer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write every thread's events to the trace file. Only the first call writes; it
+// is async-signal-safe and may run while other threads are still recording.
+void Trace_flush() {
+    if (!enabled || __atomic_exchange_n(&flushed, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    int count = __atomic_load_n(&num_buffers, __ATOMIC_ACQUIRE);
+    uint64_t dropped = 0;
+    bool first = true;
+
+    count = count < TRACE_MAX_THREADS ? count : TRACE_MAX_THREADS;
+
+    put_raw("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    put_event("process_name", "M", getpid(), first);
+    put_raw(",\"args\":{\"name\":\"t-chat\"}}");
+    first = false;
+
+    for (int i = 0; i < count; i++) {
+        Trace_buffer *buffer = __atomic_load_n(&buffers[i], __ATOMIC_ACQUIRE);
+
+        if (buffer == NULL) {
+            continue;
+        }
+
+        uint32_t events = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+
+        put_event("thread_name", "M", buffer->tid, first);
+        put_raw(",\"args\":{\"name\":\"");
+        put_string(__atomic_load_n(&buffer->name, __ATOMIC_RELAXED));
+        put_raw("\"}}");
+
+        for (uint32_t j = 0; j < events; j++) {
+            Trace_event *event = &buffer->events[j];
+
+            put_event(event->name, event->is_counter ? "C" : "X", buffer->tid, first);
+            put_raw(",\"ts\":");
+            put_usec(event->start_ns);
+
+            if (event->is_counter) {
+                put_raw(",\"args\":{\"depth\":");
+                put_i64(event->value);
+                put_raw("}}");
+            } else {
+                put_raw(",\"dur\":");
+                put_usec(event->value);
+                put_raw("}");
+            }
+        }
+
+        dropped += __atomic_load_n(&buffer->dropped, __ATOMIC_RELAXED);
+    }
+
+    put_raw("\n],\"otherData\":{\"dropped_events\":\"");
+    put_u64(dropped);
+    put_raw("\"}}\n");
+
+    flush_out();
+    close(trace_fd);
+}
+
+// True if --trace is on
+bool Trace_enabled() {
+    return enabled;
+}
+
+// Name the calling thread in the trace
+void Trace_thread(const char *name) {
+    Trace_buffer *buffer = enabled ? local_buffer() : NULL;
+
+    if (buffer != NULL) {
+        __atomic_store_n(&buffer->name, name, __ATOMIC_RELAXED);
+    }
+}
+
+// Start time of a span, to be passed to Trace_end (0 if tracing is off)
+uint64_t Trace_begin() {
+    return enabled ? now_ns() : 0;
+}
+
+// Record a span from start (a Trace_begin result) until now
+void Trace_end(const char *name, uint64_t start) {
+    if (start != 0) {
+        record(name, start, now_ns() - start, false);
+    }
+}
+
+// Record a sample of a queue depth
+void Trace_counter(const char *name, int64_t value) {
+    if (enabled) {
+        record(name, now_ns(), value, true);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ *  Opt-in thread timeline (--trace <file>).
+ *
+ *  Every thread appends spans and counter samples to its own buffer without
+ *  taking a lock; only that thread writes it, and the number of finished events
+ *  is published with a release store. At exit, or when SIGINT or SIGTERM ends
+ *  the program, the buffers are written as Chrome trace-event JSON, which
+ *  Perfetto (ui.perfetto.dev) and chrome://tracing open directly.
+ *
+ *  Names must be string literals (or otherwise live until the trace is written).
+ *  When tracing is off every call returns after a single load. Waits on mutexes
+ *  and condition variables are recorded by Stats_lock and Stats_cond_wait.
+ */
+
+#define TRACE_MAX_THREADS 64
+#define TRACE_MAX_EVENTS (1 << 17) // Per thread; later events are counted and dropped
+
+// Prototypes
+void Trace_start(const char *path);
+void Trace_flush();
+bool Trace_enabled();
+void Trace_thread(const char *name);
+uint64_t Trace_begin();
+void Trace_end(const char *name, uint64_t start);
+void Trace_counter(const char *name, int64_t value);
+
+#endif
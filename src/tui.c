@@ -0,0 +1,751 @@
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "scrollback.h"
+#include "stats.h"
+#include "trace.h"
+#include "tui.h"
+#include "waiter.h"
+
+#define TUI_INPUT_LENGTH 1024
+#define TUI_ENTER "\x1b[?1049h\x1b[2J"      // Alternate screen, cleared
+#define TUI_LEAVE "\x1b[0m\x1b[?25h\x1b[?1049l"
+
+// Cell attributes
+#define ATTR_NORMAL 0
+#define ATTR_BOLD 1     // Sent lines
+#define ATTR_DIM 2      // System lines
+#define ATTR_REVERSE 3  // Status bar
+
+static const char *attr_codes[] = { "\x1b[0m", "\x1b[0;1m", "\x1b[0;2m", "\x1b[0;7m" };
+
+typedef struct Cell_s Cell;
+struct Cell_s {
+    uint8_t bytes[4];   // One UTF-8 character
+    uint8_t length;     // 0 marks a cell whose contents on the terminal are unknown
+    uint8_t attr;
+};
+
+// Static variables
+static bool enabled = false;
+static int tty_fd = -1;         // The terminal, which stdout no longer points to
+static int capture_fd = -1;     // Read end of the pipe that stdout writes to
+static struct termios saved_termios;
+static struct sigaction previous_int;
+static struct sigaction previous_term;
+
+static pthread_t render_pthread;
+static pthread_t capture_pthread;
+static pthread_mutex_t tui_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tui_cond = PTHREAD_COND_INITIALIZER;
+
+// Guarded by tui_mutex
+static bool following = true;   // The newest line is at the bottom of the pane
+static uint64_t view = 0;       // Otherwise, the scrollback line that is
+static uint64_t page = 1;       // Lines Page Up and Page Down move, one less than were drawn
+static char input[TUI_INPUT_LENGTH];
+static size_t input_length = 0;
+static bool dirty = false;      // Something changed since the last frame
+static bool redraw = false;     // Clear the terminal and draw every cell in the next frame
+static bool running = false;
+
+// Render thread only
+static Cell *shown = NULL;      // What the terminal shows
+static Cell *frame = NULL;      // The frame being built
+static int rows = 0;
+static int cols = 0;
+static char *out = NULL;
+static size_t out_length = 0;
+static char text[sizeof(TUI_PROMPT) + SCROLLBACK_LINE_LENGTH];
+
+// write() all of length bytes to the terminal (async-signal-safe)
+static void write_tty(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = write(tty_fd, data, length);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return;
+        }
+
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+// Leave the alternate screen and cooked mode (async-signal-safe)
+static void restore_terminal() {
+    write_tty(TUI_LEAVE, strlen(TUI_LEAVE));
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+}
+
+// Give the terminal back, then let the signal do what it did before
+static void on_signal(int signum) {
+    restore_terminal();
+    sigaction(signum, signum == SIGINT ? &previous_int : &previous_term, NULL);
+    raise(signum);
+}
+
+// Restore the terminal if the program exits with the interface still up, and
+// show what was printed on the way out
+static void restore_at_exit() {
+    char buffer[4096];
+    ssize_t bytes;
+
+    if (!enabled) {
+        return;
+    }
+
+    restore_terminal();
+    fflush(stdout);
+    dup2(tty_fd, STDOUT_FILENO);
+    fcntl(capture_fd, F_SETFL, O_NONBLOCK);
+
+    while ((bytes = read(capture_fd, buffer, sizeof(buffer))) > 0) {
+        write_tty(buffer, bytes);
+    }
+}
+
+// Mark the screen out of date and wake the renderer (call with tui_mutex held)
+static void changed() {
+    dirty = true;
+    pthread_cond_signal(&tui_cond);
+}
+
+// Scrollback notification: a line was added
+static void refresh() {
+    pthread_mutex_lock(&tui_mutex);
+    {
+        changed();
+    }
+    pthread_mutex_unlock(&tui_mutex);
+}
+
+/*
+ * Screen model
+ */
+
+// Decode the character at s into cell, replacing malformed UTF-8 and control
+// characters. Returns the bytes consumed.
+static size_t decode(const char *s, Cell *cell, uint8_t attr) {
+    const uint8_t *p = (const uint8_t *)s;
+    size_t n = p[0] < 0x80 ? 1 : p[0] >= 0xc2 && p[0] <= 0xdf ? 2 : p[0] >= 0xe0 && p[0] <= 0xef ? 3 : p[0] >= 0xf0 && p[0] <= 0xf4 ? 4 : 0;
+
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            n = 0;
+        }
+    }
+
+    cell->attr = attr;
+
+    if (n == 0) {
+        memcpy(cell->bytes, "\xef\xbf\xbd", 3);
+        cell->length = 3;
+        return 1;
+    }
+
+    if (n == 1 && (p[0] < 0x20 || p[0] == 0x7f)) {
+        cell->bytes[0] = '?';
+    } else {
+        memcpy(cell->bytes, p, n);
+    }
+
+    cell->length = n;
+
+    return n;
+}
+
+static void put(int row, int col, const Cell *cell) {
+    if (row >= 0 && row < rows && col >= 0 && col < cols) {
+        frame[row * cols + col] = *cell;
+    }
+}
+
+// Lay text out from row top, wrapping at the right edge, drawing the rows that
+// fall in [0, limit). Returns the number of rows the text takes.
+static int draw_text(const char *text, uint8_t attr, int top, int limit) {
+    Cell space = { {' '}, 1, attr };
+    int row = 0;
+    int col = 0;
+
+    for (const char *p = text; *p != '\0' && *p != '\n';) {
+        Cell cell;
+
+        if (col == cols) {
+            row++;
+            col = 0;
+        }
+
+        // Tabs stop every 8 columns
+        if (*p == '\t') {
+            do {
+                if (top + row < limit) {
+                    put(top + row, col, &space);
+                }
+            } while (++col % 8 != 0 && col < cols);
+
+            p++;
+            continue;
+        }
+
+        p += decode(p, &cell, attr);
+
+        if (top + row < limit) {
+            put(top + row, col, &cell);
+        }
+
+        col++;
+    }
+
+    return row + 1;
+}
+
+// Write text into a row from col on, returning the column after it
+static int draw_row(int row, int col, const char *text, uint8_t attr) {
+    for (const char *p = text; *p != '\0' && col < cols; col++) {
+        Cell cell;
+
+        p += decode(p, &cell, attr);
+        put(row, col, &cell);
+    }
+
+    return col;
+}
+
+static uint8_t line_attr(Scrollback_kind kind) {
+    return kind == SCROLLBACK_SENT ? ATTR_BOLD : kind == SCROLLBACK_SYSTEM ? ATTR_DIM : ATTR_NORMAL;
+}
+
+// Build the next frame: scrollback pane, status bar and input line (call with
+// tui_mutex held). Returns the column of the input cursor.
+static int compose() {
+    Cell blank = { {' '}, 1, ATTR_NORMAL };
+    int pane = rows - 2;
+    size_t prompt = strlen(TUI_PROMPT);
+    uint64_t oldest = Scrollback_first();
+    uint64_t newest = Scrollback_end();
+
+    for (int i = 0; i < rows * cols; i++) {
+        frame[i] = blank;
+    }
+
+    // Lines evicted while the view was on them are replaced by the oldest kept
+    if (!following && view < oldest) {
+        view = oldest;
+    }
+
+    if (!following && view + 1 >= newest) {
+        following = true;
+    }
+
+    // The view's line at the bottom of the pane, older ones above it, so only
+    // the lines on screen are looked at
+    uint64_t below = following ? newest : view + 1;
+    uint64_t drawn = 0;
+    int bottom = pane;
+
+    memcpy(text, TUI_PROMPT, prompt);
+
+    for (uint64_t index = below; index > oldest && bottom > 0; index--) {
+        Scrollback_kind kind;
+
+        if (!Scrollback_get(index - 1, text + prompt, sizeof(text) - prompt, &kind)) {
+            break;
+        }
+
+        // Sent lines keep the prompt they were typed after
+        const char *line = kind == SCROLLBACK_SENT ? text : text + prompt;
+        uint8_t attr = line_attr(kind);
+
+        bottom -= draw_text(line, attr, 0, 0);
+        draw_text(line, attr, bottom, pane);
+        drawn++;
+    }
+
+    page = drawn > 1 ? drawn - 1 : 1;
+
+    if (pane >= 0) {
+        char status[256];
+        Cell bar = { {' '}, 1, ATTR_REVERSE };
+
+        if (!following) {
+            snprintf(status, sizeof(status), " t-chat | line %llu of %llu | %llu new below (End returns)",
+                (unsigned long long)below, (unsigned long long)newest, (unsigned long long)(newest - below));
+        } else {
+            snprintf(status, sizeof(status), " t-chat | %llu lines | PgUp/PgDn scroll, Ctrl+D quits", (unsigned long long)(newest - oldest));
+        }
+
+        for (int col = 0; col < cols; col++) {
+            put(pane, col, &bar);
+        }
+
+        draw_row(pane, 0, status, ATTR_REVERSE);
+    }
+
+    // The input line shows the end of what is being typed, leaving room for the cursor
+    size_t characters = 0;
+    size_t room = cols > (int)strlen(TUI_PROMPT) + 1 ? cols - strlen(TUI_PROMPT) - 1 : 0;
+    const char *start = input;
+
+    input[input_length] = '\0';
+
+    for (size_t i = 0; i < input_length; i++) {
+        characters += (input[i] & 0xc0) != 0x80;
+    }
+
+    for (; characters > room; characters--) {
+        do {
+            start++;
+        } while ((*start & 0xc0) == 0x80);
+    }
+
+    int col = draw_row(rows - 1, 0, TUI_PROMPT, ATTR_NORMAL);
+
+    return draw_row(rows - 1, col, start, ATTR_NORMAL);
+}
+
+// Follow the terminal's size, reallocating the grids and forcing a full redraw
+// when it changes
+static void check_size() {
+    struct winsize size;
+
+    if (ioctl(tty_fd, TIOCGWINSZ, &size) < 0 || size.ws_row == 0 || size.ws_col == 0) {
+        size.ws_row = 24;
+        size.ws_col = 80;
+    }
+
+    if (size.ws_row == rows && size.ws_col == cols) {
+        return;
+    }
+
+    rows = size.ws_row;
+    cols = size.ws_col;
+
+    free(shown);
+    free(frame);
+    free(out);
+
+    // Worst case per cell: a cursor move, an attribute change and 4 bytes
+    shown = calloc(rows * cols, sizeof(Cell));
+    frame = calloc(rows * cols, sizeof(Cell));
+    out = malloc(rows * cols * 32 + 256);
+
+    if (shown == NULL || frame == NULL || out == NULL) {
+        restore_terminal();
+        fprintf(stderr, "Out of memory for a %dx%d terminal\n", cols, rows);
+        exit(EXIT_FAILURE);
+    }
+
+    redraw = true;
+}
+
+static void append(const char *data, size_t length) {
+    memcpy(out + out_length, data, length);
+    out_length += length;
+}
+
+// Write the cells of frame that differ from shown, and put the cursor on the
+// input line. Returns the bytes written.
+static size_t flush_frame(int cursor_col) {
+    int at_row = -1;
+    int at_col = -1;
+    int attr = -1;
+    int changes = 0;
+    char move[32];
+
+    out_length = 0;
+    append("\x1b[?25l", 6);
+
+    if (redraw) {
+        append("\x1b[0m\x1b[2J", 8);
+        memset(shown, 0, rows * cols * sizeof(Cell));
+        redraw = false;
+    }
+
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            Cell *next = &frame[row * cols + col];
+            Cell *now = &shown[row * cols + col];
+
+            if (next->length == now->length && next->attr == now->attr && memcmp(next->bytes, now->bytes, next->length) == 0) {
+                continue;
+            }
+
+            if (row != at_row || col != at_col) {
+                append(move, snprintf(move, sizeof(move), "\x1b[%d;%dH", row + 1, col + 1));
+            }
+
+            if (next->attr != attr) {
+                attr = next->attr;
+                append(attr_codes[attr], strlen(attr_codes[attr]));
+            }
+
+            append((const char *)next->bytes, next->length);
+            *now = *next;
+            changes++;
+
+            // Past the last column the terminal's cursor position is uncertain
+            at_row = col + 1 < cols ? row : -1;
+            at_col = col + 1;
+        }
+    }
+
+    if (changes == 0 && cursor_col == at_col) {
+        return 0;
+    }
+
+    if (attr != ATTR_NORMAL && attr != -1) {
+        append(attr_codes[ATTR_NORMAL], strlen(attr_codes[ATTR_NORMAL]));
+    }
+
+    append(move, snprintf(move, sizeof(move), "\x1b[%d;%dH", rows, (cursor_col < cols ? cursor_col : cols - 1) + 1));
+    append("\x1b[?25h", 6);
+    write_tty(out, out_length);
+
+    return out_length;
+}
+
+// Render thread: draws a frame whenever something changed, at most TUI_FPS times a second
+static void *render_run(void *unused) {
+    uint64_t frame_ns = 1000000000 / TUI_FPS;
+
+    Trace_thread("render");
+
+    while (true) {
+        int cursor_col;
+
+        pthread_mutex_lock(&tui_mutex);
+        {
+            if (!dirty && running) {
+                struct timespec deadline;
+
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += TUI_IDLE_MS * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000;
+                deadline.tv_nsec %= 1000000000;
+                pthread_cond_timedwait(&tui_cond, &tui_mutex, &deadline);
+            }
+
+            if (!running) {
+                pthread_mutex_unlock(&tui_mutex);
+                break;
+            }
+
+            check_size();
+            cursor_col = compose();
+            dirty = false;
+        }
+        pthread_mutex_unlock(&tui_mutex);
+
+        uint64_t start = Waiter_now_ns();
+        uint64_t span = Trace_begin();
+        size_t bytes = flush_frame(cursor_col);
+
+        Trace_end("frame", span);
+
+        if (bytes > 0) {
+            Stats_add(STATS_TUI_FRAMES, 1);
+            Stats_add(STATS_TUI_BYTES, bytes);
+        }
+
+        // Whatever arrives before the next frame is due is drawn with it
+        uint64_t next = start + frame_ns;
+        struct timespec due = { next / 1000000000, next % 1000000000 };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+        }
+    }
+
+    return NULL;
+}
+
+// Capture thread: turns what the program prints into system lines
+static void *capture_run(void *unused) {
+    char buffer[4096];
+    size_t used = 0;
+
+    Trace_thread("capture");
+
+    while (true) {
+        ssize_t bytes = read(capture_fd, buffer + used, sizeof(buffer) - 1 - used);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        used += bytes;
+
+        char *start = buffer;
+        char *newline;
+
+        while ((newline = memchr(start, '\n', buffer + used - start)) != NULL) {
+            *newline = '\0';
+            Scrollback_add(SCROLLBACK_SYSTEM, start);
+            start = newline + 1;
+        }
+
+        used -= start - buffer;
+        memmove(buffer, start, used);
+
+        // A line longer than the buffer is shown in pieces
+        if (used == sizeof(buffer) - 1) {
+            buffer[used] = '\0';
+            Scrollback_add(SCROLLBACK_SYSTEM, buffer);
+            used = 0;
+        }
+    }
+
+    if (used > 0) {
+        buffer[used] = '\0';
+        Scrollback_add(SCROLLBACK_SYSTEM, buffer);
+    }
+
+    return NULL;
+}
+
+// Switch the terminal to the split-pane interface. Falls back to the line
+// interface if stdin or stdout is not a terminal.
+void Tui_start() {
+    int fds[2];
+
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        printf("<TUI>   --tui needs a terminal on stdin and stdout, using the line interface\n");
+        return;
+    }
+
+    fflush(stdout);
+
+    if ((tty_fd = dup(STDOUT_FILENO)) < 0 || tcgetattr(STDIN_FILENO, &saved_termios) < 0 || pipe(fds) < 0) {
+        printf("<TUI>   Failed to set up the terminal: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Keys arrive one at a time and unechoed; Ctrl+C still interrupts
+    struct termios raw = saved_termios;
+
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
+        printf("<TUI>   Failed to set up the terminal: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // From here on printf lands in the scrollback
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    capture_fd = fds[0];
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    write_tty(TUI_ENTER, strlen(TUI_ENTER));
+
+    // Chains to the handlers --trace and --record installed, if any
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+
+    if (atexit(restore_at_exit) != 0) {
+        restore_terminal();
+        fprintf(stderr, "Failed to register the terminal cleanup\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Scrollback_start(Options_get()->scrollback_bytes, refresh);
+
+    enabled = true;
+    running = true;
+    redraw = true;
+    dirty = true;
+
+    if (pthread_create(&render_pthread, NULL, render_run, NULL) != 0
+    || pthread_create(&capture_pthread, NULL, capture_run, NULL) != 0) {
+        restore_terminal();
+        fprintf(stderr, "Error creating render or capture thread. Exiting\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Stop drawing and give the terminal and stdout back
+void Tui_stop() {
+    if (!enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&tui_mutex);
+    {
+        running = false;
+        pthread_cond_signal(&tui_cond);
+    }
+    pthread_mutex_unlock(&tui_mutex);
+
+    pthread_join(render_pthread, NULL);
+
+    // Closing the pipe's last write end ends capture_run
+    fflush(stdout);
+    dup2(tty_fd, STDOUT_FILENO);
+    pthread_join(capture_pthread, NULL);
+    close(capture_fd);
+
+    restore_terminal();
+    enabled = false;
+    Scrollback_stop();
+
+    free(shown);
+    free(frame);
+    free(out);
+}
+
+// True while the split-pane interface owns the terminal
+bool Tui_enabled() {
+    return enabled;
+}
+
+// Scroll the view by delta lines (positive is up, towards older lines)
+static void scroll_by(int64_t delta) {
+    uint64_t oldest = Scrollback_first();
+    uint64_t newest = Scrollback_end();
+
+    if (newest == oldest) {
+        return;
+    }
+
+    uint64_t at = following ? newest - 1 : view < oldest ? oldest : view;
+
+    if (delta > 0) {
+        at = at - oldest > (uint64_t)delta ? at - delta : oldest;
+    } else {
+        at = newest - 1 - at > (uint64_t)-delta ? at - delta : newest - 1;
+    }
+
+    view = at;
+    following = at == newest - 1;
+}
+
+// Act on a complete escape sequence (the bytes after ESC)
+static void handle_sequence(const char *sequence) {
+    if (strcmp(sequence, "[5~") == 0) {
+        scroll_by(page);
+    } else if (strcmp(sequence, "[6~") == 0) {
+        scroll_by(-(int64_t)page);
+    } else if (strcmp(sequence, "[A") == 0 || strcmp(sequence, "OA") == 0) {
+        scroll_by(1);
+    } else if (strcmp(sequence, "[B") == 0 || strcmp(sequence, "OB") == 0) {
+        scroll_by(-1);
+    } else if (strcmp(sequence, "[H") == 0 || strcmp(sequence, "OH") == 0 || strcmp(sequence, "[1~") == 0) {
+        scroll_by(INT64_MAX);
+        scroll_by(-(int64_t)page);
+    } else if (strcmp(sequence, "[F") == 0 || strcmp(sequence, "OF") == 0 || strcmp(sequence, "[4~") == 0) {
+        following = true;
+    }
+}
+
+// Edit the input line until Enter, like fgets: the line, with its newline, is
+// stored in buffer. Returns NULL at the end of input or on Ctrl+D on an empty line.
+char *Tui_read_line(char *buffer, int size) {
+    char sequence[8];
+    size_t sequence_length = 0;
+    bool in_escape = false;
+    size_t max_input = (size_t)size - 2 < sizeof(input) - 1 ? (size_t)size - 2 : sizeof(input) - 1;
+
+    while (true) {
+        char c;
+        ssize_t bytes = read(STDIN_FILENO, &c, 1);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&tui_mutex);
+        {
+            if (in_escape) {
+                sequence[sequence_length++] = c;
+
+                // Ends at a final byte, except the '[' or 'O' that introduces it
+                bool introducer = sequence_length == 1 && (c == '[' || c == 'O');
+
+                if (!introducer && ((c >= 0x40 && c <= 0x7e) || sequence_length == sizeof(sequence) - 1)) {
+                    sequence[sequence_length] = '\0';
+                    handle_sequence(sequence);
+                    in_escape = false;
+                }
+            } else if (c == '\x1b') {
+                in_escape = true;
+                sequence_length = 0;
+            } else if (c == '\r' || c == '\n') {
+                memcpy(buffer, input, input_length);
+                buffer[input_length] = '\n';
+                buffer[input_length + 1] = '\0';
+                input_length = 0;
+                following = true;
+                changed();
+                pthread_mutex_unlock(&tui_mutex);
+                return buffer;
+            } else if (c == 0x04 && input_length == 0) {
+                pthread_mutex_unlock(&tui_mutex);
+                return NULL;
+            } else if (c == 0x7f || c == 0x08) {
+                // Remove a whole UTF-8 character
+                while (input_length > 0 && (input[--input_length] & 0xc0) == 0x80) {
+                }
+            } else if (c == 0x15) {
+                input_length = 0;
+            } else if (c == 0x0c) {
+                redraw = true;
+            } else if (((uint8_t)c >= 0x20 || c == '\t') && input_length < max_input) {
+                input[input_length++] = c;
+            }
+
+            changed();
+        }
+        pthread_mutex_unlock(&tui_mutex);
+    }
+}
+
+// Show scrollback line number (counting from 1) at the bottom of the pane. Returns
+// false if it is no longer or not yet in the scrollback.
+bool Tui_jump(uint64_t number) {
+    bool found = false;
+
+    pthread_mutex_lock(&tui_mutex);
+    {
+        if (number > Scrollback_first() && number <= Scrollback_end()) {
+            view = number - 1;
+            following = false;
+            found = true;
+            changed();
+        }
+    }
+    pthread_mutex_unlock(&tui_mutex);
+
+    return found;
+}
@@ -0,0 +1,40 @@
+#ifndef _TUI_H_
+#define _TUI_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ *  Split-pane terminal interface (--tui), in raw termios and ANSI escapes.
+ *
+ *  The terminal is divided into a scrollback pane, a status bar and the input
+ *  line. Received messages, typed lines and everything the program prints
+ *  (stdout is redirected into a pipe that a capture thread reads) are appended
+ *  to the scrollback (scrollback.h), so nothing is written over the line being
+ *  typed. Only the lines in the pane are read from it to draw a frame.
+ *
+ *  A render thread keeps a model of the screen as a grid of cells. It builds
+ *  each frame in a second grid, compares it with the one on the terminal, and
+ *  writes only the cells that changed, in one write(). Frames are at least
+ *  1/TUI_FPS seconds apart, and everything that arrives in between is drawn in
+ *  the next frame, so a burst costs at most one screenful of output per frame
+ *  however many lines it holds.
+ *
+ *  Keys: Enter sends, Backspace and Ctrl+U edit, Page Up/Page Down and the up
+ *  and down arrows scroll, Home goes to the oldest line kept, End returns to the
+ *  newest, Ctrl+L redraws and
+ *  Ctrl+D on an empty line quits. Every character takes one column.
+ */
+
+#define TUI_FPS 60
+#define TUI_IDLE_MS 250         // Longest the renderer sleeps without checking the terminal size
+#define TUI_PROMPT "> "
+
+// Prototypes
+void Tui_start();
+void Tui_stop();
+bool Tui_enabled();
+bool Tui_jump(uint64_t number);
+char *Tui_read_line(char *buffer, int size);
+
+#endif
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -6,60 +8,166 @@
 #include <unistd.h>
 #include <assert.h>
 
-#include "list.h"
+#include "affinity.h"
+#include "channel.h"
+#include "command.h"
+#include "history.h"
 #include "network.h"
+#include "options.h"
+#include "record.h"
+#include "sanitize.h"
+#include "scrollback.h"
+#include "stats.h"
+#include "trace.h"
+#include "tui.h"
 #include "ui.h"
+#include "waiter.h"
+
+#define UI_PASTE_GAP_MS 10  // A line read this soon after the previous one is part of a paste
+#define UI_INPUT_LENGTH (4 * BUFFER_LENGTH) // Bytes read from stdin at a time
 
 // Static variables
 static pthread_t keyboard_pthread;
 static pthread_t screen_pthread;
-static char *newstr = NULL;
+static char input[UI_INPUT_LENGTH]; // Read from stdin but not yet returned as lines
+static size_t input_length = 0;
+
+// Channel callback: put a received line on the screen
+static void show_line(const char *line) {
+    uint64_t span = Trace_begin();
+
+    if (Tui_enabled()) {
+        Scrollback_add(SCROLLBACK_RECEIVED, line);
+    } else if (fputs(line, stdout) == EOF) {
+        printf("Error writing to stdout\n. Exiting.");
+        exit(EXIT_FAILURE);
+    } else {
+        fflush(stdout);
+    }
+
+    Trace_end("fputs", span);
+}
+
+// Read a line from stdin into line, like fgets: at most size - 1 bytes, ending
+// with the newline if it fits. Returns NULL at the end of input, exits on error.
+static char *read_line(char *line, size_t size) {
+    bool at_end = false;
+
+    while (true) {
+        char *newline = memchr(input, '\n', input_length);
+        size_t length = newline != NULL ? (size_t)(newline + 1 - input) : input_length;
+
+        if (length > size - 1) {
+            length = size - 1;
+        }
+
+        // A whole line, as much of a long one as fits, or the rest of the input
+        if (newline != NULL || length == size - 1 || (at_end && length > 0)) {
+            memcpy(line, input, length);
+            line[length] = '\0';
+            input_length -= length;
+            memmove(input, input + length, input_length);
+            return line;
+        }
+
+        if (at_end) {
+            return NULL;
+        }
+
+        ssize_t bytes = read(STDIN_FILENO, input + input_length, sizeof(input) - input_length);
+
+        if (bytes < 0 && errno != EINTR) {
+            printf("Error reading from stdin\n. Exiting.");
+            exit(EXIT_FAILURE);
+        }
+
+        if (bytes >= 0) {
+            input_length += bytes;
+            at_end = bytes == 0;
+        }
+    }
+}
+
+// True if more input is already waiting behind the line just read, as the rest
+// of a paste is: either left over in input, or not read from stdin yet
+static bool input_pending() {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    if (input_length > 0) {
+        return true;
+    }
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
 
 // Keyboard thread
-static void *keyboard_run(void *send_list) {
+static void *keyboard_run(void *unused) {
     char keyboard_buffer[BUFFER_LENGTH] = "";
+    uint64_t last_line_ns = 0;
+
+    Trace_thread("keyboard");
 
     while (true) {
-        newstr = malloc(BUFFER_LENGTH + 1);
-        memset(newstr, '\0', BUFFER_LENGTH + 1);
+        uint64_t span = Trace_begin();
+        char *line = Tui_enabled() ? Tui_read_line(keyboard_buffer, BUFFER_LENGTH) : read_line(keyboard_buffer, BUFFER_LENGTH);
+
+        Trace_end("read line", span);
 
         // Reach end of file
-        if (fgets(keyboard_buffer, BUFFER_LENGTH, stdin) == NULL) {
-            if (ferror(stdin)) {
-                printf("Error reading from stdin\n. Exiting.");
-                exit(EXIT_FAILURE);
-            }
-           
+        if (line == NULL) {
             Network_cancel_pthreads();
             break;
         }
 
-        strcpy(newstr, keyboard_buffer);
-        
-        pthread_mutex_lock(Network_get_send_mutex()); 
+        uint64_t line_ns = Waiter_now_ns();
+        // Pastes go in the bulk lane: a paste's first line is known by the lines
+        // already waiting behind it, its last by how soon it followed the one before
+        bool pasted = input_pending() || (last_line_ns != 0 && line_ns - last_line_ns < UI_PASTE_GAP_MS * 1000000ULL);
+
+        last_line_ns = line_ns;
+
+        Record_add(RECORD_LINE, keyboard_buffer, strlen(keyboard_buffer));
+
+        // The terminal no longer echoes under --tui, so the scrollback shows what was typed
+        Scrollback_add(SCROLLBACK_SENT, keyboard_buffer);
+
+        // Local commands are handled here and never sent
+        if (Command_handle(keyboard_buffer)) {
+            continue;
+        }
+
+        // "!" always goes to the default channel, where it ends the chat
+        uint32_t channel = strcmp(keyboard_buffer, "!\n") == 0 ? 0 : Channel_current();
+        Network_lane lane = strcmp(keyboard_buffer, "!\n") == 0 ? LANE_CONTROL : pasted ? LANE_BULK : LANE_CHAT;
+        bool queued = false;
+
+        Stats_lock(Network_get_send_mutex(), STATS_SEND_MUTEX_NS, "wait send_mutex");
         {
-            if(List_count(send_list) == (LIST_MAX_NUM_NODES / 2)) {
-                printf("List is full! -> %s\n", newstr);
+            if (Network_queue_send(lane, channel, keyboard_buffer, strlen(keyboard_buffer)) < 0) {
+                printf("List is full! -> %s\n", keyboard_buffer);
+                Stats_add(STATS_SEND_LIST_FULL, 1);
             } else {
-                if (List_prepend((List *)send_list, newstr) < 0) {
-                    printf("List_prepend: error\n");
-                }
+                Network_notify_send();
+                queued = true;
             }
         }
         pthread_mutex_unlock(Network_get_send_mutex());
 
-        newstr = NULL;
-
         if (strcmp(keyboard_buffer, "!\n") == 0) {
             pthread_cond_signal(Network_get_send_cond());
             break;
         }
 
-        pthread_mutex_lock(Network_get_send_mutex());
+        // Only what reached a lane goes to the channel's backlog and the log
+        if (queued) {
+            Channel_sent(channel, keyboard_buffer);
+        }
+
+        Stats_lock(Network_get_send_mutex(), STATS_SEND_MUTEX_NS, "wait send_mutex");
         {
-            if(List_count(send_list) != (LIST_MAX_NUM_NODES) / 2) {
+            if (queued) {
                 pthread_cond_signal(Network_get_send_cond());
-                pthread_cond_wait(Network_get_send_cond(), Network_get_send_mutex());
+                Stats_cond_wait(Network_get_send_cond(), Network_get_send_mutex(), STATS_SEND_COND_NS, "sleep send_cond");
             }
         }
         pthread_mutex_unlock(Network_get_send_mutex());
@@ -80,42 +188,28 @@ static void *keyboard_run(void *send_list) {
 }
 
 // Screen thread
-static void *screen_run(void *recv_list) {
-    char screen_buffer[BUFFER_LENGTH] = "";
+static void *screen_run(void *unused) {
+    Trace_thread("screen");
 
     while (true) {
-        pthread_mutex_lock(Network_get_recv_mutex()); 
-        {
-        
-            while (List_count(recv_list) == 0) {
-                pthread_cond_wait(Network_get_recv_cond(), Network_get_recv_mutex());
-            }
+        Message *message;
 
-            strcpy(screen_buffer, List_last((List *)recv_list));
-            free(List_last((List *)recv_list));
-            List_trim((List *)recv_list);
+        Network_lock_received();
+        {
+            // Merge the receive workers' queues
+            message = Network_take_received();
         }
         pthread_mutex_unlock(Network_get_recv_mutex());
 
-        if (fputs(screen_buffer, stdout) == EOF) {
-            printf("Error writing to stdout\n. Exiting.");
-            exit(EXIT_FAILURE);
+        // The peer's "!" is shown whatever channel is current, and ends the chat
+        if (message->channel == 0 && strcmp(message->text, "!\n") == 0) {
+            show_line(message->text);
+            free(message);
             break;
         }
 
-        fflush(stdout);
-
-        if (strcmp(screen_buffer, "!\n") == 0) {
-            pthread_cond_signal(Network_get_recv_cond());
-            break;
-        }
-
-        pthread_mutex_lock(Network_get_recv_mutex()); 
-        {
-            pthread_cond_signal(Network_get_recv_cond());
-            pthread_cond_wait(Network_get_recv_cond(), Network_get_recv_mutex());
-        }
-        pthread_mutex_unlock(Network_get_recv_mutex());
+        // Shown now, or kept until its channel is joined
+        Channel_deliver(message);
     }
 
     int keyboard_cancel_result = 0;
@@ -132,15 +226,26 @@ static void *screen_run(void *recv_list) {
 }
 
 // Helper function to start network threads
-void Ui_start_chat(List *recv_list, List *send_list) {
+void Ui_start_chat() {
     int keyboard_result = 0;
     int screen_result = 0;
 
-    if ((keyboard_result =  pthread_create(&keyboard_pthread, NULL, keyboard_run, send_list)) != 0
-    || (screen_result = pthread_create(&screen_pthread, NULL, screen_run, recv_list)) != 0) {
+    if (Options_get()->tui) {
+        Tui_start();
+    }
+
+    Channel_start(show_line);
+
+    if ((keyboard_result =  pthread_create(&keyboard_pthread, NULL, keyboard_run, NULL)) != 0
+    || (screen_result = pthread_create(&screen_pthread, NULL, screen_run, NULL)) != 0) {
         printf("Error creating keyboard or screen thread. Exiting\n");
         exit(EXIT_FAILURE);
     }
+
+    if (Options_get()->pin) {
+        Affinity_pin(keyboard_pthread, "keyboard");
+        Affinity_pin(screen_pthread, "screen");
+    }
 }
 
 // Helper function that cancels ui threads 
@@ -158,10 +263,7 @@ void Ui_cancel_pthreads() {
 
 // Helper function for freeing
 void Ui_exit_chat() {
-    if (newstr) {
-        free(newstr);
-        newstr = NULL;
-    }
+    Channel_stop();
 }
 
 // Helper function for joining threads
@@ -174,4 +276,6 @@ void Ui_join_threads() {
         printf("Error joining keyboard or screen thread. Exiting\n");
         exit(EXIT_FAILURE);
     }
+
+    Tui_stop();
 }
@@ -0,0 +1,82 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "waiter.h"
+
+// Static variables
+static uint64_t spin_budget_ns = 0;
+
+// Set how long consumers spin before parking (0 parks immediately)
+void Waiter_configure(uint64_t spin_ns) {
+    spin_budget_ns = spin_ns;
+}
+
+// Getter for the spin budget
+uint64_t Waiter_spin_ns() {
+    return spin_budget_ns;
+}
+
+// Monotonic time in nanoseconds
+uint64_t Waiter_now_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Hint to the CPU that this is a spin loop
+void Waiter_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Record that the producer made the site ready (call before signalling)
+void Waiter_notify(Waiter_site *site) {
+    __atomic_store_n(&site->notified_ns, Waiter_now_ns(), __ATOMIC_RELAXED);
+}
+
+// Returns with mutex locked once ready(arg) is true. ready is polled without the
+// mutex while spinning, so it must only do atomic reads.
+void Waiter_lock_until(Waiter_site *site, pthread_mutex_t *mutex, pthread_cond_t *cond, READY_FN ready, void *arg) {
+    bool spun_ready = false;
+
+    if (spin_budget_ns > 0 && !ready(arg)) {
+        uint64_t start = Waiter_now_ns();
+        uint64_t span = Trace_begin();
+        int polls = 0;
+
+        while (!(spun_ready = ready(arg))) {
+            Waiter_relax();
+
+            // Reading the clock costs more than a pause, so only check it now and then
+            if (++polls % 64 == 0 && Waiter_now_ns() - start >= spin_budget_ns) {
+                break;
+            }
+        }
+
+        Trace_end("spin", span);
+        Stats_add(STATS_WAIT_SPIN_NS, Waiter_now_ns() - start);
+        Stats_add(spun_ready ? STATS_WAIT_SPIN_HITS : STATS_WAIT_PARKS, 1);
+    }
+
+    Stats_lock(mutex, site->mutex_blocked, site->lock_span);
+
+    while (!ready(arg)) {
+        Stats_cond_wait(cond, mutex, site->cond_blocked, site->sleep_span);
+    }
+
+    uint64_t notified = __atomic_load_n(&site->notified_ns, __ATOMIC_RELAXED);
+
+    if (notified != 0) {
+        uint64_t now = Waiter_now_ns();
+        Stats_record(site->handoff, now > notified ? now - notified : 0);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _WAITER_H_
+#define _WAITER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/**
+ *  Spin-then-park waits for the queue consumers.
+ *
+ *  By default a consumer parks on its condition variable straight away. With a
+ *  spin budget (--low-latency) it first polls the queue with a pause instruction
+ *  for up to that long, so a message arriving shortly after never pays for a
+ *  futex wakeup.
+ */
+
+typedef bool (*READY_FN)(void *arg);
+
+typedef struct Waiter_site_s Waiter_site;
+struct Waiter_site_s {
+    Stats_histogram handoff; // Records time from Waiter_notify to the consumer waking
+    Stats_counter mutex_blocked; // Accumulate time blocked on the mutex and the condition
+    Stats_counter cond_blocked;
+    const char *lock_span;  // Trace names of waits for the mutex and sleeps on the condition
+    const char *sleep_span;
+    uint64_t notified_ns;
+};
+
+// Prototypes
+void Waiter_configure(uint64_t spin_ns);
+uint64_t Waiter_spin_ns();
+uint64_t Waiter_now_ns();
+void Waiter_relax();
+void Waiter_notify(Waiter_site *site);
+void Waiter_lock_until(Waiter_site *site, pthread_mutex_t *mutex, pthread_cond_t *cond, READY_FN ready, void *arg);
+
+#endif